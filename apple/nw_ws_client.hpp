@@ -7,6 +7,7 @@
 #include "nw_ws_common.hpp"
 #include "../common/ws_client_base.hpp"
 
+#include <cerrno>
 #include <string>
 
 // Apple Network framework-based websocket client
@@ -21,39 +22,133 @@ public:
     
     ~nw_ws_client()
     {
-        if (m_completion.ready())
-            nw_connection_cancel(m_handle);
-        nw_release(m_handle);
-            
+        if (m_handle)
+        {
+            if (!m_completion.closed())
+                nw_connection_cancel(m_handle);
+            nw_release(m_handle);
+        }
+        
         m_completion.wait_for_closed();
+        
+        if (m_stream)
+            nw_release(m_stream);
+    }
+    
+    // Connection state
+    
+    bool ready() { return m_completion.ready(); }
+    
+    // Send (dropped unless ready, and counted as a send failure if dropped or the framework reports an error)
+    
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        if (connected())
+            send_counted(prepare(data, size, opcode));
+    }
+    
+    // Send (gathered into one composed dispatch data object)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        if (connected())
+            send_counted(prepare(buffers, count, opcode));
     }
     
-    // Send
+    // Send one fragment of a message (the first with the message's opcode and the rest as continuations)
+    // No other data messages may be sent until the final fragment
     
-    void send(const void *data, size_t size)
+    void send_fragment(const void *data, size_t size, ws_opcode opcode, bool final)
     {
-        nw_ws_common::send(m_handle, data, size);
+        if (connected())
+            send_counted(message(data, size, opcode, final), &m_stream);
+    }
+    
+    // Send a batch of binary messages
+    
+    void send_batch(const ws_buffer_list *messages, size_t count)
+    {
+        if (connected())
+        {
+            for (size_t i = 0; i < count; i++)
+                m_stats.sent(messages[i].size());
+            
+            nw_ws_common::send_batch(m_handle, messages, count, m_contexts);
+        }
     }
     
 private:
     
+    // Check the client is ready to send (counting a failure if not)
+    
+    bool connected()
+    {
+        if (ready())
+            return true;
+        
+        m_stats.failed();
+        return false;
+    }
+    
+    // Send and count a message, and a failure if the framework reports one (no completion is needed unless counting)
+    
+    void send_counted(const message& data, nw_content_context_t *stream = nullptr)
+    {
+#ifdef WS_STATS
+        ws_stats *stats = &m_stats;
+        
+        stats->sent(data.size(), data.complete() ? 1 : 0);
+        
+        nw_ws_common::send(m_handle, data, ^(nw_error_t _Nullable error)
+        {
+            if (error)
+                stats->failed();
+        }, m_contexts, stream);
+#else
+        nw_ws_common::send(m_handle, data, nullptr, m_contexts, stream);
+#endif
+    }
+    
     // Constructor
     
     template <const ws_client_handlers& handlers>
-    nw_ws_client(const char *host, uint16_t port, const char *path, ws_client_owner<handlers> owner)
+    nw_ws_client(const char *host,
+                 uint16_t port,
+                 const char *path,
+                 ws_client_owner<handlers> owner,
+                 const ws_client_options& options,
+                 bool async)
+    : nw_ws_common(options.m_share_queues ? shared_queue() : nullptr)
     {
         __block connection_completion& completion = m_completion;
+        __block int connect_error = 0;
         
         auto id = as_ws_connection_id(this);
+        auto start = ws_stats::now();
+        ws_stats *stats = &m_stats;
         
         std::string port_str = std::to_string(port);
-        std::string sock_address_url = "ws://" + std::string(host) + ":" + port_str + path;
+        std::string scheme = options.m_tls.m_enable ? "wss://" : "ws://";
+        std::string sock_address_url = scheme + std::string(host) + ":" + port_str + path;
         
         auto endpoint = nw_endpoint_create_url(sock_address_url.c_str());
         
         // Create connection with the correct parameters
         
-        auto parameters = create_websocket_parameters();
+        auto parameters = create_websocket_parameters(options.m_tcp, options.m_tls, options.m_service_class);
+        
+        // Fail if TLS cannot be set up (with no connection to close, so that destroying the client does not wait)
+        
+        if (!parameters)
+        {
+            if constexpr (handlers.m_error != nullptr)
+                handlers.m_error(id, EINVAL, owner.m_owner);
+            
+            nw_release(endpoint);
+            completion.set(completion_modes::closed);
+            return;
+        }
+        
         auto connection = nw_connection_create(endpoint, parameters);
         
         // Hold a reference until cancelled
@@ -71,16 +166,32 @@ private:
                 // Start the receive process
                 
                 completion.set(completion_modes::ready);
-                receive(connection, id, handlers, owner.m_owner);
+                stats->connected(start);
+                receive(connection, id, handlers, owner.m_owner, stats);
+                
+                if constexpr (handlers.m_ready != nullptr)
+                    handlers.m_ready(id, owner.m_owner);
             }
             else if (state == nw_connection_state_waiting)
             {
+                connect_error = errno;
                 nw_connection_cancel(connection);
             }
             else if (state == nw_connection_state_cancelled || state == nw_connection_state_failed)
             {
-                completion.set(completion_modes::closed);
+                // Report a failure to connect
+                
+                if constexpr (handlers.m_error != nullptr)
+                {
+                    if (!completion.completed())
+                        handlers.m_error(id, errno ? errno : connect_error, owner.m_owner);
+                }
+                
+                // Mark closed last, so that no handler can run once the destructor returns
+                
+                stats->closed();
                 handlers.m_close(id, owner.m_owner);
+                completion.set(completion_modes::closed);
                 
                 // Release the primary reference on the connection that was taken at creation time
                 
@@ -88,6 +199,10 @@ private:
             }
         };
         
+        // Publish the handle before the state handler can report ready (sends only use it once ready)
+        
+        m_handle = connection;
+        
         // Set queue, state changed handler
         
         nw_connection_set_queue(connection, m_queue);
@@ -96,7 +211,17 @@ private:
         // Start connection
         
         nw_connection_start(connection);
-        completion.wait_for_completion(nw_ws_connection_timeout_ms);
+        
+        // Return immediately if asynchronous (the state handler reports the outcome)
+        
+        if (async)
+        {
+            nw_release(parameters);
+            nw_release(endpoint);
+            return;
+        }
+        
+        completion.wait_for_completion(options.m_timeout_ms);
         
         // Cancel if timed out
         
@@ -111,15 +236,18 @@ private:
         nw_release(parameters);
         nw_release(endpoint);
         
-        // Store the connection if it is ready, else release
+        // Keep the connection if it is ready, else release it
         
-        if (completion.ready())
-            m_handle = connection;
-        else
+        if (!completion.ready())
+        {
+            m_handle = nullptr;
             nw_release(connection);
+        }
     }
     
     connection_completion m_completion;
+    nw_context_cache m_contexts;
+    nw_content_context_t m_stream = nullptr;
 };
 
 #endif /* NW_WS_CLIENT_HPP */
@@ -3,19 +3,203 @@
 #define NW_WS_COMMON_HPP
 
 #include "Network/Network.h"
+#include <Security/Security.h>
 
 #include "../common/ws_handlers.hpp"
 #include "../common/ws_base.hpp"
+#include "../common/ws_allocator.hpp"
+#include "../common/ws_options.hpp"
+#include "../common/ws_stats.hpp"
+#include "../common/ws_heartbeat.hpp"
+#include "../common/ws_capture.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// A message copied once into dispatch data for sending to any number of connections
+
+class nw_ws_message
+{
+public:
+    
+    nw_ws_message() : m_data(nullptr), m_opcode(ws_opcode::binary), m_complete(true) {}
+    
+    // A message, or a fragment of one if not complete (fragments after the first use the continuation opcode)
+    
+    nw_ws_message(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary, bool complete = true)
+    : m_opcode(opcode)
+    , m_complete(complete)
+    {
+        ws_buffer buffer { data, size };
+        m_data = copy(&buffer, 1);
+    }
+    
+    // Compose a message from a gather list
+    
+    nw_ws_message(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    : m_data(copy(buffers, count))
+    , m_opcode(opcode)
+    , m_complete(true)
+    {}
+    
+    nw_ws_message(const nw_ws_message& other)
+    : m_data(other.m_data)
+    , m_opcode(other.m_opcode)
+    , m_complete(other.m_complete)
+    {
+        if (m_data)
+            dispatch_retain(m_data);
+    }
+    
+    nw_ws_message& operator=(const nw_ws_message& other)
+    {
+        if (other.m_data)
+            dispatch_retain(other.m_data);
+        if (m_data)
+            dispatch_release(m_data);
+        m_data = other.m_data;
+        m_opcode = other.m_opcode;
+        m_complete = other.m_complete;
+        
+        return *this;
+    }
+    
+    ~nw_ws_message()
+    {
+        if (m_data)
+            dispatch_release(m_data);
+    }
+    
+    dispatch_data_t get() const { return m_data; }
+    size_t size() const { return m_data ? dispatch_data_get_size(m_data) : 0; }
+    ws_opcode opcode() const { return m_opcode; }
+    bool complete() const { return m_complete; }
+    bool fragment() const { return !m_complete || m_opcode == ws_opcode::continuation; }
+    
+    // Whether this is a whole data message (so that the coalesce policy may discard it)
+    
+    bool coalescable() const { return !fragment() && !ws_is_control(m_opcode); }
+    
+private:
+    
+    // Gather buffers into a single allocation (from the payload allocator) owned by the dispatch data
+    
+    static dispatch_data_t copy(const ws_buffer *buffers, size_t count)
+    {
+        const ws_allocator& allocator = ws_payload_allocator();
+        bool use_malloc = allocator.is_default();
+        size_t size = 0;
+        
+        for (size_t i = 0; i < count; i++)
+            size += buffers[i].m_size;
+        
+        if (!size)
+            return dispatch_data_empty;
+        
+        auto bytes = static_cast<unsigned char *>(use_malloc ? std::malloc(size) : allocator.allocate(size));
+        
+        for (size_t i = 0, offset = 0; i < count; offset += buffers[i++].m_size)
+            std::memcpy(bytes + offset, buffers[i].m_data, buffers[i].m_size);
+        
+        if (use_malloc)
+            return dispatch_data_create(bytes, size, nullptr, DISPATCH_DATA_DESTRUCTOR_FREE);
+        
+        return dispatch_data_create(bytes, size, nullptr, ^{ ws_payload_allocator().deallocate(bytes, size); });
+    }
+    
+    dispatch_data_t m_data;
+    ws_opcode m_opcode;
+    bool m_complete;
+};
+
+// Send contexts for the complete messages of one connection, one per opcode (created on first use from any thread and
+// released with the connection)
+
+class nw_context_cache
+{
+    static constexpr size_t opcodes = 16;
+    
+public:
+    
+    nw_context_cache() {}
+    
+    ~nw_context_cache()
+    {
+        for (size_t i = 0; i < opcodes; i++)
+        {
+            if (m_contexts[i].load())
+                nw_release(m_contexts[i].load());
+        }
+    }
+    
+    nw_context_cache(const nw_context_cache&) = delete;
+    nw_context_cache& operator=(const nw_context_cache&) = delete;
+    
+    nw_content_context_t get(ws_opcode opcode)
+    {
+        auto& slot = m_contexts[static_cast<size_t>(opcode) & (opcodes - 1)];
+        nw_content_context_t context = slot.load(std::memory_order_acquire);
+        
+        if (context)
+            return context;
+        
+        // Whichever thread loses a race to create the context releases its own
+        
+        nw_content_context_t created = create(opcode);
+        
+        if (slot.compare_exchange_strong(context, created, std::memory_order_acq_rel))
+            return created;
+        
+        nw_release(created);
+        return context;
+    }
+    
+    // Create a context for sending messages with an opcode
+    
+    static nw_content_context_t create(ws_opcode opcode)
+    {
+        nw_protocol_metadata_t metadata = nw_ws_create_metadata(static_cast<nw_ws_opcode_t>(opcode));
+        nw_content_context_t context = nw_content_context_create("send");
+        nw_content_context_set_metadata_for_protocol(context, metadata);
+        nw_release(metadata);
+        
+        return context;
+    }
+    
+private:
+    
+    std::atomic<nw_content_context_t> m_contexts[opcodes] = {};
+};
+
+// Common functionality for Apple Network framework-based clients and servers
 
 class nw_ws_common
 {
+    friend class nw_ws_connection;
+    
 protected:
     
-    static constexpr int nw_ws_connection_timeout_ms = 400;
     enum class completion_modes { connecting, ready, closed };
+    
+    // The most received at once when streaming messages to a fragment handler
+    
+    static constexpr uint32_t receive_chunk_size = 64 * 1024;
+    
+    // The largest per-thread buffer kept for flattening received messages
+    
+    static constexpr size_t max_pooled_receive_size = 4 * 1024 * 1024;
 
     // Connection Helper
     
@@ -23,42 +207,74 @@ protected:
     {
         using clock = std::chrono::steady_clock;
         
+        // Spin briefly before blocking, as state changes often arrive quickly
+        
+        static constexpr int spin_count = 64;
+    
     public:
-        // FIX - sleep/yield threads?
+        
+        // Wait for the connection to become ready or close (a zero time out waits indefinitely)
         
         void wait_for_completion(int time_out = 0)
         {
-            auto exit_time = clock::now() + std::chrono::milliseconds(time_out);
-            
-            // Busy waiting
-            
-            if (time_out)
-            {
-                while (!completed() && clock::now() < exit_time){};
-            }
-            else
-            {
-                while (!completed()){};
-            }
+            wait([this]() { return completed(); }, time_out);
         }
         
-        void set(completion_modes mode) { m_mode.store(mode); }
+        void wait_for_closed()
+        {
+            wait([this]() { return closed(); }, 0);
+        }
         
-        void wait_for_closed() { while (!closed()){}; }
+        void set(completion_modes mode)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_mode.store(mode);
+            }
+            
+            m_condition.notify_all();
+        }
         
         bool completed() { return m_mode.load() != completion_modes::connecting; }
         bool closed() { return m_mode.load() == completion_modes::closed; }
         bool ready() { return m_mode.load() == completion_modes::ready; }
-        
+    
     private:
         
-        std::atomic<completion_modes> m_mode = completion_modes::connecting;
+        template <typename F>
+        void wait(F condition, int time_out)
+        {
+            for (int i = 0; i < spin_count; i++)
+            {
+                if (condition())
+                    return;
+                
+                std::this_thread::yield();
+            }
+            
+            std::unique_lock<std::mutex> lock(m_mutex);
+            
+            if (time_out)
+                m_condition.wait_until(lock, clock::now() + std::chrono::milliseconds(time_out), condition);
+            else
+                m_condition.wait(lock, condition);
+        }
+        
+        std::atomic<completion_modes> m_mode { completion_modes::connecting };
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
     };
     
-    // Constructor and Destructor
+    // Constructor (running on the queue given, else on one of its own) and Destructor
     
-    nw_ws_common() : m_queue(nullptr)
+    nw_ws_common(dispatch_queue_t queue = nullptr) : m_queue(queue)
     {
+        if (m_queue)
+        {
+            dispatch_retain(m_queue);
+            return;
+        }
+        
         auto attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, -4);
         m_queue = dispatch_queue_create("websocket_queue", attr);
     }
@@ -70,31 +286,145 @@ protected:
         dispatch_release(m_queue);
     }
 
-    // Parameters
+    // A serial queue from a process-wide set (one per core, handed out in turn and kept for the life of the process)
+    
+    static dispatch_queue_t shared_queue()
+    {
+        struct queue_set
+        {
+            queue_set()
+            {
+                auto qos = QOS_CLASS_USER_INITIATED;
+                auto attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, qos, -4);
+                auto target = dispatch_get_global_queue(qos, 0);
+                unsigned int count = std::max(1U, std::thread::hardware_concurrency());
+                
+                for (unsigned int i = 0; i < count; i++)
+                    m_queues.push_back(dispatch_queue_create_with_target("websocket_shared_queue", attr, target));
+            }
+            
+            std::vector<dispatch_queue_t> m_queues;
+            std::atomic<size_t> m_next { 0 };
+        };
+        
+        static queue_set set;
+        
+        return set.m_queues[set.m_next.fetch_add(1, std::memory_order_relaxed) % set.m_queues.size()];
+    }
+    
+    // Parameters (shared between instances with the same settings, so treat as immutable and release when done)
+    // Sharing also means that TLS sessions are resumed across reconnects, and returns nullptr if TLS cannot be set up
+    
+    static nw_parameters_t create_websocket_parameters(const ws_tcp_options& tcp,
+                                                       const ws_tls_options& tls,
+                                                       ws_service_class service_class)
+    {
+        using key_type = std::tuple<bool, bool, unsigned int, unsigned int, unsigned int,
+                                    unsigned int, unsigned int, unsigned int, ws_service_class,
+                                    bool, std::string, std::string, std::string, bool, bool>;
+        
+        static std::mutex cache_mutex;
+        static std::map<key_type, nw_parameters_t> cache;
+        
+        key_type key(tcp.m_no_delay,
+                     tcp.m_keepalive,
+                     tcp.m_keepalive_idle_time,
+                     tcp.m_keepalive_count,
+                     tcp.m_keepalive_interval,
+                     tcp.m_connection_timeout,
+                     tcp.m_persist_timeout,
+                     tcp.m_retransmit_connection_drop_time,
+                     service_class,
+                     tls.m_enable,
+                     tls.m_enable ? tls.m_identity : std::string(),
+                     tls.m_enable ? tls.m_identity_passphrase : std::string(),
+                     tls.m_enable ? tls.m_server_name : std::string(),
+                     tls.m_enable && tls.m_allow_untrusted,
+                     tls.m_enable && tls.m_resumption);
+        
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        
+        auto it = cache.find(key);
+        
+        if (it == cache.end())
+        {
+            auto parameters = build_websocket_parameters(tcp, tls, service_class);
+            
+            if (!parameters)
+                return nullptr;
+            
+            it = cache.emplace(key, parameters).first;
+        }
+        
+        nw_retain(it->second);
+        
+        return it->second;
+    }
+    
+    // Parameters that the caller may modify
     
-    static nw_parameters_t create_websocket_parameters()
+    static nw_parameters_t copy_websocket_parameters(const ws_tcp_options& tcp,
+                                                     const ws_tls_options& tls,
+                                                     ws_service_class service_class)
     {
+        auto shared = create_websocket_parameters(tcp, tls, service_class);
+        
+        if (!shared)
+            return nullptr;
+        
+        auto parameters = nw_parameters_copy(shared);
+        
+        nw_release(shared);
+        
+        return parameters;
+    }
+    
+    static nw_parameters_t build_websocket_parameters(const ws_tcp_options& settings,
+                                                      const ws_tls_options& tls_settings,
+                                                      ws_service_class service_class)
+    {
+        // Capture a copy of the settings in case the framework keeps the blocks
+        
+        ws_tcp_options tcp = settings;
+        ws_tls_options tls = tls_settings;
+        
+        // The identity is held for as long as the cached parameters (which is the life of the process)
+        
+        sec_identity_t identity = nullptr;
+        
+        if (tls.m_enable && !tls.m_identity.empty())
+        {
+            if (!(identity = load_identity(tls.m_identity, tls.m_identity_passphrase)))
+                return nullptr;
+        }
+        
+        auto set_tls_options = ^(nw_protocol_options_t options)
+        {
+            configure_tls(options, tls, identity);
+        };
+        
         auto set_options = ^(nw_protocol_options_t options)
         {
-            nw_tcp_options_set_no_delay(options, true);
-            nw_tcp_options_set_enable_keepalive(options, true);
-            nw_tcp_options_set_keepalive_idle_time(options, 1);
-            nw_tcp_options_set_keepalive_count(options, 1);
-            nw_tcp_options_set_keepalive_interval(options, 2);
-            nw_tcp_options_set_connection_timeout(options, 2);
-            nw_tcp_options_set_persist_timeout(options, 2);
-            nw_tcp_options_set_retransmit_connection_drop_time(options, 2);
+            nw_tcp_options_set_no_delay(options, tcp.m_no_delay);
+            nw_tcp_options_set_enable_keepalive(options, tcp.m_keepalive);
+            nw_tcp_options_set_keepalive_idle_time(options, tcp.m_keepalive_idle_time);
+            nw_tcp_options_set_keepalive_count(options, tcp.m_keepalive_count);
+            nw_tcp_options_set_keepalive_interval(options, tcp.m_keepalive_interval);
+            nw_tcp_options_set_connection_timeout(options, tcp.m_connection_timeout);
+            nw_tcp_options_set_persist_timeout(options, tcp.m_persist_timeout);
+            nw_tcp_options_set_retransmit_connection_drop_time(options, tcp.m_retransmit_connection_drop_time);
         };
         
         // Parameters and protocol for websockets
         
-        auto parameters = nw_parameters_create_secure_tcp(NW_PARAMETERS_DISABLE_PROTOCOL, set_options);
+        auto configure_security = tls.m_enable ? set_tls_options : NW_PARAMETERS_DISABLE_PROTOCOL;
+        auto parameters = nw_parameters_create_secure_tcp(configure_security, set_options);
         auto protocol_stack = nw_parameters_copy_default_protocol_stack(parameters);
         auto websocket_options = nw_ws_create_options(nw_ws_version_13);
         
         nw_protocol_stack_prepend_application_protocol(protocol_stack, websocket_options);
         nw_parameters_set_include_peer_to_peer(parameters, true);
-        nw_parameters_set_service_class(parameters, nw_service_class_signaling);
+        nw_parameters_set_service_class(parameters, get_service_class(service_class));
         
         // Release temporaries
         
@@ -104,31 +434,387 @@ protected:
         return parameters;
     }
     
-    // Send
+    // TLS settings (resumption and tickets let reconnects skip the full handshake)
     
-    void send(nw_connection_t connection, const void *data, size_t size)
+    static void configure_tls(nw_protocol_options_t options, const ws_tls_options& tls, sec_identity_t identity)
     {
-        auto dispatch_data = dispatch_data_create(data, size, m_queue, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        sec_protocol_options_t security = nw_tls_copy_sec_protocol_options(options);
         
-        nw_protocol_metadata_t metadata = nw_ws_create_metadata(nw_ws_opcode_binary);
-        nw_content_context_t context = nw_content_context_create("send");
-        nw_content_context_set_metadata_for_protocol(context, metadata);
+        sec_protocol_options_set_min_tls_protocol_version(security, tls_protocol_version_TLSv12);
+        sec_protocol_options_set_tls_resumption_enabled(security, tls.m_resumption);
+        sec_protocol_options_set_tls_tickets_enabled(security, tls.m_resumption);
         
-        auto send_complete_block = ^(nw_error_t _Nullable error)
+        if (identity)
+            sec_protocol_options_set_local_identity(security, identity);
+        
+        if (!tls.m_server_name.empty())
+            sec_protocol_options_set_tls_server_name(security, tls.m_server_name.c_str());
+        
+        if (tls.m_allow_untrusted)
+        {
+            auto verify_queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+            
+            sec_protocol_options_set_verify_block(security, ^(sec_protocol_metadata_t,
+                                                              sec_trust_t,
+                                                              sec_protocol_verify_complete_t complete)
+            {
+                complete(true);
+            }, verify_queue);
+        }
+        
+        sec_release(security);
+    }
+    
+    // Load the first identity from a PKCS #12 file
+    
+    static sec_identity_t load_identity(const std::string& path, const std::string& passphrase)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        
+        if (!file.good() && !file.eof())
+            return nullptr;
+        
+        auto data = CFDataCreate(nullptr, reinterpret_cast<const UInt8 *>(contents.data()), contents.size());
+        auto password = CFStringCreateWithCString(nullptr, passphrase.c_str(), kCFStringEncodingUTF8);
+        
+        // A passphrase that is not valid UTF-8 gives no string (which the dictionary cannot hold)
+        
+        if (!data || !password)
+        {
+            if (password)
+                CFRelease(password);
+            if (data)
+                CFRelease(data);
+            
+            return nullptr;
+        }
+        
+        const void *keys[] = { kSecImportExportPassphrase };
+        const void *values[] = { password };
+        
+        auto import_options = CFDictionaryCreate(nullptr,
+                                                 keys,
+                                                 values,
+                                                 1,
+                                                 &kCFTypeDictionaryKeyCallBacks,
+                                                 &kCFTypeDictionaryValueCallBacks);
+        
+        CFArrayRef items = nullptr;
+        sec_identity_t identity = nullptr;
+        
+        if (import_options && SecPKCS12Import(data, import_options, &items) == errSecSuccess && CFArrayGetCount(items))
+        {
+            auto item = static_cast<CFDictionaryRef>(CFArrayGetValueAtIndex(items, 0));
+            auto sec_identity = static_cast<SecIdentityRef>(CFDictionaryGetValue(item, kSecImportItemIdentity));
+            
+            if (sec_identity)
+                identity = sec_identity_create(sec_identity);
+        }
+        
+        // Release temporaries
+        
+        if (items)
+            CFRelease(items);
+        if (import_options)
+            CFRelease(import_options);
+        
+        CFRelease(password);
+        CFRelease(data);
+        
+        return identity;
+    }
+    
+    static nw_service_class_t get_service_class(ws_service_class service_class)
+    {
+        switch (service_class)
+        {
+            case ws_service_class::best_effort:         return nw_service_class_best_effort;
+            case ws_service_class::background:          return nw_service_class_background;
+            case ws_service_class::interactive_video:   return nw_service_class_interactive_video;
+            case ws_service_class::interactive_voice:   return nw_service_class_interactive_voice;
+            case ws_service_class::responsive_data:     return nw_service_class_responsive_data;
+            case ws_service_class::signaling:           return nw_service_class_signaling;
+        }
+        
+        return nw_service_class_signaling;
+    }
+    
+    // Messages
+    
+    using message = nw_ws_message;
+    
+    static message prepare(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return message(data, size, opcode);
+    }
+    
+    static message prepare(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return message(buffers, count, opcode);
+    }
+    
+    // Send (complete messages use the connection's cached contexts)
+    
+    static void send_batch(nw_connection_t connection,
+                           const ws_buffer_list *messages,
+                           size_t count,
+                           nw_context_cache& contexts)
+    {
+        nw_context_cache *contexts_ptr = &contexts;
+        
+        nw_connection_batch(connection, ^{
+            for (size_t i = 0; i < count; i++)
+                send(connection, prepare(messages[i].m_buffers, messages[i].m_count), nullptr, *contexts_ptr);
+        });
+    }
+    
+    // Send a message (fragments of one message share a context held in stream until the final fragment)
+    
+    static void send(nw_connection_t connection,
+                     const message& data,
+                     nw_connection_send_completion_t completion,
+                     nw_context_cache& contexts,
+                     nw_content_context_t *stream = nullptr)
+    {
+        // Complete messages share the connection's context for their opcode and need no completion unless wanted
+        
+        if (!stream || !data.fragment())
         {
-            // Release the context on completion
+            nw_connection_send_completion_t no_completion = ^(nw_error_t _Nullable) {};
+            nw_content_context_t context = contexts.get(data.opcode());
             
+            nw_connection_send(connection, data.get(), context, true, completion ? completion : no_completion);
+            return;
+        }
+        
+        // Fragments use their own context, which is held until the final fragment and released once that is sent
+        
+        if (!*stream)
+            *stream = nw_context_cache::create(data.opcode());
+        
+        nw_content_context_t context = *stream;
+        bool complete = data.complete();
+        
+        if (complete)
+            *stream = nullptr;
+        else
+            nw_retain(context);
+        
+        auto send_complete_block = ^(nw_error_t _Nullable error)
+        {
             nw_release(context);
+            
+            if (completion)
+                completion(error);
         };
         
-        nw_connection_send(connection, dispatch_data, context, true, send_complete_block);
+        nw_connection_send(connection, data.get(), context, complete, send_complete_block);
+    }
+    
+    // Send a ping (outside any queue of messages) with a block called once the framework matches its pong
+    
+    static void ping(nw_connection_t connection,
+                     const void *data,
+                     size_t size,
+                     dispatch_queue_t queue,
+                     nw_ws_pong_handler_t pong_block)
+    {
+        nw_protocol_metadata_t metadata = nw_ws_create_metadata(nw_ws_opcode_ping);
+        nw_content_context_t context = nw_content_context_create("ping");
+        dispatch_data_t payload = dispatch_data_create(data, size, nullptr, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+        
+        nw_ws_metadata_set_pong_handler(metadata, queue, pong_block);
+        nw_content_context_set_metadata_for_protocol(context, metadata);
+        nw_connection_send(connection, payload, context, true, ^(nw_error_t _Nullable) {});
+        
+        dispatch_release(payload);
+        nw_release(context);
+        nw_release(metadata);
+    }
+    
+    // Regions of a received message (stored inline unless there are many)
+    
+    class region_list
+    {
+        static constexpr size_t inline_size = 16;
+    
+    public:
+        
+        void add(const void *data, size_t size)
+        {
+            if (m_count < inline_size)
+                m_inline[m_count] = { data, size };
+            else
+            {
+                if (m_count == inline_size)
+                    m_overflow.assign(m_inline, m_inline + inline_size);
+                
+                m_overflow.push_back({ data, size });
+            }
+            
+            m_count++;
+        }
+        
+        const ws_buffer *data() const { return m_count > inline_size ? m_overflow.data() : m_inline; }
+        size_t size() const { return m_count; }
+    
+    private:
+        
+        ws_buffer m_inline[inline_size];
+        std::vector<ws_buffer> m_overflow;
+        size_t m_count = 0;
+    };
+    
+    // The opcode of a received message (the framework's values are those of RFC 6455)
+    
+    static ws_opcode get_opcode(nw_content_context_t context)
+    {
+        ws_opcode opcode = ws_opcode::binary;
+        nw_protocol_definition_t definition = nw_protocol_copy_ws_definition();
+        nw_protocol_metadata_t metadata = nw_content_context_copy_protocol_metadata(context, definition);
+        
+        if (metadata)
+        {
+            opcode = static_cast<ws_opcode>(nw_ws_metadata_get_opcode(metadata));
+            nw_release(metadata);
+        }
+        
+        nw_release(definition);
+        
+        return opcode;
+    }
+    
+    // Capture content as one record (with its opcode and whether it completes a message)
+    
+    static void capture(ws_capture_log *log,
+                        ws_capture_event event,
+                        ws_connection_id id,
+                        dispatch_data_t content,
+                        ws_opcode opcode,
+                        bool is_complete)
+    {
+        region_list regions;
+        region_list *regions_ptr = &regions;
+        int bits = static_cast<int>(opcode) | (is_complete ? 0x80 : 0);
+        
+        if (content)
+        {
+            dispatch_data_apply(content, ^bool(dispatch_data_t, size_t, const void *buffer, size_t size)
+            {
+                regions_ptr->add(buffer, size);
+                return true;
+            });
+        }
+        
+        log->append(event, id, bits, regions.data(), regions.size());
+    }
+    
+    // Deliver received content (as-is to a regions handler, otherwise in place or flattened into a per-thread buffer)
+    
+    template <typename H>
+    static void deliver(dispatch_data_t content,
+                        nw_content_context_t context,
+                        ws_connection_id id,
+                        const H& handlers,
+                        void *owner)
+    {
+        ws_opcode opcode = get_opcode(context);
+        
+        if (handlers.m_receive_regions)
+        {
+            region_list regions;
+            region_list *regions_ptr = &regions;
+            
+            dispatch_data_apply(content, ^bool(dispatch_data_t, size_t, const void *buffer, size_t size)
+            {
+                regions_ptr->add(buffer, size);
+                return true;
+            });
+            
+            handlers.m_receive_regions(id, opcode, regions.data(), regions.size(), owner);
+        }
+        else
+        {
+            static thread_local std::vector<unsigned char> flattened;
+            
+            const void *buffer = nullptr;
+            size_t size = dispatch_data_get_size(content);
+            size_t regions = 0;
+            const void **buffer_ptr = &buffer;
+            size_t *regions_ptr = &regions;
+            
+            dispatch_data_apply(content, ^bool(dispatch_data_t, size_t, const void *region, size_t)
+            {
+                *buffer_ptr = region;
+                return ++(*regions_ptr) < 2;
+            });
+            
+            if (regions > 1)
+            {
+                flattened.resize(size);
+                unsigned char *out = flattened.data();
+                
+                dispatch_data_apply(content, ^bool(dispatch_data_t, size_t offset, const void *region, size_t length)
+                {
+                    std::memcpy(out + offset, region, length);
+                    return true;
+                });
+                
+                buffer = out;
+            }
+            
+            handlers.m_receive(id, opcode, buffer, size, owner);
+            
+            // Keep the buffer for reuse unless it has grown very large
+            
+            if (flattened.capacity() > max_pooled_receive_size)
+                std::vector<unsigned char>().swap(flattened);
+        }
     }
     
-    // Receive
+    // Stream received content to a fragment handler (a region at a time, without copying)
     
     template <typename H>
-    static void receive(nw_connection_t connection, ws_connection_id id, H handlers, void *owner)
+    static void deliver_fragment(dispatch_data_t content,
+                                 nw_content_context_t context,
+                                 bool is_complete,
+                                 ws_connection_id id,
+                                 const H& handlers,
+                                 void *owner)
+    {
+        ws_opcode opcode = get_opcode(context);
+        size_t remaining = content ? dispatch_data_get_size(content) : 0;
+        size_t *remaining_ptr = &remaining;
+        
+        if (!remaining)
+        {
+            handlers.m_receive_fragment(id, opcode, nullptr, 0, is_complete, owner);
+            return;
+        }
+        
+        dispatch_data_apply(content, ^bool(dispatch_data_t, size_t, const void *buffer, size_t size)
+        {
+            *remaining_ptr -= size;
+            handlers.m_receive_fragment(id, opcode, buffer, size, is_complete && !*remaining_ptr, owner);
+            return true;
+        });
+    }
+    
+    // Receive (partial content is only requested when streaming) and count received messages in stats
+    // Any heartbeat state given is told each time the peer is heard from, and any capture log records what arrives
+    
+    template <typename H, typename S>
+    static void receive(nw_connection_t connection,
+                        ws_connection_id id,
+                        H handlers,
+                        void *owner,
+                        S *stats,
+                        ws_heartbeat_state *heartbeat = nullptr,
+                        ws_capture_log *log = nullptr)
     {
+        uint32_t maximum_length = handlers.m_receive_fragment ? receive_chunk_size : UINT32_MAX;
+        
         auto receive_block = ^(dispatch_data_t content,
                                nw_content_context_t context,
                                bool is_complete,
@@ -136,17 +822,27 @@ protected:
         {
             if (!receive_error)
             {
-                if (is_complete && content)
+                auto start = ws_stats::now();
+                
+                if (content || is_complete)
+                    stats->received(content ? dispatch_data_get_size(content) : 0, is_complete ? 1 : 0);
+                
+                if (heartbeat)
+                    heartbeat->heard();
+                
+                if (log && (content || is_complete))
+                    capture(log, ws_capture_event::received, id, content, get_opcode(context), is_complete);
+                
+                if (handlers.m_receive_fragment)
                 {
-                    const void *buffer = nullptr;
-                    size_t size = 0;
-                    
-                    dispatch_data_t contiguous = dispatch_data_create_map(content, &buffer, &size);
-                    handlers.m_receive(id, buffer, size, owner);
-                    dispatch_release(contiguous);
+                    if (content || is_complete)
+                        deliver_fragment(content, context, is_complete, id, handlers, owner);
                 }
+                else if (is_complete && content)
+                    deliver(content, context, id, handlers, owner);
                 
-                receive(connection, id, handlers, owner);
+                stats->handled(start);
+                receive(connection, id, handlers, owner, stats, heartbeat, log);
             }
             else
             {
@@ -160,7 +856,7 @@ protected:
             }
         };
         
-        nw_connection_receive(connection, 1, UINT32_MAX, receive_block);
+        nw_connection_receive(connection, 1, maximum_length, receive_block);
     }
     
     dispatch_queue_t m_queue;
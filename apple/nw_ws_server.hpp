@@ -6,64 +6,396 @@
 
 #include "nw_ws_common.hpp"
 #include "../common/ws_server_base.hpp"
+#include "../common/ws_connection.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <string>
+#include <thread>
+#include <vector>
+
+// Network framework per-connection state
+
+class nw_ws_connection : public ws_connection<nw_ws_connection, nw_ws_message>
+{
+public:
+    
+    nw_ws_connection(nw_connection_t connection,
+                     dispatch_queue_t queue,
+                     const ws_send_queue_options& options,
+                     ws_handler_funcs::backpressure_handler backpressure,
+                     void *owner)
+    : ws_connection(options, backpressure, owner)
+    , m_connection(connection)
+    , m_dispatch_queue(queue)
+    {
+        dispatch_retain(m_dispatch_queue);
+    }
+    
+    ~nw_ws_connection()
+    {
+        if (m_stream)
+            nw_release(m_stream);
+        
+        dispatch_release(m_dispatch_queue);
+    }
+    
+    // Pass queued messages to the framework (in order) until the low watermark is in flight
+    
+    void drain()
+    {
+        nw_ws_connection *connection = this;
+        
+        nw_connection_batch(m_connection, ^{
+            connection->m_queue.drain([&](const nw_ws_message& data, size_t bytes)
+            {
+                connection->retain();
+                
+                auto completion = ^(nw_error_t _Nullable error)
+                {
+                    if (error)
+                        connection->m_stats.failed();
+                    
+                    connection->complete(bytes);
+                    connection->drain();
+                    connection->release();
+                };
+                
+                nw_ws_common::send(connection->m_connection,
+                                   data,
+                                   completion,
+                                   connection->m_contexts,
+                                   &connection->m_stream);
+            }, connection->m_queue.options().m_low_watermark);
+        });
+    }
+    
+    // Drain after a delay (so that messages queued meanwhile are passed to the framework in the same batch)
+    //
+    // This runs on the connection's own queue, so delayed drains are serialised with its other events rather than
+    // contending for the server's queue.
+    
+    void drain_after(std::chrono::microseconds delay)
+    {
+        nw_ws_connection *connection = this;
+        
+        retain();
+        
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay.count() * NSEC_PER_USEC), m_dispatch_queue, ^{
+            connection->drain();
+            connection->release();
+        });
+    }
+    
+    nw_connection_t const m_connection;
+    dispatch_queue_t const m_dispatch_queue;        // The queue the connection's events are delivered on
+    
+    // Contexts for complete messages, and the context for a message being sent in fragments (only used by the drainer)
+    
+    nw_context_cache m_contexts;
+    nw_content_context_t m_stream = nullptr;
+};
 
 // Apple Network framework-based websocket server
 
 class nw_ws_server
-: public nw_ws_common, public ws_server_base<nw_ws_server, nw_listener_t, nw_connection_t>
+: public nw_ws_common, public ws_server_base<nw_ws_server, nw_listener_t, nw_ws_connection *>
 {
     friend ws_base<nw_ws_server, nw_listener_t>;
+    friend ws_server_base<nw_ws_server, nw_listener_t, nw_ws_connection *>;
     
 public:
- 
+    
+    using nw_ws_common::message;
+    using nw_ws_common::prepare;
+    
     // Send
     
-    void send(ws_connection_id id, const void *data, size_t size)
+    ws_send_result send(ws_connection_id id, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send(id, prepare(data, size, opcode));
+    }
+    
+    // Send (gathered)
+    
+    ws_send_result send(ws_connection_id id, const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send(id, prepare(buffers, count, opcode));
+    }
+    
+    // Send (prepared)
+    
+    ws_send_result send(ws_connection_id id, const message& data)
+    {
+        ws_send_result result = ws_send_result::not_connected;
+        
+        visit_connection(id, [&](nw_ws_connection *connection)
+        {
+            result = enqueue(connection, &data, 1);
+        });
+        
+        if (result == ws_send_result::not_connected)
+            m_stats.failed();
+        
+        return result;
+    }
+    
+    // Send (prepared to all)
+    
+    void send(const message& data)
     {
-        nw_ws_common::send(find(id), data, size);
+        for_each_connection([&](nw_ws_connection *connection)
+        {
+            enqueue(connection, &data, 1);
+        });
+    }
+    
+    // Send (prepared to the members of a group) and return the number queued
+    
+    size_t send_to_group(ws_group_id group, const message& frame)
+    {
+        size_t queued = 0;
+        
+        for_each_in_group(group, [&](nw_ws_connection *connection)
+        {
+            if (accepted(enqueue(connection, &frame, 1)))
+                queued++;
+        });
+        
+        return queued;
+    }
+    
+    // Send (to the members of a group)
+    
+    size_t send_to_group(ws_group_id group, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_to_group(group, prepare(data, size, opcode));
+    }
+    
+    // Send (gathered to the members of a group)
+    
+    size_t send_to_group(ws_group_id group,
+                         const ws_buffer *buffers,
+                         size_t count,
+                         ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_to_group(group, prepare(buffers, count, opcode));
     }
     
     // Send (to all)
     
-    void send(const void *data, size_t size)
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        send(prepare(data, size, opcode));
+    }
+    
+    // Send (gathered to all)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
     {
-        for (auto it = m_map_from_id.begin(); it != m_map_from_id.end(); it++)
-            nw_ws_common::send(it->second, data, size);
+        send(prepare(buffers, count, opcode));
+    }
+    
+    // Send one fragment of a message (the first with the message's opcode and the rest as continuations)
+    // No other data messages may be sent to the connection until the final fragment (the coalesce policy never
+    // discards queued fragments, so a message is not broken up)
+    
+    ws_send_result send_fragment(ws_connection_id id, const void *data, size_t size, ws_opcode opcode, bool final)
+    {
+        return send(id, message(data, size, opcode, final));
+    }
+    
+    // Send a batch of binary messages (those for each connection are passed on in one batch)
+    // Returns the number queued
+    
+    size_t send_batch(const ws_batch_message *messages, size_t count)
+    {
+        size_t queued = 0;
+        std::vector<message> group_messages;
+        
+        group_batch(messages, count, [&](ws_connection_id id, const ws_buffer_list *group, size_t size)
+        {
+            group_messages.clear();
+            
+            for (size_t i = 0; i < size; i++)
+                group_messages.push_back(prepare(group[i].m_buffers, group[i].m_count));
+            
+            bool found = visit_connection(id, [&](nw_ws_connection *connection)
+            {
+                if (accepted(enqueue(connection, group_messages.data(), size)))
+                    queued += size;
+            });
+            
+            if (!found)
+                m_stats.failed();
+        });
+        
+        return queued;
     }
     
     // Destructor
     
     ~nw_ws_server()
     {
+        stop_heartbeat();
+        
         // Release all connections
         
-        for_each_connection(nw_connection_cancel);
+        for_each_connection([](nw_ws_connection *connection)
+        {
+            nw_connection_cancel(connection->m_connection);
+        });
 
-        if (m_completion.ready())
-            nw_listener_cancel(m_handle);
-        nw_release(m_handle);
+        // A server that failed to start has no listener (and its completion is already closed)
+        
+        if (m_handle)
+        {
+            if (m_completion.ready())
+                nw_listener_cancel(m_handle);
+            nw_release(m_handle);
+        }
         
         m_completion.wait_for_closed();
+        
+        // Connections retain their queues, so any still closing keep theirs alive
+        
+        for (auto it = m_connection_queues.begin(); it != m_connection_queues.end(); it++)
+            dispatch_release(*it);
     }
     
 private:
     
+    // Heartbeats (the framework matches each pong to its ping, so the stamp is only held for the round trip time)
+    
+    template <const ws_server_handlers& handlers>
+    void ping(nw_ws_connection *connection, uint64_t stamp)
+    {
+        connection->retain();
+        
+        auto pong_block = ^(nw_error_t _Nullable error)
+        {
+            if (!error)
+                answered<handlers>(connection, stamp);
+            
+            connection->release();
+        };
+        
+        nw_ws_common::ping(connection->m_connection, &stamp, sizeof(stamp), connection->m_dispatch_queue, pong_block);
+    }
+    
+    void close_idle(nw_ws_connection *connection)
+    {
+        nw_connection_cancel(connection->m_connection);
+    }
+    
+    // Connection queues (serial, so each connection's events stay in order, and sharing the global concurrent queue)
+    
+    void create_connection_queues(unsigned int count)
+    {
+        if (!count)
+            count = std::max(1U, std::thread::hardware_concurrency());
+        
+        auto attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, -4);
+        auto target = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+        
+        for (unsigned int i = 0; i < count; i++)
+            m_connection_queues.push_back(dispatch_queue_create_with_target("websocket_connection_queue", attr, target));
+    }
+    
+    // Pick a queue for a new connection (only called from the listener queue)
+    
+    dispatch_queue_t next_connection_queue()
+    {
+        auto queue = m_connection_queues[m_next_queue];
+        m_next_queue = (m_next_queue + 1) % m_connection_queues.size();
+        return queue;
+    }
+    
+    // Queue messages and pass them on if the queue is not already being drained (returns the last result)
+    
+    ws_send_result enqueue(nw_ws_connection *connection, const message *messages, size_t count)
+    {
+        ws_send_result result = ws_send_result::not_connected;
+        bool schedule = false;
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            auto push_result = connection->push(messages[i], messages[i].size());
+            
+            result = push_result.m_result;
+            schedule = schedule || push_result.m_schedule;
+            
+            if (accepted(result))
+            {
+                connection->m_stats.sent(messages[i].size());
+                
+                if (connection->m_capture)
+                    capture(connection->m_capture,
+                            ws_capture_event::sent,
+                            connection->m_id,
+                            messages[i].get(),
+                            messages[i].opcode(),
+                            messages[i].complete());
+            }
+            else
+                connection->m_stats.failed();
+            
+            if (result == ws_send_result::disconnecting)
+            {
+                connection->m_queue.close();
+                nw_connection_cancel(connection->m_connection);
+                return result;
+            }
+        }
+        
+        if (schedule && connection->m_batching.load(std::memory_order_relaxed))
+        {
+            auto delay = std::chrono::microseconds(std::max(0, m_options.m_batching.m_max_delay_us));
+            connection->drain_after(delay);
+        }
+        else if (schedule)
+            connection->drain();
+        
+        return result;
+    }
+    
     // Constructor
     
     template <const ws_server_handlers& handlers>
-    nw_ws_server(const char *port, const char *path, ws_server_owner<handlers> owner)
+    nw_ws_server(const char *port, const char *path, ws_server_owner<handlers> owner, const ws_server_options& options)
+    : m_options(options)
     {
         __block connection_completion& completion = m_completion;
         
+        create_connection_queues(m_options.m_dispatch_queues);
+        start_capture(m_options.m_capture);
+        start_heartbeat<handlers>(m_options.m_heartbeat);
+        
         std::string sock_address_url = "ws://localhost:" + std::string(port) + path;
         auto endpoint = nw_endpoint_create_url(sock_address_url.c_str());
         
         // Parameters and protocol for websockets
         
-        auto parameters = create_websocket_parameters();
+        // Heartbeats replace TCP keepalive (which only shows that the peer's kernel is alive)
+        
+        ws_tcp_options tcp = options.m_tcp;
+        
+        if (options.m_heartbeat.m_enable)
+            tcp.m_keepalive = false;
+        
+        auto parameters = copy_websocket_parameters(tcp, options.m_tls, options.m_service_class);
+        
+        // Fail to start if TLS cannot be set up (with no listener to close, so that destroying the server does not wait)
+        
+        if (!parameters)
+        {
+            nw_release(endpoint);
+            completion.set(completion_modes::closed);
+            return;
+        }
+        
         nw_parameters_set_local_endpoint(parameters, endpoint);
+        nw_parameters_set_reuse_local_address(parameters, options.m_reuse_port);
         
         // Create listener
         
@@ -94,12 +426,31 @@ private:
                 nw_release(listener);
             }
         };
-            
+        
         // Connection block (for client connections)
         
         auto connection_block = ^(nw_connection_t _Nonnull connection)
         {
-            auto id = add_connection(connection);
+            dispatch_queue_t queue = next_connection_queue();
+            auto connection_state = new nw_ws_connection(connection,
+                                                         queue,
+                                                         m_options.m_send_queue,
+                                                         handlers.m_backpressure,
+                                                         owner.m_owner);
+            
+            connection_state->m_batching.store(m_options.m_batching.m_enable);
+            
+            auto id = add_connection(connection_state);
+            
+            // Reject the connection if the registry is full
+            
+            if (!id)
+            {
+                connection_state->release();
+                nw_connection_cancel(connection);
+                return;
+            }
+            
             handlers.m_connect(id, owner.m_owner);
             
             // Keep a reference for the client connection
@@ -115,7 +466,8 @@ private:
                 
                 if (state == nw_connection_state_ready)
                 {
-                    handlers.m_ready(find(connection), owner.m_owner);
+                    connection_state->m_stats.connected();
+                    handlers.m_ready(id, connection_state->user_data());
                 }
                 else if (state == nw_connection_state_waiting)
                 {
@@ -123,8 +475,11 @@ private:
                 }
                 else if (state == nw_connection_state_cancelled || state == nw_connection_state_failed)
                 {
-                    auto id = remove_connection(connection);
-                    handlers.m_close(id, owner.m_owner);
+                    remove_connection(id);
+                    connection_state->m_queue.close();
+                    connection_state->m_stats.closed();
+                    handlers.m_close(id, connection_state->user_data());
+                    connection_state->release();
                     
                     // Release the  reference that was taken at creation time
                     
@@ -135,16 +490,21 @@ private:
             
             // Setup queue and handlers
             
-            nw_connection_set_queue(connection, m_queue);
+            nw_connection_set_queue(connection, queue);
             nw_connection_set_state_changed_handler(connection, client_state_block);
             
             // Accept the connection
             
             nw_connection_start(connection);
-                        
-            // Start receiving
             
-            receive(connection, id, handlers, owner.m_owner);
+            // Start receiving (with the user data as set by m_connect)
+            
+            auto& stats = connection_state->m_stats;
+            
+            auto heartbeat = &connection_state->m_heartbeat;
+            auto log = connection_state->m_capture;
+            
+            receive(connection, id, handlers, connection_state->user_data(), &stats, heartbeat, log);
         };
         
         // Setup queue and handlers
@@ -156,7 +516,7 @@ private:
         // Start server
         
         nw_listener_start(listener);
-        completion.wait_for_completion(nw_ws_connection_timeout_ms);
+        completion.wait_for_completion(options.m_timeout_ms);
         
         // Cancel if timed out
         
@@ -175,12 +535,17 @@ private:
         {
             m_handle = listener;
             m_port = nw_listener_get_port(listener);
+            m_ports.push_back(m_port);
         }
         else
             nw_release(listener);
     }
     
     connection_completion m_completion;
+    const ws_server_options m_options;
+    
+    std::vector<dispatch_queue_t> m_connection_queues;
+    size_t m_next_queue = 0;
 };
 
 #endif /* NW_WS_SERVER_HPP */
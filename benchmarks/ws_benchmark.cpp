@@ -0,0 +1,641 @@
+
+// Websocket benchmarks for each backend
+//
+// Runs echo latency, one-way throughput, broadcast fan-out and connect/disconnect churn scenarios against each
+// server/client pair and prints one JSON object per result line (so results can be collected and compared).
+//
+// Usage: ws_benchmark [--backend all|civetweb|apple|loopback] [--scenario all|echo|throughput|fanout|churn] [--port N]
+//                     [--sizes 64,1024,...] [--clients 1000,10000] [--messages N] [--timeout-ms N] [--max-workers N]
+//
+// CivetWeb holds a worker thread for each connection, and each CivetWeb client has a thread of its own, so with
+// thousands of clients a fan-out would mostly measure thread scheduling. Its worker pool is therefore capped (at 1024
+// by default) and the CivetWeb fan-out connects at most that many clients less a margin. Lines where fewer clients
+// were connected than asked for report both counts ("requested_clients" and "clients").
+
+#include "../websocket-tools.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using benchmark_clock = std::chrono::steady_clock;
+
+// Settings
+
+struct benchmark_settings
+{
+    std::string m_backend = "all";
+    std::string m_scenario = "all";
+    int m_port = 9100;
+    size_t m_echo_messages = 10000;
+    size_t m_echo_size = 64;
+    size_t m_throughput_bytes = 64 * 1024 * 1024;
+    std::vector<size_t> m_sizes { 64, 1024, 16 * 1024, 256 * 1024 };
+    std::vector<size_t> m_fanout_clients { 1000, 10000 };
+    size_t m_fanout_messages = 100;
+    size_t m_fanout_size = 1024;
+    size_t m_churn_connections = 1000;
+    int m_timeout_ms = 60000;
+    size_t m_max_workers = 1024;
+};
+
+// A single line of JSON output
+
+class json_line
+{
+public:
+    
+    json_line(const char *backend, const char *scenario)
+    {
+        add("backend", backend);
+        add("scenario", scenario);
+    }
+    
+    void add(const char *name, const char *value)
+    {
+        m_text += separator() + quote(name) + ":" + quote(value);
+    }
+    
+    void add(const char *name, bool value)
+    {
+        m_text += separator() + quote(name) + ":" + (value ? "true" : "false");
+    }
+    
+    void add(const char *name, size_t value)
+    {
+        m_text += separator() + quote(name) + ":" + std::to_string(value);
+    }
+    
+    void add(const char *name, double value)
+    {
+        char number[64];
+        std::snprintf(number, sizeof(number), "%.3f", value);
+        m_text += separator() + quote(name) + ":" + number;
+    }
+    
+    // Add mean and percentiles of latency samples in microseconds
+    
+    void add_latencies(const char *prefix, std::vector<double>& samples)
+    {
+        std::string name(prefix);
+        
+        if (samples.empty())
+            return;
+        
+        std::sort(samples.begin(), samples.end());
+        
+        double sum = 0.0;
+        
+        for (auto it = samples.begin(); it != samples.end(); it++)
+            sum += *it;
+        
+        add((name + "_mean_us").c_str(), sum / samples.size());
+        add((name + "_p50_us").c_str(), percentile(samples, 50.0));
+        add((name + "_p90_us").c_str(), percentile(samples, 90.0));
+        add((name + "_p99_us").c_str(), percentile(samples, 99.0));
+        add((name + "_max_us").c_str(), samples.back());
+    }
+    
+    void print() const
+    {
+        std::printf("{%s}\n", m_text.c_str());
+        std::fflush(stdout);
+    }
+    
+private:
+    
+    static double percentile(const std::vector<double>& sorted, double p)
+    {
+        size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+    
+    static std::string quote(const char *text)
+    {
+        return std::string("\"") + text + "\"";
+    }
+    
+    std::string separator() const
+    {
+        return m_text.empty() ? "" : ",";
+    }
+    
+    std::string m_text;
+};
+
+// Timing helpers
+
+static double elapsed_us(benchmark_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(benchmark_clock::now() - start).count();
+}
+
+// Wait for a counter to reach a target (spinning briefly first, so that short waits are measured accurately)
+
+static bool wait_for(const std::atomic<size_t>& counter, size_t target, int timeout_ms)
+{
+    auto deadline = benchmark_clock::now() + std::chrono::milliseconds(timeout_ms);
+    
+    for (int i = 0; counter.load(std::memory_order_acquire) < target; i++)
+    {
+        if (i < 1000)
+            std::this_thread::yield();
+        else if (benchmark_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        else
+            return false;
+    }
+    
+    return true;
+}
+
+// Benchmarks for one server/client pair
+
+template <class S, class C>
+class backend_benchmark
+{
+    // Server side state (passed as the owner)
+    
+    struct server_state
+    {
+        S *m_server = nullptr;
+        bool m_echo = false;
+        std::atomic<size_t> m_connects { 0 };
+        std::atomic<size_t> m_ready { 0 };
+        std::atomic<size_t> m_closes { 0 };
+        std::atomic<size_t> m_messages { 0 };
+        std::atomic<size_t> m_bytes { 0 };
+    };
+    
+    // Client side state (shared by all the clients of a scenario)
+    
+    struct client_state
+    {
+        std::atomic<size_t> m_messages { 0 };
+        std::atomic<size_t> m_bytes { 0 };
+        std::atomic<size_t> m_closes { 0 };
+    };
+    
+    // Server handlers
+    
+    static void server_connect(ws_connection_id, void *owner)
+    {
+        static_cast<server_state *>(owner)->m_connects++;
+    }
+    
+    static void server_ready(ws_connection_id, void *owner)
+    {
+        static_cast<server_state *>(owner)->m_ready++;
+    }
+    
+    static void server_receive(ws_connection_id id, ws_opcode opcode, const void *data, size_t size, void *owner)
+    {
+        auto state = static_cast<server_state *>(owner);
+        
+        if (state->m_echo)
+            state->m_server->send(id, data, size, opcode);
+        
+        state->m_bytes.fetch_add(size, std::memory_order_relaxed);
+        state->m_messages.fetch_add(1, std::memory_order_release);
+    }
+    
+    static void server_close(ws_connection_id, void *owner)
+    {
+        static_cast<server_state *>(owner)->m_closes++;
+    }
+    
+    // Client handlers
+    
+    static void client_receive(ws_connection_id, ws_opcode, const void *, size_t size, void *owner)
+    {
+        auto state = static_cast<client_state *>(owner);
+        
+        state->m_bytes.fetch_add(size, std::memory_order_relaxed);
+        state->m_messages.fetch_add(1, std::memory_order_release);
+    }
+    
+    static void client_close(ws_connection_id, void *owner)
+    {
+        static_cast<client_state *>(owner)->m_closes++;
+    }
+    
+    static constexpr ws_server_handlers server_handlers { server_connect, server_ready, server_receive, server_close };
+    static constexpr ws_client_handlers client_handlers { client_receive, client_close };
+    
+public:
+    
+    backend_benchmark(const char *name, const benchmark_settings& settings)
+    : m_name(name)
+    , m_settings(settings)
+    , m_port(settings.m_port)
+    {}
+    
+    void run()
+    {
+        auto selected = [&](const char *scenario)
+        {
+            return m_settings.m_scenario == "all" || m_settings.m_scenario == scenario;
+        };
+        
+        if (selected("echo"))
+            echo();
+        
+        if (selected("throughput"))
+        {
+            for (auto it = m_settings.m_sizes.begin(); it != m_settings.m_sizes.end(); it++)
+                throughput(*it);
+        }
+        
+        if (selected("fanout"))
+        {
+            for (auto it = m_settings.m_fanout_clients.begin(); it != m_settings.m_fanout_clients.end(); it++)
+                fanout(*it);
+        }
+        
+        if (selected("churn"))
+            churn();
+    }
+    
+private:
+    
+    using server_pointer = std::unique_ptr<S>;
+    using client_pointer = std::unique_ptr<C>;
+    
+    // CivetWeb workers kept beyond one per client (for connections still closing from an earlier scenario)
+    
+    static constexpr size_t worker_margin = 16;
+    
+    // Report the clients connected, and the number asked for if it was capped
+    
+    static void add_clients(json_line& line, size_t requested, size_t clients)
+    {
+        if (requested != clients)
+            line.add("requested_clients", requested);
+        
+        line.add("clients", clients);
+    }
+    
+    // Create a server on a fresh port (so that sockets from previous scenarios do not interfere)
+    
+    server_pointer create_server(server_state& state, size_t clients = 1)
+    {
+        ws_server_options options;
+        
+        // Queue enough that broadcasts are not dropped, and give CivetWeb a worker per connection (up to the cap)
+        
+        size_t workers = std::min(std::max(clients + worker_margin, size_t(64)), m_settings.m_max_workers);
+        
+        options.m_send_queue.m_high_watermark = 256 * 1024 * 1024;
+        options.m_send_queue.m_low_watermark = 64 * 1024 * 1024;
+        options.m_worker_threads = static_cast<unsigned int>(workers);
+        options.m_timeout_ms = 2000;
+        
+        std::string port = std::to_string(m_port++);
+        server_pointer server(S::template create<server_handlers>(port.c_str(),
+                                                                  "/",
+                                                                  ws_server_owner<server_handlers> { &state },
+                                                                  options));
+        
+        state.m_server = server.get();
+        
+        return server;
+    }
+    
+    client_pointer create_client(client_state& state, const S& server)
+    {
+        ws_client_options options;
+        
+        options.m_timeout_ms = 2000;
+        
+        return client_pointer(C::template create<client_handlers>("localhost",
+                                                                 server.port(),
+                                                                 "/",
+                                                                 ws_client_owner<client_handlers> { &state },
+                                                                 options));
+    }
+    
+    // Add the server's own statistics (when built with WS_STATS)
+    
+    static void add_server_stats(json_line& line, const S& server)
+    {
+#ifdef WS_STATS
+        auto stats = server.stats();
+        
+        line.add("server_messages_in", static_cast<size_t>(stats.m_messages_in));
+        line.add("server_messages_out", static_cast<size_t>(stats.m_messages_out));
+        line.add("server_send_failures", static_cast<size_t>(stats.m_send_failures));
+        line.add("server_handshake_p99_us", static_cast<size_t>(stats.m_handshake.percentile(99.0)));
+        line.add("server_receive_p99_us", static_cast<size_t>(stats.m_receive.percentile(99.0)));
+#else
+        (void) line;
+        (void) server;
+#endif
+    }
+    
+    // Report a scenario that could not be run
+    
+    void failed(const char *scenario, const char *error)
+    {
+        json_line line(m_name, scenario);
+        
+        line.add("error", error);
+        line.print();
+    }
+    
+    // Round trip latency of one message at a time, echoed by the server
+    
+    void echo()
+    {
+        server_state server_state;
+        client_state client_state;
+        
+        server_state.m_echo = true;
+        
+        auto server = create_server(server_state);
+        auto client = server ? create_client(client_state, *server) : nullptr;
+        
+        if (!client)
+            return failed("echo", "connect failed");
+        
+        std::vector<unsigned char> payload(m_settings.m_echo_size, 0x55);
+        std::vector<double> samples;
+        auto start = benchmark_clock::now();
+        bool complete = true;
+        
+        samples.reserve(m_settings.m_echo_messages);
+        
+        for (size_t i = 0; i < m_settings.m_echo_messages && complete; i++)
+        {
+            auto send_time = benchmark_clock::now();
+            
+            client->send(payload.data(), payload.size());
+            complete = wait_for(client_state.m_messages, i + 1, m_settings.m_timeout_ms);
+            samples.push_back(elapsed_us(send_time));
+        }
+        
+        double seconds = elapsed_us(start) / 1e6;
+        json_line line(m_name, "echo");
+        
+        line.add("message_size", m_settings.m_echo_size);
+        line.add("messages", samples.size());
+        line.add("complete", complete);
+        line.add("seconds", seconds);
+        line.add("round_trips_per_second", samples.size() / seconds);
+        line.add_latencies("rtt", samples);
+        add_server_stats(line, *server);
+        line.print();
+    }
+    
+    // One-way throughput from a client to the server
+    
+    void throughput(size_t size)
+    {
+        server_state server_state;
+        client_state client_state;
+        
+        auto server = create_server(server_state);
+        auto client = server ? create_client(client_state, *server) : nullptr;
+        
+        if (!client)
+            return failed("throughput", "connect failed");
+        
+        size_t messages = std::max(size_t(1), m_settings.m_throughput_bytes / size);
+        std::vector<unsigned char> payload(size, 0xAA);
+        auto start = benchmark_clock::now();
+        
+        for (size_t i = 0; i < messages; i++)
+            client->send(payload.data(), payload.size());
+        
+        bool complete = wait_for(server_state.m_messages, messages, m_settings.m_timeout_ms);
+        double seconds = elapsed_us(start) / 1e6;
+        size_t received = server_state.m_messages.load();
+        json_line line(m_name, "throughput");
+        
+        line.add("message_size", size);
+        line.add("messages", messages);
+        line.add("received", received);
+        line.add("complete", complete);
+        line.add("seconds", seconds);
+        line.add("messages_per_second", received / seconds);
+        line.add("megabytes_per_second", server_state.m_bytes.load() / seconds / (1024.0 * 1024.0));
+        add_server_stats(line, *server);
+        line.print();
+    }
+    
+    // Broadcast from the server to many clients (on CivetWeb no more than its capped workers can serve)
+    
+    void fanout(size_t requested)
+    {
+        size_t clients = requested;
+        
+        if (std::is_same<S, cw_ws_server>::value && m_settings.m_max_workers > worker_margin)
+            clients = std::min(clients, m_settings.m_max_workers - worker_margin);
+        
+        server_state server_state;
+        client_state client_state;
+        std::vector<client_pointer> connections;
+        
+        auto server = create_server(server_state, clients);
+        
+        if (!server)
+            return failed("fanout", "server failed");
+        
+        for (size_t i = 0; i < clients; i++)
+        {
+            auto client = create_client(client_state, *server);
+            
+            if (!client)
+                break;
+            
+            connections.push_back(std::move(client));
+        }
+        
+        // Wait for the server to see every connection as ready (so that broadcasts reach all of them)
+        
+        if (connections.size() < clients || !wait_for(server_state.m_ready, clients, m_settings.m_timeout_ms))
+        {
+            json_line line(m_name, "fanout");
+            
+            add_clients(line, requested, clients);
+            line.add("connected", connections.size());
+            line.add("error", "connect failed");
+            line.print();
+            return;
+        }
+        
+        std::vector<unsigned char> payload(m_settings.m_fanout_size, 0x33);
+        size_t deliveries = clients * m_settings.m_fanout_messages;
+        auto message = server->prepare(payload.data(), payload.size());
+        auto start = benchmark_clock::now();
+        
+        for (size_t i = 0; i < m_settings.m_fanout_messages; i++)
+            server->send(message);
+        
+        bool complete = wait_for(client_state.m_messages, deliveries, m_settings.m_timeout_ms);
+        double seconds = elapsed_us(start) / 1e6;
+        size_t received = client_state.m_messages.load();
+        json_line line(m_name, "fanout");
+        
+        add_clients(line, requested, clients);
+        line.add("message_size", m_settings.m_fanout_size);
+        line.add("messages", m_settings.m_fanout_messages);
+        line.add("deliveries", received);
+        line.add("complete", complete);
+        line.add("seconds", seconds);
+        line.add("deliveries_per_second", received / seconds);
+        add_server_stats(line, *server);
+        line.print();
+        
+        connections.clear();
+        wait_for(server_state.m_closes, clients, m_settings.m_timeout_ms);
+    }
+    
+    // Connect and disconnect clients one after another
+    
+    void churn()
+    {
+        server_state server_state;
+        client_state client_state;
+        std::vector<double> connect_samples;
+        std::vector<double> close_samples;
+        
+        auto server = create_server(server_state);
+        
+        if (!server)
+            return failed("churn", "server failed");
+        
+        auto start = benchmark_clock::now();
+        
+        for (size_t i = 0; i < m_settings.m_churn_connections; i++)
+        {
+            auto connect_time = benchmark_clock::now();
+            auto client = create_client(client_state, *server);
+            
+            if (!client)
+                break;
+            
+            connect_samples.push_back(elapsed_us(connect_time));
+            
+            // Time until the server has seen the close
+            
+            auto close_time = benchmark_clock::now();
+            
+            client.reset();
+            
+            if (!wait_for(server_state.m_closes, i + 1, m_settings.m_timeout_ms))
+                break;
+            
+            close_samples.push_back(elapsed_us(close_time));
+        }
+        
+        double seconds = elapsed_us(start) / 1e6;
+        json_line line(m_name, "churn");
+        
+        line.add("connections", m_settings.m_churn_connections);
+        line.add("completed", close_samples.size());
+        line.add("complete", close_samples.size() == m_settings.m_churn_connections);
+        line.add("seconds", seconds);
+        line.add("connections_per_second", close_samples.size() / seconds);
+        line.add_latencies("connect", connect_samples);
+        line.add_latencies("close", close_samples);
+        add_server_stats(line, *server);
+        line.print();
+    }
+    
+    const char *m_name;
+    const benchmark_settings& m_settings;
+    int m_port;
+};
+
+// Argument parsing
+
+static std::vector<size_t> parse_list(const char *text)
+{
+    std::vector<size_t> values;
+    
+    for (const char *c = text; *c; )
+    {
+        char *end = nullptr;
+        size_t value = std::strtoull(c, &end, 10);
+        
+        if (end == c)
+            break;
+        
+        values.push_back(value);
+        c = *end == ',' ? end + 1 : end;
+    }
+    
+    return values;
+}
+
+static bool parse_arguments(int argc, char **argv, benchmark_settings& settings)
+{
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *name = argv[i];
+        const char *value = argv[i + 1];
+        
+        if (!std::strcmp(name, "--backend"))
+            settings.m_backend = value;
+        else if (!std::strcmp(name, "--scenario"))
+            settings.m_scenario = value;
+        else if (!std::strcmp(name, "--port"))
+            settings.m_port = std::atoi(value);
+        else if (!std::strcmp(name, "--sizes"))
+            settings.m_sizes = parse_list(value);
+        else if (!std::strcmp(name, "--clients"))
+            settings.m_fanout_clients = parse_list(value);
+        else if (!std::strcmp(name, "--messages"))
+            settings.m_echo_messages = settings.m_fanout_messages = settings.m_churn_connections = std::atoi(value);
+        else if (!std::strcmp(name, "--timeout-ms"))
+            settings.m_timeout_ms = std::atoi(value);
+        else if (!std::strcmp(name, "--max-workers"))
+            settings.m_max_workers = std::strtoul(value, nullptr, 10);
+        else
+            return false;
+    }
+    
+    return argc % 2 == 1;
+}
+
+int main(int argc, char **argv)
+{
+    benchmark_settings settings;
+    
+    if (!parse_arguments(argc, argv, settings))
+    {
+        std::fprintf(stderr, "usage: %s [--backend all|civetweb|apple|loopback]"
+                             " [--scenario all|echo|throughput|fanout|churn] [--port N] [--sizes a,b,...]"
+                             " [--clients a,b,...] [--messages N] [--timeout-ms N] [--max-workers N]\n",
+                     argv[0]);
+        return 1;
+    }
+    
+    if (settings.m_backend == "all" || settings.m_backend == "civetweb")
+    {
+        mg_init_library(0);
+        backend_benchmark<cw_ws_server, cw_ws_client>("civetweb", settings).run();
+        mg_exit_library();
+        settings.m_port += 100;
+    }
+
+#ifdef __APPLE__
+    if (settings.m_backend == "all" || settings.m_backend == "apple")
+        backend_benchmark<nw_ws_server, nw_ws_client>("apple", settings).run();
+#endif
+    
+    // In-process (measures the library and handlers without sockets)
+    
+    if (settings.m_backend == "all" || settings.m_backend == "loopback")
+        backend_benchmark<lb_ws_server, lb_ws_client>("loopback", settings).run();
+    
+    return 0;
+}
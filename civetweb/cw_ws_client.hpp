@@ -3,10 +3,22 @@
 #define CW_WS_CLIENT_HPP
 
 #include "../common/ws_handlers.hpp"
-#include "../common/ws_base.hpp"
+#include "../common/ws_client_base.hpp"
+#include "../common/ws_frame.hpp"
+#include "../common/ws_deflate.hpp"
+#include "../common/ws_message_assembler.hpp"
+#include "../common/ws_stats.hpp"
 
 #include "../dependencies/civetweb/include/civetweb.h"
 
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 // CivetWeb-based websocket client
 
 class cw_ws_client : public ws_client_base<cw_ws_client, struct mg_connection *>
@@ -19,60 +31,313 @@ public:
     
     ~cw_ws_client()
     {
-        // FIX
+        if (m_connect_thread.joinable())
+            m_connect_thread.join();
+        
+        // Closing joins CivetWeb's receive thread, so no handler can run after this
+        
+        if (m_handle)
+            mg_close_connection(m_handle);
     }
     
-    // Send
+    // Connection state
+    
+    bool ready() const { return m_ready.load(std::memory_order_acquire); }
+    
+    // Send (dropped unless ready, and counted as a send failure if dropped or not fully written)
     
-    void send(const void *data, size_t size)
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
     {
-        auto char_data = reinterpret_cast<const char *>(data);
-        int bytes = mg_websocket_client_write(m_handle, MG_WEBSOCKET_OPCODE_BINARY, char_data, size);
+        if (!connected())
+            return;
         
-        if (bytes != size)
+        if (m_deflater)
         {
-            // Handle errors
+            ws_buffer buffer { data, size };
+            ws_buffer_list message { &buffer, 1 };
+            write_messages(&message, 1, opcode);
+            return;
         }
+        
+        auto char_data = reinterpret_cast<const char *>(data);
+        int bytes = mg_websocket_client_write(m_handle, static_cast<int>(opcode), char_data, size);
+        
+        if (bytes == static_cast<int>(size))
+            m_stats.sent(ws_frame_header::size(size, true) + size);
+        else
+            m_stats.failed();
+    }
+    
+    // Send (gathered into one masked frame)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        ws_buffer_list message { buffers, count };
+        
+        if (connected())
+            write_messages(&message, 1, opcode);
+    }
+    
+    // Send one fragment of a message (the first with the message's opcode and the rest as continuations)
+    // No other data messages may be sent until the final fragment
+    
+    void send_fragment(const void *data, size_t size, ws_opcode opcode, bool final)
+    {
+        int flags = final ? 0 : ws_frame_header::fragment;
+        
+        if (connected())
+            write(ws_frame(static_cast<int>(opcode) | flags, data, size, true), final ? 1 : 0);
+    }
+    
+    // Send a batch of binary messages in a single write
+    
+    void send_batch(const ws_buffer_list *messages, size_t count)
+    {
+        if (connected())
+            write_messages(messages, count, ws_opcode::binary);
     }
     
 private:
     
-    // CivetWeb handler wrapper
+    // Check the client is ready to send (counting a failure if not)
+    
+    bool connected()
+    {
+        if (ready())
+            return true;
+        
+        m_stats.failed();
+        return false;
+    }
+    
+    // Write frames for one or more messages (holding the connection lock as mg_websocket_client_write does)
+    
+    bool write(const ws_frame& frame, size_t messages = 1)
+    {
+        mg_lock_connection(m_handle);
+        int bytes = mg_write(m_handle, frame.data(), frame.size());
+        mg_unlock_connection(m_handle);
+        
+        bool written = bytes == static_cast<int>(frame.size());
+        
+        if (written)
+            m_stats.sent(frame.size(), messages);
+        else
+            m_stats.failed();
+        
+        return written;
+    }
+    
+    // Frame and write messages (compressed if negotiated and over the threshold)
+    
+    bool write_messages(const ws_buffer_list *messages, size_t count, ws_opcode opcode)
+    {
+        if (m_deflater && !ws_is_control(opcode))
+        {
+            size_t size = 0;
+            
+            for (size_t i = 0; i < count; i++)
+                size += messages[i].size();
+            
+            if (size >= m_options.m_deflate.m_threshold)
+            {
+                // Compress and write in the same order, as the context may be shared between messages
+                
+                std::lock_guard<std::mutex> lock(m_deflate_mutex);
+                
+                auto frame = ws_frame_builder::compress(*m_deflater,
+                                                        static_cast<int>(opcode),
+                                                        messages,
+                                                        count,
+                                                        size,
+                                                        true);
+                if (!frame.empty())
+                    return write(frame, count);
+            }
+        }
+        
+        return write(ws_frame(static_cast<int>(opcode), messages, count, true), count);
+    }
+    
+    // Conversion to Client Object
+    
+    static cw_ws_client *as_client(void *x)
+    {
+        return reinterpret_cast<cw_ws_client *>(x);
+    }
+    
+    // CivetWeb handler wrapper (the client is the ID so that it is known before the connection exists)
     
     template <const ws_client_handlers& handlers>
     struct cw_handlers
     {
-        static int data(struct mg_connection *connection, int, char *buffer, size_t size, void *x)
+        static int data(struct mg_connection *, int bits, char *buffer, size_t size, void *x)
         {
-            auto id = as_ws_connection_id(connection);
-            handlers.m_receive(id, buffer, size, x);
+            auto client = as_client(x);
+            auto id = as_ws_connection_id(client);
+            auto start = ws_stats::now();
+            bool control = ws_is_control(static_cast<ws_opcode>(bits & 0x0F));
+            const void *data = buffer;
+            
+            // CivetWeb does not decompress for clients, so inflate messages marked with RSV1 (set on the first frame)
+            
+            if (client->m_assembler.starts_message(bits))
+                client->m_inflating = (bits & ws_frame_header::compressed) && client->m_inflater;
+            
+            if (client->m_inflating && !control)
+            {
+                bool final = bits & ws_message_assembler::fin_bit;
+                
+                if (!client->m_inflater->decompress(buffer, size, client->m_inflated, final))
+                    return 0;
+                
+                data = client->m_inflated.data();
+                size = client->m_inflated.size();
+            }
+            
+            client->m_stats.received(size, (bits & ws_message_assembler::fin_bit) ? 1 : 0);
+            
+            // CivetWeb passes on each frame, so reassemble (or stream) fragmented messages
+            
+            if (!client->m_assembler.receive(handlers, id, bits, data, size, client->m_owner))
+                return 0;
+            
+            client->m_stats.handled(start);
             return 1;
         }
         
-        static void close(const struct mg_connection *connection, void *x)
+        static void close(const struct mg_connection *, void *x)
         {
-            auto id = as_ws_connection_id(connection);
-            handlers.m_close(id, x);
+            auto client = as_client(x);
+            client->m_stats.closed();
+            handlers.m_close(as_ws_connection_id(client), client->m_owner);
         }
     };
     
+    // Connect (blocking) and report the outcome
+    
+    template <const ws_client_handlers& handlers>
+    void connect(const char *host, uint16_t port, const char *path)
+    {
+        auto id = as_ws_connection_id(this);
+        auto start = ws_stats::now();
+        auto& deflate = m_options.m_deflate;
+        bool offer_deflate = ws_deflate_available && deflate.m_enable;
+        std::string extensions = offer_deflate ? ws_deflate_params::offer(deflate) : std::string();
+        
+        // The server may send compressed messages as soon as the connection is made
+        
+        if (offer_deflate)
+            m_inflater.reset(new ws_inflater());
+        
+        const char *offer = offer_deflate ? extensions.c_str() : nullptr;
+        struct mg_connection *connection = nullptr;
+        
+        if (m_options.m_tls.m_enable)
+        {
+            auto& tls = m_options.m_tls;
+            
+            struct mg_client_options client_options = {};
+            client_options.host = host;
+            client_options.port = port;
+            client_options.client_cert = tls.m_certificate.empty() ? nullptr : tls.m_certificate.c_str();
+            client_options.server_cert = tls.m_ca_file.empty() ? nullptr : tls.m_ca_file.c_str();
+            client_options.host_name = tls.m_server_name.empty() ? host : tls.m_server_name.c_str();
+            
+            connection = mg_connect_websocket_client_secure_extensions(&client_options,
+                                                                       errors,      // errors buffer
+                                                                       256,         // errors buffer size
+                                                                       path,
+                                                                       "null",      // origin (use "null")
+                                                                       offer,
+                                                                       cw_handlers<handlers>::data,
+                                                                       cw_handlers<handlers>::close,
+                                                                       this);
+        }
+        else
+        {
+            connection = mg_connect_websocket_client_extensions(host,
+                                                                port,
+                                                                0,                  // ssl off
+                                                                errors,             // errors buffer
+                                                                256,                // errors buffer size
+                                                                path,
+                                                                "null",             // origin (use "null")
+                                                                offer,
+                                                                cw_handlers<handlers>::data,
+                                                                cw_handlers<handlers>::close,
+                                                                this);
+        }
+        
+        if (connection)
+        {
+            ws_deflate_params params;
+            
+            if (offer_deflate && params.parse(mg_get_header(connection, "Sec-WebSocket-Extensions")))
+            {
+                int window_bits = std::min(deflate.m_window_bits, params.m_client_window_bits);
+                bool takeover = deflate.m_context_takeover && !params.m_client_no_context_takeover;
+                
+                m_deflater.reset(new ws_deflater(deflate.m_level, window_bits, takeover));
+            }
+            
+            m_handle = connection;
+            m_ready.store(true, std::memory_order_release);
+            m_stats.connected(start);
+            
+            if constexpr (handlers.m_ready != nullptr)
+                handlers.m_ready(id, m_owner);
+        }
+        else
+        {
+            if constexpr (handlers.m_error != nullptr)
+                handlers.m_error(id, errno, m_owner);
+        }
+    }
+    
     // Constructor
     
     template <const ws_client_handlers& handlers>
-    cw_ws_client(const char *host, uint16_t port, const char *path, ws_client_owner<handlers> owner)
+    cw_ws_client(const char *host,
+                 uint16_t port,
+                 const char *path,
+                 ws_client_owner<handlers> owner,
+                 const ws_client_options& options,
+                 bool async)
+    : m_owner(owner.m_owner)
+    , m_options(options)
     {
-        m_handle = mg_connect_websocket_client(host,
-                                               port,
-                                               0,                           // ssl off
-                                               errors,                      // errors buffer
-                                               256,                         // errors buffer size
-                                               path,
-                                               "null",                      // origin (use "null")
-                                               cw_handlers<handlers>::data,
-                                               cw_handlers<handlers>::close,
-                                               owner.m_owner);
+        // CivetWeb only offers a blocking connect, so connect asynchronously on a thread of our own
+        
+        if (async)
+        {
+            std::string host_str(host);
+            std::string path_str(path);
+            
+            m_connect_thread = std::thread([this, host_str, port, path_str]()
+            {
+                connect<handlers>(host_str.c_str(), port, path_str.c_str());
+            });
+        }
+        else
+            connect<handlers>(host, port, path);
     }
     
+    void *m_owner;
+    const ws_client_options m_options;
+    std::atomic<bool> m_ready { false };
+    
+    // Compression state (receiving happens on CivetWeb's client thread only)
+    
+    std::unique_ptr<ws_deflater> m_deflater;
+    std::unique_ptr<ws_inflater> m_inflater;
+    std::vector<unsigned char> m_inflated;
+    std::mutex m_deflate_mutex;
+    bool m_inflating = false;
+    
+    ws_message_assembler m_assembler;
+    
+    std::thread m_connect_thread;
     char errors[256];
 };
 
@@ -4,14 +4,98 @@
 
 #include "../common/ws_handlers.hpp"
 #include "../common/ws_server_base.hpp"
+#include "../common/ws_connection.hpp"
+#include "../common/ws_frame.hpp"
+#include "../common/ws_deflate.hpp"
+#include "../common/ws_message_assembler.hpp"
+#include "../common/ws_stats.hpp"
 
 #include "../dependencies/civetweb/include/civetweb.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// CivetWeb per-connection state
+
+class cw_ws_connection : public ws_connection<cw_ws_connection, ws_frame>
+{
+public:
+    
+    cw_ws_connection(struct mg_connection *connection,
+                     const ws_send_queue_options& options,
+                     ws_handler_funcs::backpressure_handler backpressure,
+                     void *owner)
+    : ws_connection(options, backpressure, owner)
+    , m_connection(connection)
+    {}
+    
+    // Write pre-framed bytes (holding the connection lock as mg_websocket_write does)
+    
+    bool write(const ws_frame& frame)
+    {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        
+        if (m_closed)
+            return false;
+        
+        mg_lock_connection(m_connection);
+        int bytes = mg_write(m_connection, frame.data(), frame.size());
+        mg_unlock_connection(m_connection);
+        
+        return bytes == static_cast<int>(frame.size());
+    }
+    
+    // Ask CivetWeb to close the connection, unless it already has
+    //
+    // For a connection in websocket handling this only sets CivetWeb's close flag, which its reader checks between
+    // reads, so the close handler runs once the current read returns (when data arrives or at the websocket time out).
+    
+    void shutdown()
+    {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        
+        if (!m_closed)
+            mg_close_connection(m_connection);
+    }
+    
+    // Stop writing (waiting for any write in progress) so that CivetWeb can reuse the connection
+    
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        
+        m_closed = true;
+        m_queue.close();
+    }
+    
+    struct mg_connection *const m_connection;
+    std::atomic<bool> m_disconnect { false };
+    bool m_deflate = false;
+    ws_message_assembler m_assembler;
+    
+private:
+    
+    std::mutex m_write_mutex;
+    bool m_closed = false;
+};
+
 // CivetWeb-based websocket server
+//
+// The port may list several endpoints separated by commas, as CivetWeb's listening_ports does (for instance
+// "8080,8081" or "8080,[::]:8080"), and ports() reports each one bound.
 
-class cw_ws_server : public ws_server_base<cw_ws_server, mg_context *, struct mg_connection *>
+class cw_ws_server : public ws_server_base<cw_ws_server, mg_context *, cw_ws_connection *>
 {
     friend ws_base<cw_ws_server, mg_context *>;
+    friend ws_server_base<cw_ws_server, mg_context *, cw_ws_connection *>;
 
 public:
     
@@ -19,29 +103,164 @@ public:
     
     ~cw_ws_server()
     {
+        stop_heartbeat();
         mg_stop(m_handle);
+        stop_senders();
     }
 
-    // Send
+    // A message framed (and compressed, if enabled) once for sending to any number of connections
+    
+    using message = ws_prepared_frame;
+    
+    message prepare(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary) const
+    {
+        ws_buffer buffer { data, size };
+        
+        return prepare(&buffer, 1, opcode);
+    }
+    
+    message prepare(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary) const
+    {
+        ws_buffer_list list { buffers, count };
+        
+        return m_builder.prepare(static_cast<int>(opcode), &list, 1);
+    }
+    
+    // Send (queued and written by the sender threads)
+    
+    ws_send_result send(ws_connection_id id, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send(id, prepare(data, size, opcode));
+    }
+    
+    // Send (gathered)
+    
+    ws_send_result send(ws_connection_id id, const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send(id, prepare(buffers, count, opcode));
+    }
+    
+    // Send (prepared)
+    
+    ws_send_result send(ws_connection_id id, const message& frame)
+    {
+        ws_send_result result = ws_send_result::not_connected;
+        
+        visit_connection(id, [&](cw_ws_connection *connection)
+        {
+            result = enqueue(connection, frame);
+        });
+        
+        if (result == ws_send_result::not_connected)
+            m_stats.failed();
+        
+        return result;
+    }
+    
+    // Send (prepared to all)
+    
+    void send(const message& frame)
+    {
+        for_each_connection([&](cw_ws_connection *connection)
+        {
+            enqueue(connection, frame);
+        });
+    }
+    
+    // Send (prepared to the members of a group) and return the number queued
+    
+    size_t send_to_group(ws_group_id group, const message& frame)
+    {
+        size_t queued = 0;
+        
+        for_each_in_group(group, [&](cw_ws_connection *connection)
+        {
+            if (accepted(enqueue(connection, frame)))
+                queued++;
+        });
+        
+        return queued;
+    }
+    
+    // Send (to the members of a group)
     
-    void send(ws_connection_id id, const void *data, size_t size)
+    size_t send_to_group(ws_group_id group, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
     {
-        auto const_char_data = reinterpret_cast<const char *>(data);
-        mg_websocket_write(find(id), MG_WEBSOCKET_OPCODE_BINARY, const_char_data, size);
+        return send_to_group(group, prepare(data, size, opcode));
+    }
+    
+    // Send (gathered to the members of a group)
+    
+    size_t send_to_group(ws_group_id group,
+                         const ws_buffer *buffers,
+                         size_t count,
+                         ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_to_group(group, prepare(buffers, count, opcode));
     }
     
     // Send (to all)
     
-    void send(const void *data, size_t size)
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
     {
-        auto const_char_data = reinterpret_cast<const char *>(data);
-
-        for (auto it = m_map_from_id.begin(); it != m_map_from_id.end(); it++)
-            mg_websocket_write(it->second, MG_WEBSOCKET_OPCODE_BINARY, const_char_data, size);
+        send(prepare(data, size, opcode));
+    }
+    
+    // Send (gathered to all)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        send(prepare(buffers, count, opcode));
+    }
+    
+    // Send one fragment of a message (the first with the message's opcode and the rest as continuations)
+    // No other data messages may be sent to the connection until the final fragment (the coalesce policy never
+    // discards queued fragments, so a message is not broken up)
+    
+    ws_send_result send_fragment(ws_connection_id id, const void *data, size_t size, ws_opcode opcode, bool final)
+    {
+        ws_buffer buffer { data, size };
+        ws_buffer_list list { &buffer, 1 };
+        int flags = final ? 0 : ws_frame_header::fragment;
+        
+        return send(id, m_builder.prepare(static_cast<int>(opcode) | flags, &list, 1));
+    }
+    
+    // Send a batch of binary messages (those for each connection are framed into a single write)
+    // Returns the number queued
+    
+    size_t send_batch(const ws_batch_message *messages, size_t count)
+    {
+        size_t queued = 0;
+        
+        group_batch(messages, count, [&](ws_connection_id id, const ws_buffer_list *group, size_t size)
+        {
+            auto frame = m_builder.prepare(static_cast<int>(ws_opcode::binary), group, size);
+            
+            bool found = visit_connection(id, [&](cw_ws_connection *connection)
+            {
+                if (accepted(enqueue(connection, frame, size)))
+                    queued += size;
+            });
+            
+            if (!found)
+                m_stats.failed();
+        });
+        
+        return queued;
     }
     
 private:
     
+    // The number of bytes written for one connection before moving on to the next
+    
+    static constexpr size_t sender_quantum = 256 * 1024;
+    
+    // Worker threads per core when sizing the pool from the hardware (at least CivetWeb's default of 50 overall)
+    
+    static constexpr unsigned int workers_per_core = 32;
+    static constexpr unsigned int min_workers = 50;
+    
     // Conversion to Server Object
     
     static cw_ws_server *as_server(void *x)
@@ -49,6 +268,342 @@ private:
         return reinterpret_cast<cw_ws_server *>(x);
     }
     
+    // Retrieve the state stored with a connection
+    
+    static cw_ws_connection *get_state(const struct mg_connection *connection)
+    {
+        return reinterpret_cast<cw_ws_connection *>(mg_get_user_connection_data(connection));
+    }
+    
+    // Queue a frame (holding one or more messages) and schedule the connection if needed
+    
+    ws_send_result enqueue(cw_ws_connection *connection, const message& prepared, size_t messages = 1)
+    {
+        const ws_frame& frame = prepared.get(connection->m_deflate);
+        auto result = connection->push(frame, frame.size());
+        
+        if (accepted(result.m_result))
+        {
+            connection->m_stats.sent(frame.size(), messages);
+            connection->capture(ws_capture_event::sent, 0, frame.data(), frame.size(), true);
+        }
+        else
+            connection->m_stats.failed();
+        
+        if (result.m_result == ws_send_result::disconnecting)
+            disconnect(connection);
+        else if (result.m_schedule)
+            schedule(connection, connection->m_batching.load(std::memory_order_relaxed));
+        
+        return result.m_result;
+    }
+    
+    // Replace the queue with a close frame (1008 - policy violation by default) and close the connection
+    //
+    // The sender thread closes the connection once the close frame is written, or once a write times out (after
+    // CivetWeb's websocket time out) if a stalled peer lets the socket fill. CivetWeb then drops it after its reader's
+    // next read or read time out, and any frame received in between also closes it.
+    
+    void disconnect(cw_ws_connection *connection, uint16_t code = 1008)
+    {
+        const unsigned char status[2] = { static_cast<unsigned char>(code >> 8), static_cast<unsigned char>(code) };
+        ws_frame frame(MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE, status, sizeof(status));
+        
+        connection->m_disconnect.store(true);
+        
+        if (connection->m_queue.close(frame, frame.size()))
+            schedule(connection);
+    }
+    
+    // Heartbeats (pings are queued behind other messages, so round trip times include any wait to be written)
+    
+    template <const ws_server_handlers&>
+    void ping(cw_ws_connection *connection, uint64_t stamp)
+    {
+        ws_frame frame(MG_WEBSOCKET_OPCODE_PING, &stamp, sizeof(stamp));
+        
+        if (connection->push(frame, frame.size()).m_schedule)
+            schedule(connection);
+    }
+    
+    // Queue a close with 1001 (going away) and close the connection at once, as an idle peer may never read the frame
+    //
+    // CivetWeb's reader then drops the connection once its current read times out, which with heartbeats enabled is
+    // at most the heartbeat time out (the websocket time out is capped to it).
+    
+    void close_idle(cw_ws_connection *connection)
+    {
+        disconnect(connection, 1001);
+        connection->shutdown();
+    }
+    
+    // Sender threads (connections that are batching wait out the delay first, in order as the delay is fixed)
+    
+    void schedule(cw_ws_connection *connection, bool delay = false)
+    {
+        connection->retain();
+        
+        {
+            std::lock_guard<std::mutex> lock(m_ready_mutex);
+            
+            if (delay)
+                m_delayed.emplace_back(std::chrono::steady_clock::now() + batch_delay(), connection);
+            else
+                m_ready.push_back(connection);
+        }
+        
+        m_ready_condition.notify_one();
+    }
+    
+    std::chrono::microseconds batch_delay() const
+    {
+        return std::chrono::microseconds(std::max(0, m_options.m_batching.m_max_delay_us));
+    }
+    
+    void start_senders(unsigned int count)
+    {
+        if (!count)
+            count = std::max(1U, std::thread::hardware_concurrency());
+        
+        for (unsigned int i = 0; i < count; i++)
+            m_senders.emplace_back(&cw_ws_server::sender_loop, this);
+    }
+    
+    void stop_senders()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_ready_mutex);
+            m_stop = true;
+        }
+        
+        m_ready_condition.notify_all();
+        
+        for (auto it = m_senders.begin(); it != m_senders.end(); it++)
+            it->join();
+    }
+    
+    void sender_loop()
+    {
+        std::vector<ws_frame> batch;
+        
+        while (true)
+        {
+            cw_ws_connection *connection = nullptr;
+            
+            {
+                std::unique_lock<std::mutex> lock(m_ready_mutex);
+                
+                // Take a delayed connection once due (or when stopping), else the next ready one
+                
+                while (true)
+                {
+                    bool delayed = !m_delayed.empty();
+                    
+                    if (delayed && (m_stop || m_delayed.front().first <= std::chrono::steady_clock::now()))
+                    {
+                        connection = m_delayed.front().second;
+                        m_delayed.pop_front();
+                        break;
+                    }
+                    
+                    if (!m_ready.empty())
+                    {
+                        connection = m_ready.front();
+                        m_ready.pop_front();
+                        break;
+                    }
+                    
+                    if (m_stop)
+                        return;
+                    
+                    if (delayed)
+                        m_ready_condition.wait_until(lock, m_delayed.front().first);
+                    else
+                        m_ready_condition.wait(lock);
+                }
+            }
+            
+            if (drain(connection, batch))
+            {
+                // Keep the reference and go to the back of the line
+                
+                std::lock_guard<std::mutex> lock(m_ready_mutex);
+                m_ready.push_back(connection);
+            }
+            else
+                connection->release();
+        }
+    }
+    
+    // Write queued frames for one connection (returns true if there is more to write)
+    
+    bool drain(cw_ws_connection *connection, std::vector<ws_frame>& batch)
+    {
+        if (connection->m_batching.load(std::memory_order_relaxed))
+            return drain_batched(connection, batch);
+        
+        ws_frame frame;
+        size_t bytes;
+        
+        for (size_t written = 0; written < sender_quantum; written += bytes)
+        {
+            if (!connection->m_queue.pop(frame, bytes))
+                return false;
+            
+            write(connection, frame);
+            connection->complete(bytes);
+            finish_disconnect(connection, frame);
+        }
+        
+        return true;
+    }
+    
+    // Write queued frames, joining each run that fits within the batch size into one buffer written at once
+    
+    bool drain_batched(cw_ws_connection *connection, std::vector<ws_frame>& batch)
+    {
+        size_t bytes = 0;
+        
+        auto add = [&](ws_frame& frame, size_t size)
+        {
+            batch.push_back(std::move(frame));
+            bytes += size;
+        };
+        
+        for (size_t written = 0; written < sender_quantum; written += bytes)
+        {
+            bytes = 0;
+            
+            size_t count = connection->m_queue.pop_batch(add, m_options.m_batching.m_max_batch_size);
+            
+            if (!count)
+                return false;
+            
+            write(connection, count == 1 ? batch[0] : ws_frame(batch.data(), count));
+            connection->complete(bytes, count);
+            finish_disconnect(connection, batch[count - 1]);
+            batch.clear();
+        }
+        
+        return true;
+    }
+    
+    // Write to a connection, closing it on failure
+    
+    static void write(cw_ws_connection *connection, const ws_frame& frame)
+    {
+        if (!connection->write(frame))
+        {
+            connection->m_stats.failed();
+            connection->m_disconnect.store(true);
+            connection->shutdown();
+            connection->close();
+        }
+    }
+    
+    // Close a disconnecting connection once its close frame has been written
+    
+    static void finish_disconnect(cw_ws_connection *connection, const ws_frame& frame)
+    {
+        auto bytes = static_cast<const unsigned char *>(frame.data());
+        bool close = frame.size() && (bytes[0] & 0x0F) == MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE;
+        
+        if (close && connection->m_disconnect.load())
+            connection->shutdown();
+    }
+    
+    // The listening ports (with the "s" suffix on each when using TLS)
+    
+    static std::string listening_ports(const char *port, bool tls)
+    {
+        std::string ports;
+        std::string entry;
+        
+        for (const char *c = port; ; c++)
+        {
+            if (*c && *c != ',')
+            {
+                entry += *c;
+                continue;
+            }
+            
+            if (tls && (entry.empty() || entry.back() != 's'))
+                entry += 's';
+            
+            ports += ports.empty() ? entry : "," + entry;
+            entry.clear();
+            
+            if (!*c)
+                return ports;
+        }
+    }
+    
+    // Build CivetWeb configuration as name/value pairs
+    
+    static std::vector<std::string> configuration(const char *port, const ws_server_options& options)
+    {
+        std::vector<std::string> config;
+        
+        auto add = [&](const char *name, const std::string& value)
+        {
+            config.emplace_back(name);
+            config.push_back(value);
+        };
+        
+        auto add_if_set = [&](const char *name, int value)
+        {
+            if (value > 0)
+                add(name, std::to_string(value));
+        };
+        
+        unsigned int workers = options.m_worker_threads;
+        
+        if (!workers)
+            workers = std::max(min_workers, std::thread::hardware_concurrency() * workers_per_core);
+        
+        add("listening_ports", listening_ports(port, options.m_tls.m_enable));
+        add("num_threads", std::to_string(workers));
+        add("tcp_nodelay", options.m_tcp.m_no_delay ? "1" : "0");
+        add("enable_keep_alive", options.m_keep_alive ? "yes" : "no");
+        add("keep_alive_timeout_ms", std::to_string(options.m_keep_alive_timeout_ms));
+        add_if_set("listen_backlog", options.m_listen_backlog);
+        add_if_set("connection_queue", options.m_connection_queue);
+        
+        // With heartbeats the websocket time out is no longer than the heartbeat time out, so that the reader of an
+        // idle connection closed by the heartbeat returns promptly (healthy connections answer pings well within it)
+        
+        int websocket_timeout_ms = options.m_websocket_timeout_ms;
+        
+        if (options.m_heartbeat.m_enable && options.m_heartbeat.m_timeout_ms > 0)
+        {
+            if (!websocket_timeout_ms || websocket_timeout_ms > options.m_heartbeat.m_timeout_ms)
+                websocket_timeout_ms = options.m_heartbeat.m_timeout_ms;
+        }
+        
+        add_if_set("websocket_timeout_ms", websocket_timeout_ms);
+        
+        // TLS (a session cache lets reconnecting clients resume rather than perform a full handshake)
+        
+        auto& tls = options.m_tls;
+        
+        if (tls.m_enable)
+        {
+            add("ssl_certificate", tls.m_certificate);
+            add("ssl_protocol_version", "4");             // TLS 1.2 or later
+            
+            if (!tls.m_ca_file.empty())
+            {
+                add("ssl_ca_file", tls.m_ca_file);
+                add("ssl_verify_peer", "yes");
+            }
+            
+            if (tls.m_resumption)
+                add_if_set("ssl_cache_timeout", tls.m_session_cache_timeout);
+        }
+        
+        return config;
+    }
+    
     // CivetWeb handler wrapper
     
     template <const ws_server_handlers& handlers>
@@ -56,71 +611,117 @@ private:
     {
         static int connect(const struct mg_connection *connection, void *x)
         {
-            auto id = as_server(x)->add_connection(const_cast<struct mg_connection *>(connection));
-            handlers.m_connect(id, get_owner(connection, x));
+            auto server = as_server(x);
+            auto state = new cw_ws_connection(const_cast<struct mg_connection *>(connection),
+                                              server->m_options.m_send_queue,
+                                              handlers.m_backpressure,
+                                              server->m_owner);
+            
+            // CivetWeb agrees to permessage-deflate whenever it is offered (if built with support for it)
+
+#if defined(USE_ZLIB) && defined(MG_EXPERIMENTAL_INTERFACES)
+            ws_deflate_params params;
+            params.parse(mg_get_header(connection, "Sec-WebSocket-Extensions"));
+            state->m_deflate = server->m_builder.usable(params);
+#endif
+            
+            state->m_batching.store(server->m_options.m_batching.m_enable);
+            
+            auto id = server->add_connection(state);
+            
+            // Reject the connection if the registry is full
+            
+            if (!id)
+            {
+                state->release();
+                return 1;
+            }
+            
+            mg_set_user_connection_data(connection, state);
+            handlers.m_connect(id, server->m_owner);
             return 0;
         }
         
-        static void ready(struct mg_connection *connection, void *x)
+        static void ready(struct mg_connection *connection, void *)
         {
-            auto id = as_server(x)->find(connection);
-            handlers.m_ready(id, get_owner(connection, x));
+            auto state = get_state(connection);
+            
+            state->m_stats.connected();
+            handlers.m_ready(state->m_id, state->user_data());
         }
         
-        static int receive(struct mg_connection *connection, int, char *buffer, size_t size, void *x)
+        static int receive(struct mg_connection *connection, int bits, char *buffer, size_t size, void *)
         {
-            auto id = as_server(x)->find(connection);
-            handlers.m_receive(id, buffer, size, get_owner(connection, x));
-            return 1;
+            auto state = get_state(connection);
+            auto start = ws_stats::now();
+            
+            state->m_stats.received(size, (bits & ws_message_assembler::fin_bit) ? 1 : 0);
+            
+            if (received<handlers>(state, bits, buffer, size))
+                return 1;
+            
+            // CivetWeb passes on each frame, so reassemble (or stream) fragmented messages
+            
+            if (!state->m_assembler.receive(handlers, state->m_id, bits, buffer, size, state->user_data()))
+                return 0;
+            
+            state->m_stats.handled(start);
+            
+            return state->m_disconnect.load() ? 0 : 1;
         }
         
         static void close(const struct mg_connection *connection, void *x)
         {
-            auto id = as_server(x)->remove_connection(connection);
-            handlers.m_close(id, get_owner(connection, x));
-        }
-        
-        // Cast server object
-        
-        static void *get_owner(const struct mg_connection *connection, void *untyped_local_server)
-        {
-            const struct mg_request_info *request_info = mg_get_request_info(connection);
+            auto state = get_state(connection);
+            
+            if (!state)
+                return;
             
-            assert(request_info != nullptr);
+            auto id = state->m_id;
             
-            void *owner = request_info->user_data;
+            // Remove, then wait for any write in progress before the connection can be reused
             
-            assert(as_server(untyped_local_server)->m_owner == owner);
-                        
-            return owner;
+            as_server(x)->remove_connection(id);
+            state->close();
+            state->m_stats.closed();
+            handlers.m_close(id, state->user_data());
+            
+            state->release();
         }
+        
     };
     
     // Constructor
 
     template <const ws_server_handlers& handlers>
-    cw_ws_server(const char *port, const char *path, ws_server_owner<handlers> owner)
+    cw_ws_server(const char *port, const char *path, ws_server_owner<handlers> owner, const ws_server_options& options)
     : m_owner(owner.m_owner)
+    , m_options(options)
+    , m_builder(options.m_deflate)
     {
-        const char* options[] =
-        {
-            "listening_ports", port,
-            "tcp_nodelay", "1",
-            "enable_keep_alive", "yes",
-            "keep_alive_timeout_ms", "500",
-            NULL
-        };
+        auto config = configuration(port, m_options);
+        std::vector<const char *> mg_options;
+        
+        for (auto it = config.begin(); it != config.end(); it++)
+            mg_options.push_back(it->c_str());
+        
+        mg_options.push_back(NULL);
         
         struct mg_init_data mg_start_init_data = {};
         mg_start_init_data.callbacks = nullptr;
         mg_start_init_data.user_data = owner.m_owner;
-        mg_start_init_data.configuration_options = options;
+        mg_start_init_data.configuration_options = mg_options.data();
         
         struct mg_error_data mg_start_error_data = {};
         char errtxtbuf[256] = {0};
         mg_start_error_data.text = errtxtbuf;
         mg_start_error_data.text_buffer_size = sizeof(errtxtbuf);
         
+        // Capture and heartbeats start before connections can arrive
+        
+        start_capture(m_options.m_capture);
+        start_heartbeat<handlers>(m_options.m_heartbeat);
+        
         m_handle = mg_start2(&mg_start_init_data, &mg_start_error_data);
         
         if (m_handle)
@@ -133,15 +734,49 @@ private:
                                      cw_handlers<handlers>::close,
                                      this);
             
-            mg_server_port ports[1];
+            record_ports();
+            
+            start_senders(m_options.m_send_threads);
+        }
+    }
+    
+    // Record every bound port (CivetWeb fills in as many as fit, so grow until some room is left)
+    
+    void record_ports()
+    {
+        std::vector<mg_server_port> ports(8);
+        int count = 0;
+        
+        while (true)
+        {
+            int size = static_cast<int>(ports.size());
+            count = mg_get_server_ports(m_handle, size, ports.data());
             
-            if (mg_get_server_ports(m_handle, 1, ports))
-                m_port = static_cast<uint16_t>(ports[0].port);
+            if (count < size)
+                break;
             
+            ports.resize(ports.size() * 2);
         }
+        
+        for (int i = 0; i < count; i++)
+            m_ports.push_back(static_cast<uint16_t>(ports[i].port));
+        
+        if (!m_ports.empty())
+            m_port = m_ports.front();
     }
     
     void *m_owner;
+    const ws_server_options m_options;
+    const ws_frame_builder m_builder;
+    
+    // Sender state
+    
+    std::mutex m_ready_mutex;
+    std::condition_variable m_ready_condition;
+    std::deque<cw_ws_connection *> m_ready;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, cw_ws_connection *>> m_delayed;
+    std::vector<std::thread> m_senders;
+    bool m_stop = false;
 };
 
 #endif /* CW_WS_SERVER_HPP */
@@ -0,0 +1,60 @@
+
+#ifndef WS_ALLOCATOR_HPP
+#define WS_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+
+// An allocator for message payload buffers (frames on CivetWeb and outbound message copies on Apple)
+//
+// The default uses operator new and delete. Replace it at startup before any messages are created, as buffers are
+// returned to whichever allocator is current when they are freed. Both functions must be thread-safe.
+
+struct ws_allocator
+{
+    using allocate_func = void *(*)(size_t size, void *context);
+    using deallocate_func = void (*)(void *ptr, size_t size, void *context);
+    
+    allocate_func m_allocate;
+    deallocate_func m_deallocate;
+    void *m_context;
+    
+    // Default functions
+    
+    static void *default_allocate(size_t size, void *)
+    {
+        return ::operator new(size);
+    }
+    
+    static void default_deallocate(void *ptr, size_t, void *)
+    {
+        ::operator delete(ptr);
+    }
+    
+    bool is_default() const
+    {
+        return m_allocate == default_allocate && m_deallocate == default_deallocate;
+    }
+    
+    // Use the allocator
+    
+    void *allocate(size_t size) const { return m_allocate(size, m_context); }
+    void deallocate(void *ptr, size_t size) const { m_deallocate(ptr, size, m_context); }
+};
+
+// The current payload allocator
+
+inline ws_allocator& ws_payload_allocator()
+{
+    static ws_allocator allocator { ws_allocator::default_allocate, ws_allocator::default_deallocate, nullptr };
+    return allocator;
+}
+
+// Replace the payload allocator
+
+inline void ws_set_payload_allocator(const ws_allocator& allocator)
+{
+    ws_payload_allocator() = allocator;
+}
+
+#endif /* WS_ALLOCATOR_HPP */
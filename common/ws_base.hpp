@@ -2,12 +2,31 @@
 #ifndef WS_BASE_HPP
 #define WS_BASE_HPP
 
+#include <cstddef>
 #include <cstdint>
 
 // Type for Connection IDs
 
 using ws_connection_id = uintptr_t;
 
+// Websocket opcodes (RFC 6455 section 5.2)
+// Control frames (close, ping and pong) carry at most 125 bytes and are never compressed
+
+enum class ws_opcode
+{
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xA
+};
+
+inline bool ws_is_control(ws_opcode opcode)
+{
+    return static_cast<int>(opcode) & 0x8;
+}
+
 // Use an arbitrary pointer as an ID (e.g. in clients)
 
 ws_connection_id as_ws_connection_id(const void *ptr)
@@ -15,6 +34,40 @@ ws_connection_id as_ws_connection_id(const void *ptr)
     return reinterpret_cast<uintptr_t>(ptr);
 }
 
+// A buffer for scatter/gather sends and receives
+
+struct ws_buffer
+{
+    const void *m_data;
+    size_t m_size;
+};
+
+// A message made up from a list of buffers
+
+struct ws_buffer_list
+{
+    const ws_buffer *m_buffers;
+    size_t m_count;
+    
+    size_t size() const
+    {
+        size_t size = 0;
+        
+        for (size_t i = 0; i < m_count; i++)
+            size += m_buffers[i].m_size;
+        
+        return size;
+    }
+};
+
+// A message for a specific connection (for batched sends)
+
+struct ws_batch_message
+{
+    ws_connection_id m_id;
+    ws_buffer_list m_message;
+};
+
 // A base class for all websocket clients/servers
 
 template <class T, class handle_type>
@@ -38,6 +91,14 @@ protected:
         return object;
     }
     
+    // Create an object whose handle may not be set until later
+    
+    template <typename ...Args>
+    static T *create_async(Args...args)
+    {
+        return new T(args...);
+    }
+    
     // Server or Client Handle
     
     handle_type m_handle = nullptr;
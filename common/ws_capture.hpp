@@ -0,0 +1,427 @@
+
+#ifndef WS_CAPTURE_HPP
+#define WS_CAPTURE_HPP
+
+#include "ws_base.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The events in a capture log
+//
+// received - one frame's payload (on Apple a message, or a chunk of one when streaming), with its FIN bit and opcode
+// sent     - outbound data as queued: whole frames with their headers on CivetWeb and loopback (marked as framed), or a
+//            message's payload with its opcode on Apple
+
+enum class ws_capture_event : uint8_t
+{
+    opened = 1,
+    closed = 2,
+    received = 3,
+    sent = 4
+};
+
+// A record read from a capture log (the time is in nanoseconds since the log was opened)
+
+struct ws_capture_record
+{
+    uint64_t m_time_ns;
+    ws_connection_id m_id;
+    ws_capture_event m_event;
+    int m_bits;
+    bool m_framed;
+    const void *m_data;
+    size_t m_size;
+    
+    ws_opcode opcode() const { return static_cast<ws_opcode>(m_bits & 0x0F); }
+    bool final() const { return m_bits & 0x80; }
+};
+
+// The layout of a capture log file (records follow the header, each padded to a multiple of 8 bytes)
+
+struct ws_capture_format
+{
+    static constexpr char magic[8] = { 'W', 'S', 'C', 'A', 'P', 'T', '0', '1' };
+    
+    struct file_header
+    {
+        char m_magic[8];
+        uint64_t m_size;                    // The bytes of records (zero if the log was not closed)
+        uint64_t m_dropped;                 // Records that did not fit
+        uint64_t m_reserved;
+    };
+    
+    struct record_header
+    {
+        uint64_t m_time_ns;
+        uint64_t m_id;
+        uint32_t m_size;
+        uint8_t m_event;
+        uint8_t m_bits;
+        uint16_t m_flags;
+    };
+    
+    static constexpr uint16_t framed = 0x1;
+    
+    static size_t padded(size_t size) { return (size + 7) & ~size_t(7); }
+    
+    // A record's event, which publishes it (written last with a release store and read first with an acquire load)
+    
+    using event_flag = std::atomic<uint8_t>;
+    
+    static_assert(sizeof(event_flag) == 1 && event_flag::is_always_lock_free, "event flags must be plain bytes");
+    
+    static event_flag *event(unsigned char *record)
+    {
+        return reinterpret_cast<event_flag *>(record + offsetof(record_header, m_event));
+    }
+    
+    static const event_flag *event(const unsigned char *record)
+    {
+        return reinterpret_cast<const event_flag *>(record + offsetof(record_header, m_event));
+    }
+};
+
+// An append-only capture log in a memory-mapped file of fixed capacity
+//
+// Appending reserves space with one atomic add and copies the record straight into the mapping, so writers on any
+// thread never lock or call the kernel. Records that do not fit are dropped and counted. Closing (or destroying) the
+// log truncates the file to the records written, and must only happen once nothing can append. A log that was never
+// closed can still be read whilst it is written (by any process mapping the file on the same machine), up to the first
+// record that had not been published - each record's event is stored last, with release ordering, after the rest of
+// it has been written.
+
+class ws_capture_log
+{
+    using file_header = ws_capture_format::file_header;
+    using record_header = ws_capture_format::record_header;
+    
+public:
+    
+    ws_capture_log() {}
+    ws_capture_log(const ws_capture_log&) = delete;
+    ws_capture_log& operator=(const ws_capture_log&) = delete;
+    
+    ~ws_capture_log()
+    {
+        close();
+    }
+    
+    // Create (or replace) a log file with room for the given bytes of records (returns false on failure)
+    
+    bool open(const char *path, size_t capacity)
+    {
+        close();
+        
+        capacity = ws_capture_format::padded(capacity);
+        
+        int file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        
+        if (file < 0)
+            return false;
+        
+        size_t size = sizeof(file_header) + capacity;
+        void *base = MAP_FAILED;
+        
+        if (ftruncate(file, static_cast<off_t>(size)) == 0)
+            base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        
+        if (base == MAP_FAILED)
+        {
+            ::close(file);
+            return false;
+        }
+        
+        m_file = file;
+        m_base = static_cast<unsigned char *>(base);
+        m_capacity = capacity;
+        m_used.store(0);
+        m_end.store(capacity);
+        m_dropped.store(0);
+        m_start = std::chrono::steady_clock::now();
+        
+        std::memcpy(header()->m_magic, ws_capture_format::magic, sizeof(ws_capture_format::magic));
+        
+        return true;
+    }
+    
+    // Record the size, unmap and truncate the file to what was written
+    
+    void close()
+    {
+        if (!m_base)
+            return;
+        
+        uint64_t size = std::min(m_used.load(), m_end.load());
+        
+        header()->m_size = size;
+        header()->m_dropped = m_dropped.load();
+        
+        munmap(m_base, sizeof(file_header) + m_capacity);
+        
+        // Should truncating fail the file keeps its unused capacity, which readers skip as it holds no records
+        
+        int result = ftruncate(m_file, static_cast<off_t>(sizeof(file_header) + size));
+        (void) result;
+        
+        ::close(m_file);
+        
+        m_base = nullptr;
+        m_file = -1;
+    }
+    
+    bool is_open() const { return m_base; }
+    
+    // Append a record (the bits are a frame's FIN bit and opcode)
+    
+    void append(ws_capture_event event,
+                ws_connection_id id,
+                int bits = 0,
+                const void *data = nullptr,
+                size_t size = 0,
+                bool framed = false)
+    {
+        ws_buffer buffer { data, size };
+        
+        append(event, id, bits, &buffer, 1, framed);
+    }
+    
+    // Append a record gathered from buffers
+    
+    void append(ws_capture_event event,
+                ws_connection_id id,
+                int bits,
+                const ws_buffer *buffers,
+                size_t count,
+                bool framed = false)
+    {
+        size_t size = 0;
+        
+        for (size_t i = 0; i < count; i++)
+            size += buffers[i].m_size;
+        
+        if (size > UINT32_MAX)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        
+        unsigned char *out = reserve(sizeof(record_header) + ws_capture_format::padded(size));
+        
+        if (!out)
+            return;
+        
+        record_header record;
+        record.m_time_ns = now();
+        record.m_id = id;
+        record.m_size = static_cast<uint32_t>(size);
+        record.m_event = 0;
+        record.m_bits = static_cast<uint8_t>(bits & 0x8F);
+        record.m_flags = framed ? ws_capture_format::framed : 0;
+        
+        unsigned char *payload = out + sizeof(record_header);
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            if (buffers[i].m_size)
+                std::memcpy(payload, buffers[i].m_data, buffers[i].m_size);
+            
+            payload += buffers[i].m_size;
+        }
+        
+        // Write the header with no event (as the reserved space already has), then publish the record
+        
+        std::memcpy(out, &record, sizeof(record));
+        ws_capture_format::event(out)->store(static_cast<uint8_t>(event), std::memory_order_release);
+    }
+    
+    // Records dropped for want of space
+    
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+    
+    // Bytes of records written (or being written)
+    
+    size_t size() const { return std::min(m_used.load(), m_end.load()); }
+    size_t capacity() const { return m_capacity; }
+    
+private:
+    
+    file_header *header() { return reinterpret_cast<file_header *>(m_base); }
+    
+    uint64_t now() const
+    {
+        auto time = std::chrono::steady_clock::now() - m_start;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+    }
+    
+    // Reserve space for a record (the end moves back to the first reservation that failed, which later ones follow)
+    
+    unsigned char *reserve(size_t size)
+    {
+        if (!m_base)
+            return nullptr;
+        
+        size_t offset = m_used.fetch_add(size, std::memory_order_relaxed);
+        
+        if (size > m_capacity || offset > m_capacity - size)
+        {
+            size_t end = m_end.load(std::memory_order_relaxed);
+            
+            while (offset < end && !m_end.compare_exchange_weak(end, offset, std::memory_order_relaxed));
+            
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        
+        return m_base + sizeof(file_header) + offset;
+    }
+    
+    int m_file = -1;
+    unsigned char *m_base = nullptr;
+    size_t m_capacity = 0;
+    std::atomic<size_t> m_used { 0 };
+    std::atomic<size_t> m_end { 0 };
+    std::atomic<uint64_t> m_dropped { 0 };
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// A capture log mapped read-only for reading its records in order
+
+class ws_capture_reader
+{
+    using file_header = ws_capture_format::file_header;
+    using record_header = ws_capture_format::record_header;
+    
+public:
+    
+    ws_capture_reader() {}
+    ws_capture_reader(const ws_capture_reader&) = delete;
+    ws_capture_reader& operator=(const ws_capture_reader&) = delete;
+    
+    ~ws_capture_reader()
+    {
+        close();
+    }
+    
+    // Open a log (returns false if it cannot be read or is not a capture log)
+    
+    bool open(const char *path)
+    {
+        close();
+        
+        int file = ::open(path, O_RDONLY);
+        struct stat info;
+        
+        if (file < 0)
+            return false;
+        
+        void *base = MAP_FAILED;
+        
+        if (fstat(file, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(file_header))
+            base = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, file, 0);
+        
+        ::close(file);
+        
+        if (base == MAP_FAILED)
+            return false;
+        
+        m_base = static_cast<const unsigned char *>(base);
+        m_mapped = static_cast<size_t>(info.st_size);
+        
+        if (std::memcmp(header()->m_magic, ws_capture_format::magic, sizeof(ws_capture_format::magic)))
+        {
+            close();
+            return false;
+        }
+        
+        // An unclosed log has no size, so is read up to the end of the mapping (or the first empty record)
+        
+        size_t available = m_mapped - sizeof(file_header);
+        m_size = header()->m_size ? std::min(static_cast<size_t>(header()->m_size), available) : available;
+        
+        return true;
+    }
+    
+    void close()
+    {
+        if (m_base)
+            munmap(const_cast<unsigned char *>(m_base), m_mapped);
+        
+        m_base = nullptr;
+        m_mapped = 0;
+        m_size = 0;
+    }
+    
+    bool is_open() const { return m_base; }
+    
+    uint64_t dropped() const { return m_base ? header()->m_dropped : 0; }
+    
+    // Read the record at an offset and move the offset past it (returns false at the end)
+    
+    bool next(size_t& offset, ws_capture_record& record) const
+    {
+        record_header header;
+        
+        if (!m_base || offset > m_size || m_size - offset < sizeof(record_header))
+            return false;
+        
+        const unsigned char *in = m_base + sizeof(file_header) + offset;
+        
+        // Check the record is published before reading the rest of it
+        
+        uint8_t event = ws_capture_format::event(in)->load(std::memory_order_acquire);
+        
+        if (!event)
+            return false;
+        
+        std::memcpy(&header, in, sizeof(header));
+        
+        size_t length = sizeof(record_header) + ws_capture_format::padded(header.m_size);
+        
+        if (length > m_size - offset)
+            return false;
+        
+        record.m_time_ns = header.m_time_ns;
+        record.m_id = static_cast<ws_connection_id>(header.m_id);
+        record.m_event = static_cast<ws_capture_event>(event);
+        record.m_bits = header.m_bits;
+        record.m_framed = header.m_flags & ws_capture_format::framed;
+        record.m_data = in + sizeof(record_header);
+        record.m_size = header.m_size;
+        
+        offset += length;
+        
+        return true;
+    }
+    
+    // Call a function on each record in order
+    
+    template <typename F>
+    void for_each(F func) const
+    {
+        ws_capture_record record;
+        size_t offset = 0;
+        
+        while (next(offset, record))
+            func(record);
+    }
+    
+private:
+    
+    const file_header *header() const { return reinterpret_cast<const file_header *>(m_base); }
+    
+    const unsigned char *m_base = nullptr;
+    size_t m_mapped = 0;
+    size_t m_size = 0;
+};
+
+#endif /* WS_CAPTURE_HPP */
@@ -3,6 +3,10 @@
 #define WS_CLIENT_BASE_HPP
 
 #include "ws_base.hpp"
+#include "ws_handlers.hpp"
+#include "ws_options.hpp"
+#include "ws_stats.hpp"
+#include "ws_typed_handlers.hpp"
 
 // A base class for websocket clients
 
@@ -17,11 +21,63 @@ public:
     static T *create(const char *host,
                      uint16_t port,
                      const char *path,
-                     ws_client_owner<handlers> owner)
-
+                     ws_client_owner<handlers> owner,
+                     const ws_client_options& options = ws_client_options())
+    {
+        return ws_base<T, U>::create(host, port, path, owner, options, false);
+    }
+    
+    // Create without waiting for the connection (never returns nullptr)
+    //
+    // The client starts in a connecting state and sends are dropped until it is ready.
+    // Readiness or failure is reported through the optional m_ready and m_error handlers.
+    
+    template <const ws_client_handlers& handlers>
+    static T *create_async(const char *host,
+                           uint16_t port,
+                           const char *path,
+                           ws_client_owner<handlers> owner,
+                           const ws_client_options& options = ws_client_options())
+    {
+        return ws_base<T, U>::create_async(host, port, path, owner, options, true);
+    }
+    
+    // Create with handlers that are members of the owner's type (see ws_typed_handlers)
+    
+    template <class O>
+    static T *create(const char *host,
+                     uint16_t port,
+                     const char *path,
+                     O *owner,
+                     const ws_client_options& options = ws_client_options())
+    {
+        constexpr auto& handlers = ws_typed_handlers<O>::client;
+        
+        return create<handlers>(host, port, path, ws_client_owner<handlers> { owner }, options);
+    }
+    
+    template <class O>
+    static T *create_async(const char *host,
+                           uint16_t port,
+                           const char *path,
+                           O *owner,
+                           const ws_client_options& options = ws_client_options())
     {
-        return ws_base<T, U>::create(host, port, path, owner);
+        constexpr auto& handlers = ws_typed_handlers<O>::client;
+        
+        return create_async<handlers>(host, port, path, ws_client_owner<handlers> { owner }, options);
     }
+    
+    // Statistics (all zero unless built with WS_STATS)
+    
+    ws_stats_snapshot stats() const
+    {
+        return m_stats.snapshot();
+    }
+    
+protected:
+    
+    ws_stats m_stats;
 };
 
 #endif /* WS_CLIENT_BASE_HPP */
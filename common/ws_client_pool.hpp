@@ -0,0 +1,545 @@
+
+#ifndef WS_CLIENT_POOL_HPP
+#define WS_CLIENT_POOL_HPP
+
+#include "ws_base.hpp"
+#include "ws_handlers.hpp"
+#include "ws_options.hpp"
+#include "ws_reconnecting_client.hpp"
+#include "ws_typed_handlers.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// An endpoint to connect to
+
+struct ws_endpoint
+{
+    std::string m_host;
+    uint16_t m_port = 0;
+    std::string m_path = "/";
+};
+
+// How a pool chooses a connection for each send
+
+enum class ws_pool_selection
+{
+    round_robin,        // Each healthy connection in turn
+    least_loaded        // The healthy connection with the fewest sends in progress or waiting (ties in turn)
+};
+
+// Pool configuration
+
+struct ws_client_pool_options
+{
+    size_t m_connections_per_endpoint = 1;
+    ws_pool_selection m_selection = ws_pool_selection::round_robin;
+    
+    // Delays and attempts for replacing each lost connection (the buffering settings are not used)
+    
+    ws_reconnect_options m_reconnect;
+    
+    ws_client_options m_client;
+};
+
+// A pool of client connections to a set of endpoints, for any backend client type
+//
+// Each connection has a ws_connection_id from 1 to size() that stays the same across reconnects. Handlers are passed
+// it with the pool's owner, and see:
+//
+// m_ready - each time a connection becomes ready
+// m_close - each time a ready connection is lost, including when the pool is destroyed
+// m_error - each time an attempt to connect fails
+//
+// A connection is healthy from its ready handler until its close or error handler, and only healthy connections are
+// chosen for sends. One thread per pool replaces lost connections after a backoff, rather than a thread for each.
+// Apple clients in a pool run on the process-wide shared queues (and share parameters, as all Apple clients do),
+// whereas CivetWeb and loopback clients still receive on a thread each. Sends may come from any thread, as the pool
+// serialises those to each connection, and are dropped rather than buffered when no connection is healthy.
+
+template <class C>
+class ws_client_pool
+{
+    using clock = std::chrono::steady_clock;
+    
+    enum class member_state
+    {
+        waiting,            // For the retry time
+        connecting,         // Or connected
+        lost,               // Waiting for the pool thread to destroy the client
+        failed              // Out of attempts
+    };
+    
+    struct member
+    {
+        ws_client_pool *m_pool;
+        ws_connection_id m_id;
+        size_t m_endpoint;
+        
+        // Sending (recursive so that handlers run during a send or a connect can send)
+        
+        std::recursive_mutex m_mutex;
+        C *m_client = nullptr;
+        std::atomic<bool> m_ready { false };
+        std::atomic<int> m_load { 0 };
+        
+        // Reconnection (guarded by the pool's m_state_mutex)
+        
+        member_state m_state = member_state::waiting;
+        clock::time_point m_retry;
+        unsigned int m_attempts = 0;
+    };
+    
+public:
+    
+    // Create (never returns nullptr, and connects in the background)
+    
+    template <const ws_client_handlers& handlers>
+    static ws_client_pool *create(const std::vector<ws_endpoint>& endpoints,
+                                  ws_client_owner<handlers> owner,
+                                  const ws_client_pool_options& options = ws_client_pool_options())
+    {
+        return new ws_client_pool(endpoints, owner, options);
+    }
+    
+    // Create with handlers that are members of the owner's type (see ws_typed_handlers)
+    
+    template <class O>
+    static ws_client_pool *create(const std::vector<ws_endpoint>& endpoints,
+                                  O *owner,
+                                  const ws_client_pool_options& options = ws_client_pool_options())
+    {
+        constexpr auto& handlers = ws_typed_handlers<O>::client;
+        
+        return create<handlers>(endpoints, ws_client_owner<handlers> { owner }, options);
+    }
+    
+    // Destructor (closes all connections)
+    
+    ~ws_client_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            m_stop = true;
+        }
+        
+        m_condition.notify_all();
+        m_thread.join();
+        
+        for (auto it = m_members.begin(); it != m_members.end(); it++)
+            destroy_client(it->get());
+    }
+    
+    // The number of connections and the number that are healthy
+    
+    size_t size() const { return m_members.size(); }
+    
+    size_t healthy() const
+    {
+        size_t count = 0;
+        
+        for (auto it = m_members.begin(); it != m_members.end(); it++)
+            count += (*it)->m_ready.load() ? 1 : 0;
+        
+        return count;
+    }
+    
+    // The state of a connection
+    
+    bool ready(ws_connection_id id) const
+    {
+        const member *m = find(id);
+        
+        return m && m->m_ready.load();
+    }
+    
+    // False once the maximum number of attempts to connect has failed
+    
+    bool reconnecting(ws_connection_id id)
+    {
+        const member *m = find(id);
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        
+        return m && m->m_state != member_state::failed;
+    }
+    
+    // The endpoint (index) of a connection
+    
+    size_t endpoint(ws_connection_id id) const
+    {
+        const member *m = find(id);
+        
+        return m ? m->m_endpoint : 0;
+    }
+    
+    // Send through a chosen connection (returns false if none is healthy)
+    
+    bool send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_any([&](C *client) { client->send(data, size, opcode); });
+    }
+    
+    // Send (gathered into one message)
+    
+    bool send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_any([&](C *client) { client->send(buffers, count, opcode); });
+    }
+    
+    // Send a batch of binary messages (all through the same connection)
+    
+    bool send_batch(const ws_buffer_list *messages, size_t count)
+    {
+        return send_any([&](C *client) { client->send_batch(messages, count); });
+    }
+    
+    // Send through a particular connection (returns false unless it is healthy)
+    
+    bool send(ws_connection_id id, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_with(find(id), [&](C *client) { client->send(data, size, opcode); });
+    }
+    
+    bool send(ws_connection_id id, const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_with(find(id), [&](C *client) { client->send(buffers, count, opcode); });
+    }
+    
+private:
+    
+    // Handlers for the backend clients (passing on the stable ID and the owner)
+    
+    template <const ws_client_handlers& handlers>
+    struct relay
+    {
+        static member& get(void *x) { return *static_cast<member *>(x); }
+        static void *owner(void *x) { return get(x).m_pool->m_owner; }
+        
+        static void receive(ws_connection_id, ws_opcode opcode, const void *data, size_t size, void *x)
+        {
+            handlers.m_receive(get(x).m_id, opcode, data, size, owner(x));
+        }
+        
+        static void receive_regions(ws_connection_id, ws_opcode opcode, const ws_buffer *regions, size_t count, void *x)
+        {
+            handlers.m_receive_regions(get(x).m_id, opcode, regions, count, owner(x));
+        }
+        
+        static void receive_fragment(ws_connection_id,
+                                     ws_opcode opcode,
+                                     const void *data,
+                                     size_t size,
+                                     bool final,
+                                     void *x)
+        {
+            handlers.m_receive_fragment(get(x).m_id, opcode, data, size, final, owner(x));
+        }
+        
+        static void ready(ws_connection_id, void *x)
+        {
+            get(x).m_pool->connected(get(x));
+            
+            if constexpr (handlers.m_ready != nullptr)
+                handlers.m_ready(get(x).m_id, owner(x));
+        }
+        
+        static void close(ws_connection_id, void *x)
+        {
+            if (get(x).m_pool->lost(get(x)))
+                handlers.m_close(get(x).m_id, owner(x));
+        }
+        
+        static void error(ws_connection_id, int error, void *x)
+        {
+            get(x).m_pool->lost(get(x));
+            
+            if constexpr (handlers.m_error != nullptr)
+                handlers.m_error(get(x).m_id, error, owner(x));
+        }
+        
+        static constexpr ws_client_handlers relayed
+        {
+            receive,
+            close,
+            handlers.m_receive_regions ? &receive_regions : nullptr,
+            handlers.m_receive_fragment ? &receive_fragment : nullptr,
+            ready,
+            error
+        };
+    };
+    
+    member *find(ws_connection_id id) const
+    {
+        return id && id <= m_members.size() ? m_members[id - 1].get() : nullptr;
+    }
+    
+    // Choose a healthy connection (or return nullptr if there is none)
+    
+    member *select()
+    {
+        size_t count = m_members.size();
+        size_t start = m_next.fetch_add(1, std::memory_order_relaxed);
+        member *best = nullptr;
+        int best_load = 0;
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            member *m = m_members[(start + i) % count].get();
+            
+            if (!m->m_ready.load(std::memory_order_relaxed))
+                continue;
+            
+            if (m_options.m_selection == ws_pool_selection::round_robin)
+                return m;
+            
+            int load = m->m_load.load(std::memory_order_relaxed);
+            
+            if (!best || load < best_load)
+            {
+                best = m;
+                best_load = load;
+                
+                if (!load)
+                    break;
+            }
+        }
+        
+        return best;
+    }
+    
+    // Send through chosen connections until one is still healthy once locked
+    
+    template <typename F>
+    bool send_any(F func)
+    {
+        for (size_t i = 0; i < m_members.size(); i++)
+        {
+            member *m = select();
+            
+            if (!m)
+                return false;
+            
+            if (send_with(m, func))
+                return true;
+        }
+        
+        return false;
+    }
+    
+    template <typename F>
+    bool send_with(member *m, F func)
+    {
+        bool sent = false;
+        
+        if (!m)
+            return false;
+        
+        m->m_load.fetch_add(1, std::memory_order_relaxed);
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(m->m_mutex);
+            
+            if (m->m_client && m->m_ready.load())
+            {
+                func(m->m_client);
+                sent = true;
+            }
+        }
+        
+        m->m_load.fetch_sub(1, std::memory_order_relaxed);
+        
+        return sent;
+    }
+    
+    // Called when a connection becomes ready
+    
+    void connected(member& m)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            m.m_attempts = 0;
+        }
+        
+        m.m_ready.store(true);
+    }
+    
+    // Called when a connection closes or fails (returns true if it was ready)
+    
+    bool lost(member& m)
+    {
+        bool was_ready = m.m_ready.exchange(false);
+        
+        {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            
+            if (m.m_state == member_state::connecting)
+                m.m_state = member_state::lost;
+        }
+        
+        m_condition.notify_all();
+        
+        return was_ready;
+    }
+    
+    // Start connecting (holding the member's lock so that the new client's handlers can only send once it is stored)
+    
+    template <const ws_client_handlers& handlers>
+    void connect(member *m)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            m->m_state = member_state::connecting;
+            m->m_attempts++;
+        }
+        
+        const ws_endpoint& endpoint = m_endpoints[m->m_endpoint];
+        ws_client_owner<relay<handlers>::relayed> owner { m };
+        
+        std::lock_guard<std::recursive_mutex> lock(m->m_mutex);
+        m->m_client = C::template create_async<relay<handlers>::relayed>(endpoint.m_host.c_str(),
+                                                                        endpoint.m_port,
+                                                                        endpoint.m_path.c_str(),
+                                                                        owner,
+                                                                        m_options.m_client);
+    }
+    
+    // Destroy a connection's client (after which none of its handlers can run)
+    
+    void destroy_client(member *m)
+    {
+        C *client;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(m->m_mutex);
+            client = m->m_client;
+            m->m_client = nullptr;
+        }
+        
+        delete client;
+    }
+    
+    // Pool thread (replaces lost connections, waiting until the earliest retry is due)
+    
+    template <const ws_client_handlers& handlers>
+    void run()
+    {
+        std::vector<member *> closing;
+        std::vector<member *> due;
+        
+        std::unique_lock<std::mutex> lock(m_state_mutex);
+        
+        while (!m_stop)
+        {
+            auto now = clock::now();
+            auto next = clock::time_point::max();
+            
+            for (auto it = m_members.begin(); it != m_members.end(); it++)
+            {
+                member *m = it->get();
+                
+                if (m->m_state == member_state::lost)
+                    closing.push_back(m);
+                else if (m->m_state == member_state::waiting && m->m_retry <= now)
+                    due.push_back(m);
+                else if (m->m_state == member_state::waiting)
+                    next = std::min(next, m->m_retry);
+            }
+            
+            if (closing.empty() && due.empty())
+            {
+                if (next == clock::time_point::max())
+                    m_condition.wait(lock);
+                else
+                    m_condition.wait_until(lock, next);
+                
+                continue;
+            }
+            
+            lock.unlock();
+            
+            for (auto it = closing.begin(); it != closing.end(); it++)
+                destroy_client(*it);
+            
+            for (auto it = due.begin(); it != due.end(); it++)
+                connect<handlers>(*it);
+            
+            lock.lock();
+            
+            // Wait before trying again (the attempt count is reset once a connection becomes ready)
+            
+            unsigned int max_attempts = m_options.m_reconnect.m_max_attempts;
+            
+            for (auto it = closing.begin(); it != closing.end(); it++)
+            {
+                member *m = *it;
+                
+                if (max_attempts && m->m_attempts >= max_attempts)
+                    m->m_state = member_state::failed;
+                else
+                {
+                    m->m_state = member_state::waiting;
+                    m->m_retry = clock::now() + m_backoff.delay(m->m_attempts);
+                }
+            }
+            
+            closing.clear();
+            due.clear();
+        }
+    }
+    
+    // Constructor (connections are interleaved across the endpoints so that choosing in turn spreads between them)
+    
+    template <const ws_client_handlers& handlers>
+    ws_client_pool(const std::vector<ws_endpoint>& endpoints,
+                   ws_client_owner<handlers> owner,
+                   const ws_client_pool_options& options)
+    : m_owner(owner.m_owner)
+    , m_endpoints(endpoints)
+    , m_options(options)
+    , m_backoff(options.m_reconnect)
+    {
+        m_options.m_client.m_share_queues = true;
+        
+        for (size_t i = 0; i < m_options.m_connections_per_endpoint; i++)
+        {
+            for (size_t j = 0; j < m_endpoints.size(); j++)
+            {
+                m_members.emplace_back(new member());
+                
+                member *m = m_members.back().get();
+                
+                m->m_pool = this;
+                m->m_id = m_members.size();
+                m->m_endpoint = j;
+            }
+        }
+        
+        m_thread = std::thread(&ws_client_pool::run<handlers>, this);
+    }
+    
+    void *m_owner;
+    
+    const std::vector<ws_endpoint> m_endpoints;
+    ws_client_pool_options m_options;
+    std::vector<std::unique_ptr<member>> m_members;
+    std::atomic<size_t> m_next { 0 };
+    
+    // Pool thread state
+    
+    std::mutex m_state_mutex;
+    std::condition_variable m_condition;
+    bool m_stop = false;
+    ws_backoff m_backoff;
+    
+    std::thread m_thread;
+};
+
+#endif /* WS_CLIENT_POOL_HPP */
@@ -0,0 +1,112 @@
+
+#ifndef WS_CONNECTION_HPP
+#define WS_CONNECTION_HPP
+
+#include "ws_base.hpp"
+#include "ws_capture.hpp"
+#include "ws_handlers.hpp"
+#include "ws_heartbeat.hpp"
+#include "ws_send_queue.hpp"
+#include "ws_stats.hpp"
+
+#include <atomic>
+
+// A base class for per-connection server state (held by the registry and reference counted)
+//
+// T is the derived backend connection type and message_type the type of queued outbound messages.
+// The registry holds one reference from connection to close, and drainers take further references whilst writing.
+
+template <class T, class message_type>
+class ws_connection
+{
+public:
+    
+    ws_connection(const ws_send_queue_options& options,
+                  ws_handler_funcs::backpressure_handler backpressure,
+                  void *owner)
+    : m_queue(options)
+    , m_backpressure(backpressure)
+    , m_user_data(owner)
+    {}
+    
+    ws_connection(const ws_connection&) = delete;
+    ws_connection& operator=(const ws_connection&) = delete;
+    
+    // Reference counting
+    
+    void retain()
+    {
+        m_references.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void release()
+    {
+        if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete static_cast<T *>(this);
+    }
+    
+    // Queue a message (notifying if the connection becomes congested)
+    
+    typename ws_send_queue<message_type>::push_result push(message_type item, size_t bytes)
+    {
+        auto result = m_queue.push(std::move(item), bytes);
+        
+        if (result.m_congested)
+            notify_backpressure(true);
+        
+        return result;
+    }
+    
+    // Mark messages as written (notifying if the connection is no longer congested)
+    
+    void complete(size_t bytes, size_t messages = 1)
+    {
+        if (m_queue.complete(bytes, messages))
+            notify_backpressure(false);
+    }
+    
+    // Capture a frame if the server is capturing (the bits are a frame's FIN bit and opcode)
+    
+    void capture(ws_capture_event event, int bits, const void *data, size_t size, bool framed = false)
+    {
+        if (m_capture)
+            m_capture->append(event, m_id, bits, data, size, framed);
+    }
+    
+    // The pointer passed to the connection's handlers (the server's owner unless replaced)
+    
+    void *user_data() const
+    {
+        return m_user_data.load(std::memory_order_acquire);
+    }
+    
+    void set_user_data(void *data)
+    {
+        m_user_data.store(data, std::memory_order_release);
+    }
+    
+    ws_connection_id m_id = 0;
+    ws_send_queue<message_type> m_queue;
+    ws_connection_stats m_stats;
+    ws_heartbeat_state m_heartbeat;
+    std::atomic<bool> m_batching { false };
+    ws_capture_log *m_capture = nullptr;
+    
+protected:
+    
+    ~ws_connection() {}
+    
+private:
+    
+    void notify_backpressure(bool congested)
+    {
+        if (m_backpressure)
+            m_backpressure(m_id, congested, user_data());
+    }
+    
+    std::atomic<int> m_references { 1 };
+    ws_handler_funcs::backpressure_handler m_backpressure;
+    std::atomic<void *> m_user_data;
+};
+
+#endif /* WS_CONNECTION_HPP */
@@ -0,0 +1,314 @@
+
+#ifndef WS_CONNECTION_REGISTRY_HPP
+#define WS_CONNECTION_REGISTRY_HPP
+
+#include "ws_base.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A generational slot map from connection IDs to connections
+//
+// IDs pack a slot index (plus one, so that zero is never a valid ID) in the low bits and a generation in the high bits.
+// Slots are recycled through a free list and the generation is bumped on removal, so stale IDs are rejected.
+//
+// Slots live in fixed-size chunks that never move, so lookups and iteration are lock-free (RCU-style).
+// Only add() and remove() take the writer lock, and remove() waits for readers that might still hold the connection.
+// Connections found by visit() or for_each() are therefore valid for the duration of the callback.
+// remove() must not be called from within visit() or for_each() as it would wait on itself.
+
+template <class connection_type>
+class ws_connection_registry
+{
+    static constexpr int index_bits = sizeof(ws_connection_id) * 4;
+    static constexpr ws_connection_id index_mask = (ws_connection_id(1) << index_bits) - 1;
+    
+    static constexpr size_t chunk_bits = 10;
+    static constexpr size_t chunk_size = size_t(1) << chunk_bits;
+    static constexpr size_t max_chunks = 4096;
+    static constexpr size_t reader_stripes = 16;
+    
+    struct slot
+    {
+        std::atomic<ws_connection_id> m_generation { 0 };
+        std::atomic<connection_type> m_connection { nullptr };
+    };
+    
+    struct chunk
+    {
+        slot m_slots[chunk_size];
+    };
+    
+    struct alignas(64) reader_count
+    {
+        std::atomic<size_t> m_count { 0 };
+    };
+    
+    // A read-side critical section
+    
+    class read_section
+    {
+    public:
+        
+        read_section(const ws_connection_registry& registry) : m_count(registry.enter()) {}
+        ~read_section() { m_count->fetch_sub(1); }
+        
+        read_section(const read_section&) = delete;
+        read_section& operator=(const read_section&) = delete;
+    
+    private:
+        
+        std::atomic<size_t> *m_count;
+    };
+    
+public:
+    
+    ws_connection_registry()
+    {
+        for (size_t i = 0; i < max_chunks; i++)
+            m_chunks[i].store(nullptr);
+    }
+    
+    ~ws_connection_registry()
+    {
+        for (size_t i = 0; i < max_chunks; i++)
+            delete m_chunks[i].load();
+    }
+    
+    ws_connection_registry(const ws_connection_registry&) = delete;
+    ws_connection_registry& operator=(const ws_connection_registry&) = delete;
+    
+    // Add a connection and return its ID (returns zero if the registry is full)
+    
+    ws_connection_id add(connection_type connection)
+    {
+        return add(connection, [](ws_connection_id) {});
+    }
+    
+    // Add a connection, calling a function with its ID before it becomes visible to readers
+    
+    template <typename F>
+    ws_connection_id add(connection_type connection, F prepare)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        size_t index;
+        
+        if (m_free.size())
+        {
+            index = m_free.back();
+            m_free.pop_back();
+        }
+        else
+        {
+            index = m_high_water.load();
+            
+            if (index >= max_chunks * chunk_size)
+                return 0;
+            
+            if (!(index & (chunk_size - 1)))
+                m_chunks[index >> chunk_bits].store(new chunk());
+        }
+        
+        slot& s = get_slot(index);
+        
+        ws_connection_id id = make_id(index, s.m_generation.load());
+        
+        prepare(id);
+        s.m_connection.store(connection);
+        
+        if (index == m_high_water.load())
+            m_high_water.store(index + 1);
+        
+        m_size.fetch_add(1);
+        
+        return id;
+    }
+    
+    // Remove a connection by ID (returns the connection, or nullptr if the ID is not current)
+    // On return no reader can still be using the connection
+    
+    connection_type remove(ws_connection_id id)
+    {
+        connection_type connection = nullptr;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            
+            slot *s = find_slot(id);
+            
+            if (!s || !s->m_connection.load())
+                return nullptr;
+            
+            s->m_generation.store((get_generation(id) + 1) & generation_mask());
+            connection = s->m_connection.exchange(nullptr);
+            m_free.push_back(get_index(id));
+            m_size.fetch_sub(1);
+        }
+        
+        synchronize();
+        
+        return connection;
+    }
+    
+    // Find a connection from its ID without entering a read section (returns nullptr if the ID is not current)
+    // The caller must otherwise know that the connection is alive (e.g. from within that connection's callbacks)
+    
+    connection_type find(ws_connection_id id) const
+    {
+        const slot *s = find_slot(id);
+        
+        if (!s)
+            return nullptr;
+        
+        connection_type connection = s->m_connection.load();
+        
+        // Recheck in case the slot was reused whilst reading
+        
+        return s->m_generation.load() == get_generation(id) ? connection : nullptr;
+    }
+    
+    // Call a function on the connection with the given ID (returns false if the ID is not current)
+    
+    template <typename F>
+    bool visit(ws_connection_id id, F func) const
+    {
+        read_section section(*this);
+        
+        connection_type connection = find(id);
+        
+        if (connection)
+            func(connection);
+        
+        return connection;
+    }
+    
+    // Call a function on each live connection
+    
+    template <typename F>
+    void for_each(F func) const
+    {
+        read_section section(*this);
+        
+        size_t high_water = m_high_water.load();
+        
+        for (size_t i = 0; i < high_water; i++)
+        {
+            connection_type connection = get_slot(i).m_connection.load();
+            
+            if (connection)
+                func(connection);
+        }
+    }
+    
+    // The number of live connections
+    
+    size_t size() const
+    {
+        return m_size.load();
+    }
+    
+private:
+    
+    // ID helpers
+    
+    static constexpr ws_connection_id generation_mask()
+    {
+        return ~ws_connection_id(0) >> index_bits;
+    }
+    
+    static ws_connection_id make_id(size_t index, ws_connection_id generation)
+    {
+        return (generation << index_bits) | (static_cast<ws_connection_id>(index) + 1);
+    }
+    
+    static size_t get_index(ws_connection_id id)
+    {
+        return static_cast<size_t>((id & index_mask) - 1);
+    }
+    
+    static ws_connection_id get_generation(ws_connection_id id)
+    {
+        return id >> index_bits;
+    }
+    
+    // Slot lookup
+    
+    slot& get_slot(size_t index) const
+    {
+        return m_chunks[index >> chunk_bits].load()->m_slots[index & (chunk_size - 1)];
+    }
+    
+    slot *find_slot(ws_connection_id id) const
+    {
+        if (!(id & index_mask))
+            return nullptr;
+        
+        size_t index = get_index(id);
+        
+        if (index >= m_high_water.load())
+            return nullptr;
+        
+        slot& s = get_slot(index);
+        
+        return s.m_generation.load() == get_generation(id) ? &s : nullptr;
+    }
+    
+    // Readers register on a striped counter for the current epoch
+    
+    static size_t reader_stripe()
+    {
+        static thread_local size_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % reader_stripes;
+        return stripe;
+    }
+    
+    std::atomic<size_t> *enter() const
+    {
+        size_t stripe = reader_stripe();
+        
+        while (true)
+        {
+            size_t epoch = m_epoch.load();
+            std::atomic<size_t> *count = &m_readers[epoch & 1][stripe].m_count;
+            
+            count->fetch_add(1);
+            
+            if (m_epoch.load() == epoch)
+                return count;
+            
+            count->fetch_sub(1);
+        }
+    }
+    
+    // Wait for all readers that entered before the call
+    
+    void synchronize()
+    {
+        std::lock_guard<std::mutex> lock(m_sync_mutex);
+        
+        size_t epoch = m_epoch.fetch_add(1);
+        
+        for (size_t i = 0; i < reader_stripes; i++)
+        {
+            while (m_readers[epoch & 1][i].m_count.load())
+                std::this_thread::yield();
+        }
+    }
+    
+    std::atomic<chunk *> m_chunks[max_chunks];
+    std::atomic<size_t> m_high_water { 0 };
+    std::atomic<size_t> m_size { 0 };
+    std::vector<size_t> m_free;
+    std::mutex m_mutex;
+    
+    mutable reader_count m_readers[2][reader_stripes];
+    std::atomic<size_t> m_epoch { 0 };
+    std::mutex m_sync_mutex;
+};
+
+#endif /* WS_CONNECTION_REGISTRY_HPP */
@@ -0,0 +1,785 @@
+
+#ifndef WS_COROUTINE_HPP
+#define WS_COROUTINE_HPP
+
+// Coroutines need C++20 (the contents of this file are left out otherwise)
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include "ws_base.hpp"
+#include "ws_handlers.hpp"
+#include "ws_options.hpp"
+#include "ws_send_queue.hpp"
+#include "ws_typed_handlers.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Awaitable clients and servers wrapping any backend (e.g. ws_co_client<cw_ws_client> or ws_co_server<lb_ws_server>)
+//
+//     auto client = co_await ws_co_client<cw_ws_client>::connect("localhost", 8080, "/ws", executor);
+//
+//     while (auto message = co_await client->receive())
+//         co_await client->send(message.m_data, message.m_size, message.m_opcode);
+//
+// Coroutines are always resumed through the executor given, never on backend threads. Received messages are copied
+// once into a ring of slots that keep their capacity, so in the steady state no await allocates. Each connection
+// supports one receiving and one sending coroutine at a time.
+
+// An executor that coroutines are resumed on
+//
+// Post is called on backend threads and must queue the coroutine rather than resume it (it should not allocate).
+
+struct ws_co_executor
+{
+    using post_func = void (*)(std::coroutine_handle<> handle, void *context);
+    
+    post_func m_post;
+    void *m_context;
+    
+    void post(std::coroutine_handle<> handle) const { m_post(handle, m_context); }
+};
+
+// A received message (borrowed - valid until the next receive on the same connection)
+
+struct ws_co_message
+{
+    ws_opcode m_opcode = ws_opcode::close;
+    const void *m_data = nullptr;
+    size_t m_size = 0;
+    
+    // Set once the connection has closed and every message received before has been taken
+    
+    bool m_closed = true;
+    
+    explicit operator bool() const { return !m_closed; }
+};
+
+// The receive ring and waiting coroutines of a connection
+//
+// A connection's handlers are never called concurrently, so there is one producer. The ring grows rather than make
+// the backend thread wait, as a coroutine waiting for a send to drain may need that thread to drain it. Slots keep
+// their buffers once taken, and moving a slot keeps its buffer, so borrowed messages stay valid whilst it grows.
+
+class ws_co_stream
+{
+    struct slot
+    {
+        ws_opcode m_opcode = ws_opcode::binary;
+        std::vector<unsigned char> m_data;
+    };
+    
+public:
+    
+    ws_co_stream(ws_co_executor executor, size_t capacity)
+    : m_executor(executor)
+    , m_slots(capacity ? capacity : 1)
+    {}
+    
+    ws_co_stream(const ws_co_stream&) = delete;
+    ws_co_stream& operator=(const ws_co_stream&) = delete;
+    
+    // Awaitable receive
+    
+    class receiver
+    {
+    public:
+        
+        receiver(ws_co_stream& stream) : m_stream(stream) {}
+        
+        bool await_ready() { return m_stream.ready_to_receive(); }
+        bool await_suspend(std::coroutine_handle<> handle) { return m_stream.suspend(m_stream.m_receiver, handle); }
+        ws_co_message await_resume() { return m_stream.take(); }
+    
+    private:
+        
+        ws_co_stream& m_stream;
+    };
+    
+    receiver receive() { return receiver(*this); }
+    
+    // Wait until not congested (returns false if there is no need to suspend)
+    
+    bool ready_to_send()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_congested || m_closed;
+    }
+    
+    bool suspend_sender(std::coroutine_handle<> handle) { return suspend(m_sender, handle); }
+    
+    // Backend side
+    
+    void push(ws_opcode opcode, const void *data, size_t size)
+    {
+        size_t tail;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            
+            if (m_count == m_slots.size())
+                grow();
+            
+            tail = (m_head + m_count) % m_slots.size();
+        }
+        
+        // The slot is not visible to the coroutine until it is counted, so fill it outside the lock
+        
+        auto bytes = static_cast<const unsigned char *>(data);
+        
+        m_slots[tail].m_opcode = opcode;
+        m_slots[tail].m_data.assign(bytes, bytes + size);
+        
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_count++;
+        wake(m_receiver, lock);
+    }
+    
+    void congest(bool congested)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_congested = congested;
+        
+        if (!congested)
+            wake(m_sender, lock);
+    }
+    
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_closed = true;
+        
+        std::coroutine_handle<> sender = m_sender;
+        m_sender = nullptr;
+        
+        wake(m_receiver, lock);
+        
+        if (sender)
+            m_executor.post(sender);
+    }
+    
+private:
+    
+    // Free the borrowed slot, then check for a message or the close
+    
+    bool ready_to_receive()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (m_borrowed)
+        {
+            m_head = (m_head + 1) % m_slots.size();
+            m_count--;
+            m_borrowed = false;
+        }
+        
+        return m_count || m_closed;
+    }
+    
+    // Suspend unless what is being waited for happened meanwhile
+    
+    bool suspend(std::coroutine_handle<>& waiter, std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        bool ready = (&waiter == &m_receiver) ? (m_count || m_closed) : (!m_congested || m_closed);
+        
+        if (!ready)
+            waiter = handle;
+        
+        return !ready;
+    }
+    
+    ws_co_message take()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (!m_count)
+            return ws_co_message();
+        
+        slot& s = m_slots[m_head];
+        m_borrowed = true;
+        
+        return ws_co_message { s.m_opcode, s.m_data.data(), s.m_data.size(), false };
+    }
+    
+    // Double the slots, moving those in use to the front in order (whilst holding the lock)
+    
+    void grow()
+    {
+        std::vector<slot> slots(m_slots.size() * 2);
+        
+        for (size_t i = 0; i < m_count; i++)
+            slots[i] = std::move(m_slots[(m_head + i) % m_slots.size()]);
+        
+        m_slots.swap(slots);
+        m_head = 0;
+    }
+    
+    // Post a waiting coroutine (after unlocking)
+    
+    void wake(std::coroutine_handle<>& waiter, std::unique_lock<std::mutex>& lock)
+    {
+        std::coroutine_handle<> handle = waiter;
+        waiter = nullptr;
+        lock.unlock();
+        
+        if (handle)
+            m_executor.post(handle);
+    }
+    
+    ws_co_executor m_executor;
+    std::vector<slot> m_slots;
+    size_t m_head = 0;
+    size_t m_count = 0;
+    bool m_borrowed = false;
+    bool m_congested = false;
+    bool m_closed = false;
+    std::coroutine_handle<> m_receiver;
+    std::coroutine_handle<> m_sender;
+    std::mutex m_mutex;
+};
+
+// An awaitable client
+//
+// Clients report no backpressure (the CivetWeb and loopback clients wait within the send itself and Network.framework
+// queues), so sends complete without suspending. Whilst the transport is full the first two hold up the executor's
+// thread, so a client should not be given an executor that must run the server it sends to.
+
+template <class C>
+class ws_co_client
+{
+    friend class ws_typed_handlers<ws_co_client>;
+    
+public:
+    
+    // Awaitable connect (resumes with the client, or nullptr if it fails to connect)
+    
+    class connector
+    {
+    public:
+        
+        connector(const char *host,
+                  uint16_t port,
+                  const char *path,
+                  ws_co_executor executor,
+                  const ws_client_options& options,
+                  size_t receive_capacity)
+        : m_host(host)
+        , m_port(port)
+        , m_path(path)
+        , m_executor(executor)
+        , m_options(options)
+        , m_receive_capacity(receive_capacity)
+        {}
+        
+        bool await_ready() { return false; }
+        
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_client.reset(new ws_co_client(m_executor, m_receive_capacity));
+            m_client->m_connector = handle;
+            m_client->m_client = C::create_async(m_host, m_port, m_path, m_client.get(), m_options);
+            
+            return !m_client->arrive();
+        }
+        
+        std::unique_ptr<ws_co_client> await_resume()
+        {
+            if (!m_client->m_connected)
+                m_client.reset();
+            
+            return std::move(m_client);
+        }
+    
+    private:
+        
+        const char *m_host;
+        uint16_t m_port;
+        const char *m_path;
+        ws_co_executor m_executor;
+        ws_client_options m_options;
+        size_t m_receive_capacity;
+        std::unique_ptr<ws_co_client> m_client;
+    };
+    
+    // Awaitable send
+    
+    class sender
+    {
+    public:
+        
+        sender(C *client, const void *data, size_t size, const ws_buffer *buffers, ws_opcode opcode)
+        : m_client(client), m_data(data), m_size(size), m_buffers(buffers), m_opcode(opcode)
+        {}
+        
+        bool await_ready() { return true; }
+        void await_suspend(std::coroutine_handle<>) {}
+        
+        void await_resume()
+        {
+            if (m_buffers)
+                m_client->send(m_buffers, m_size, m_opcode);
+            else
+                m_client->send(m_data, m_size, m_opcode);
+        }
+    
+    private:
+        
+        C *m_client;
+        const void *m_data;
+        size_t m_size;
+        const ws_buffer *m_buffers;
+        ws_opcode m_opcode;
+    };
+    
+    // Connect (the host and path need only remain valid until the connect is awaited)
+    // The receive ring starts with the capacity given, in messages
+    
+    static connector connect(const char *host,
+                             uint16_t port,
+                             const char *path,
+                             ws_co_executor executor,
+                             const ws_client_options& options = ws_client_options(),
+                             size_t receive_capacity = 64)
+    {
+        return connector(host, port, path, executor, options, receive_capacity);
+    }
+    
+    // Destructor (closes the connection)
+    
+    ~ws_co_client()
+    {
+        delete m_client;
+    }
+    
+    ws_co_client(const ws_co_client&) = delete;
+    ws_co_client& operator=(const ws_co_client&) = delete;
+    
+    // Receive the next message (a closed message once the connection has closed)
+    
+    ws_co_stream::receiver receive() { return m_stream.receive(); }
+    
+    // Send
+    
+    sender send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return sender(m_client, data, size, nullptr, opcode);
+    }
+    
+    sender send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return sender(m_client, nullptr, count, buffers, opcode);
+    }
+    
+    // The wrapped client
+    
+    C& client() { return *m_client; }
+    
+private:
+    
+    ws_co_client(ws_co_executor executor, size_t receive_capacity)
+    : m_executor(executor)
+    , m_stream(executor, receive_capacity)
+    {}
+    
+    // The connector and the backend both arrive once the client exists and its outcome is known - the last resumes
+    
+    bool arrive()
+    {
+        return m_arrivals.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+    
+    void settle(bool connected)
+    {
+        if (m_settled.exchange(true))
+            return;
+        
+        m_connected = connected;
+        
+        if (arrive())
+            m_executor.post(m_connector);
+    }
+    
+    // Typed handlers (called by the backend)
+    
+    void on_ready(ws_connection_id) { settle(true); }
+    void on_error(ws_connection_id, int) { settle(false); }
+    
+    void on_receive(ws_connection_id, ws_opcode opcode, const void *data, size_t size)
+    {
+        m_stream.push(opcode, data, size);
+    }
+    
+    void on_close(ws_connection_id)
+    {
+        settle(false);
+        m_stream.close();
+    }
+    
+    C *m_client = nullptr;
+    ws_co_executor m_executor;
+    ws_co_stream m_stream;
+    std::coroutine_handle<> m_connector;
+    std::atomic<int> m_arrivals { 2 };
+    std::atomic<bool> m_settled { false };
+    bool m_connected = false;
+};
+
+// An awaitable server
+//
+// Connections are accepted as they become ready and are shared between the server and the application until they
+// close. Sends suspend whilst a connection is over its high watermark and resume once it drains or closes. Under the
+// drop policy a message dropped for taking the connection over is sent again then, so awaited sends are not lost to
+// backpressure. Connections must not be sent to once the server has been destroyed.
+
+template <class S>
+class ws_co_server
+{
+public:
+    
+    class connection;
+    
+    using connection_ptr = std::shared_ptr<connection>;
+    
+    // Awaitable send (resumes with the result)
+    
+    class sender
+    {
+    public:
+        
+        sender(connection& c, const void *data, size_t size, const ws_buffer *buffers, ws_opcode opcode)
+        : m_connection(c), m_data(data), m_size(size), m_buffers(buffers), m_opcode(opcode)
+        {}
+        
+        bool await_ready()
+        {
+            return m_connection.m_stream.ready_to_send() && attempt();
+        }
+        
+        // Wait for the connection to drain (trying again if it already has)
+        
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            while (!m_connection.m_stream.suspend_sender(handle))
+            {
+                if (attempt())
+                    return false;
+            }
+            
+            m_waited = true;
+            return true;
+        }
+        
+        ws_send_result await_resume()
+        {
+            if (m_waited)
+                attempt();
+            
+            return m_result;
+        }
+    
+    private:
+        
+        // Send (returns false if dropped for want of space whilst something is queued, which drains)
+        
+        bool attempt()
+        {
+            S *server = m_connection.m_server;
+            ws_connection_id id = m_connection.m_id;
+            
+            if (m_buffers)
+                m_result = server->send(id, m_buffers, m_size, m_opcode);
+            else
+                m_result = server->send(id, m_data, m_size, m_opcode);
+            
+            return m_result != ws_send_result::dropped || !server->queue_depth(id).m_bytes;
+        }
+        
+        connection& m_connection;
+        const void *m_data;
+        size_t m_size;
+        const ws_buffer *m_buffers;
+        ws_opcode m_opcode;
+        ws_send_result m_result = ws_send_result::not_connected;
+        bool m_waited = false;
+    };
+    
+    // A connection
+    
+    class connection
+    {
+        friend ws_co_server;
+        friend sender;
+    
+    public:
+        
+        connection(ws_co_server *owner, ws_connection_id id, ws_co_executor executor, size_t receive_capacity)
+        : m_owner(owner)
+        , m_server(owner->m_server)
+        , m_id(id)
+        , m_stream(executor, receive_capacity)
+        {}
+        
+        ws_connection_id id() const { return m_id; }
+        
+        // Receive the next message (a closed message once the connection has closed)
+        
+        ws_co_stream::receiver receive() { return m_stream.receive(); }
+        
+        // Send
+        
+        sender send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+        {
+            return sender(*this, data, size, nullptr, opcode);
+        }
+        
+        sender send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+        {
+            return sender(*this, nullptr, count, buffers, opcode);
+        }
+    
+    private:
+        
+        ws_co_server *m_owner;
+        S *m_server;
+        ws_connection_id m_id;
+        ws_co_stream m_stream;
+    };
+    
+    // Awaitable accept (resumes with the next connection, or nullptr once stopped)
+    
+    class acceptor
+    {
+        friend ws_co_server;
+    
+    public:
+        
+        acceptor(ws_co_server& server) : m_server(server) {}
+        
+        bool await_ready() { return m_server.take(m_connection); }
+        bool await_suspend(std::coroutine_handle<> handle) { return m_server.suspend(*this, handle); }
+        connection_ptr await_resume() { return std::move(m_connection); }
+    
+    private:
+        
+        ws_co_server& m_server;
+        std::coroutine_handle<> m_handle;
+        connection_ptr m_connection;
+    };
+    
+    // Create (returns nullptr if the backend fails to start)
+    // Each connection's receive ring starts with the capacity given, in messages
+    
+    static std::unique_ptr<ws_co_server> create(const char *port,
+                                                const char *path,
+                                                ws_co_executor executor,
+                                                const ws_server_options& options = ws_server_options(),
+                                                size_t receive_capacity = 64)
+    {
+        std::unique_ptr<ws_co_server> server(new ws_co_server(executor, receive_capacity));
+        
+        S *backend = S::template create<handlers>(port, path, ws_server_owner<handlers> { server.get() }, options);
+        
+        // Connections may arrive before the backend is returned, so they wait for it
+        
+        {
+            std::lock_guard<std::mutex> lock(server->m_mutex);
+            server->m_server = backend;
+            server->m_started = true;
+        }
+        
+        server->m_start.notify_all();
+        
+        if (!backend)
+            server.reset();
+        
+        return server;
+    }
+    
+    // Destructor (resumes any waiting accept with nullptr and closes all connections)
+    
+    ~ws_co_server()
+    {
+        stop();
+        delete m_server;
+    }
+    
+    ws_co_server(const ws_co_server&) = delete;
+    ws_co_server& operator=(const ws_co_server&) = delete;
+    
+    // Accept the next connection
+    
+    acceptor accept() { return acceptor(*this); }
+    
+    // Stop accepting (a waiting accept and any later ones resume with nullptr)
+    
+    void stop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopped = true;
+        
+        acceptor *waiting = m_acceptor;
+        m_acceptor = nullptr;
+        lock.unlock();
+        
+        if (waiting)
+            m_executor.post(waiting->m_handle);
+    }
+    
+    // The wrapped server (for sends to groups and the like)
+    
+    S& server() { return *m_server; }
+    
+private:
+    
+    ws_co_server(ws_co_executor executor, size_t receive_capacity)
+    : m_executor(executor)
+    , m_receive_capacity(receive_capacity)
+    {}
+    
+    // Take a connection that is waiting to be accepted (returns false if there is none and not stopped)
+    
+    bool take(connection_ptr& c)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return take_locked(c);
+    }
+    
+    bool take_locked(connection_ptr& c)
+    {
+        if (!m_pending.empty())
+        {
+            c = std::move(m_pending.front());
+            m_pending.pop_front();
+            return true;
+        }
+        
+        return m_stopped;
+    }
+    
+    bool suspend(acceptor& a, std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (take_locked(a.m_connection))
+            return false;
+        
+        a.m_handle = handle;
+        m_acceptor = &a;
+        
+        return true;
+    }
+    
+    // Conversion
+    
+    static ws_co_server& as_server(void *x) { return *static_cast<ws_co_server *>(x); }
+    static connection& as_connection(void *x) { return *static_cast<connection *>(x); }
+    
+    // Handlers (connection handlers after m_connect are passed the connection as user data)
+    
+    static void connect(ws_connection_id id, void *x)
+    {
+        ws_co_server& server = as_server(x);
+        
+        std::unique_lock<std::mutex> lock(server.m_mutex);
+        server.m_start.wait(lock, [&]() { return server.m_started; });
+        
+        auto c = std::make_shared<connection>(&server, id, server.m_executor, server.m_receive_capacity);
+        
+        server.m_connections.emplace(id, c);
+        lock.unlock();
+        
+        server.m_server->set_user_data(id, c.get());
+    }
+    
+    static void ready(ws_connection_id id, void *x)
+    {
+        ws_co_server& server = *as_connection(x).m_owner;
+        
+        std::unique_lock<std::mutex> lock(server.m_mutex);
+        
+        auto it = server.m_connections.find(id);
+        
+        if (it == server.m_connections.end())
+            return;
+        
+        // Hand the connection straight to a waiting accept, else queue it
+        
+        acceptor *waiting = server.m_acceptor;
+        
+        if (waiting)
+        {
+            server.m_acceptor = nullptr;
+            waiting->m_connection = it->second;
+            lock.unlock();
+            server.m_executor.post(waiting->m_handle);
+        }
+        else
+            server.m_pending.push_back(it->second);
+    }
+    
+    static void receive(ws_connection_id, ws_opcode opcode, const void *data, size_t size, void *x)
+    {
+        as_connection(x).m_stream.push(opcode, data, size);
+    }
+    
+    static void backpressure(ws_connection_id, bool congested, void *x)
+    {
+        as_connection(x).m_stream.congest(congested);
+    }
+    
+    static void close(ws_connection_id id, void *x)
+    {
+        connection& c = as_connection(x);
+        ws_co_server& server = *c.m_owner;
+        
+        c.m_stream.close();
+        
+        // Release the server's reference (the connection may be deleted here)
+        
+        connection_ptr released;
+        
+        std::lock_guard<std::mutex> lock(server.m_mutex);
+        
+        auto it = server.m_connections.find(id);
+        
+        if (it != server.m_connections.end())
+        {
+            released = std::move(it->second);
+            server.m_connections.erase(it);
+        }
+    }
+    
+    static constexpr ws_server_handlers handlers
+    {
+        connect,
+        ready,
+        receive,
+        close,
+        backpressure
+    };
+    
+    ws_co_executor m_executor;
+    size_t m_receive_capacity;
+    S *m_server = nullptr;
+    bool m_started = false;
+    bool m_stopped = false;
+    acceptor *m_acceptor = nullptr;
+    std::deque<connection_ptr> m_pending;
+    std::unordered_map<ws_connection_id, connection_ptr> m_connections;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+};
+
+#endif
+
+#endif /* WS_COROUTINE_HPP */
@@ -0,0 +1,449 @@
+
+#ifndef WS_DEFLATE_HPP
+#define WS_DEFLATE_HPP
+
+#include "ws_base.hpp"
+#include "ws_frame.hpp"
+#include "ws_options.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+// permessage-deflate (RFC 7692) support
+//
+// Compression needs zlib and is only available when building with USE_ZLIB (otherwise messages are never compressed).
+// Compressed frames are marked with RSV1 and hold a raw deflate stream with the final empty block removed.
+
+static constexpr bool ws_deflate_available =
+#ifdef USE_ZLIB
+    true;
+#else
+    false;
+#endif
+
+// Negotiated extension parameters
+
+struct ws_deflate_params
+{
+    static constexpr int max_window_bits = 15;
+    static constexpr int min_window_bits = 9;
+    
+    bool m_negotiated = false;
+    int m_server_window_bits = max_window_bits;
+    int m_client_window_bits = max_window_bits;
+    bool m_server_no_context_takeover = false;
+    bool m_client_no_context_takeover = false;
+    
+    static int clamp(int window_bits)
+    {
+        return std::min(max_window_bits, std::max(min_window_bits, window_bits));
+    }
+    
+    // Parse a Sec-WebSocket-Extensions header (an offer or a response) and return true if permessage-deflate is present
+    
+    bool parse(const char *header)
+    {
+        *this = ws_deflate_params();
+        
+        if (!header)
+            return false;
+        
+        // Extensions are comma-separated and each has semicolon-separated parameters
+        
+        for (const char *extension = header; *extension; )
+        {
+            const char *end = extension + std::strcspn(extension, ",");
+            std::vector<std::string> tokens = split(extension, end);
+            
+            if (tokens.size() && tokens[0] == "permessage-deflate")
+            {
+                for (size_t i = 1; i < tokens.size(); i++)
+                    parse_param(tokens[i]);
+                
+                m_negotiated = true;
+                return true;
+            }
+            
+            extension = *end ? end + 1 : end;
+        }
+        
+        return false;
+    }
+    
+    // Build a client offer from the options
+    
+    static std::string offer(const ws_deflate_options& options)
+    {
+        std::string offer = "permessage-deflate; client_max_window_bits";
+        
+        if (!options.m_context_takeover)
+            offer += "; client_no_context_takeover";
+        
+        return offer;
+    }
+    
+private:
+    
+    static std::vector<std::string> split(const char *begin, const char *end)
+    {
+        std::vector<std::string> tokens;
+        
+        while (begin < end)
+        {
+            const char *next = std::find(begin, end, ';');
+            std::string token;
+            
+            for (const char *c = begin; c < next; c++)
+            {
+                if (!std::isspace(static_cast<unsigned char>(*c)) && *c != '"')
+                    token += *c;
+            }
+            
+            tokens.push_back(token);
+            begin = next < end ? next + 1 : end;
+        }
+        
+        return tokens;
+    }
+    
+    void parse_param(const std::string& param)
+    {
+        auto equals = param.find('=');
+        std::string name = param.substr(0, equals);
+        int value = equals == std::string::npos ? max_window_bits : std::atoi(param.c_str() + equals + 1);
+        
+        value = clamp(value);
+        
+        if (name == "server_max_window_bits")
+            m_server_window_bits = value;
+        else if (name == "client_max_window_bits")
+            m_client_window_bits = value;
+        else if (name == "server_no_context_takeover")
+            m_server_no_context_takeover = true;
+        else if (name == "client_no_context_takeover")
+            m_client_no_context_takeover = true;
+    }
+};
+
+#ifdef USE_ZLIB
+
+// A raw deflate compressor (with or without context takeover between messages)
+
+class ws_deflater
+{
+public:
+    
+    ws_deflater(int level, int window_bits, bool context_takeover)
+    : m_context_takeover(context_takeover)
+    {
+        configure(level, window_bits);
+    }
+    
+    ~ws_deflater()
+    {
+        if (m_valid)
+            deflateEnd(&m_stream);
+    }
+    
+    ws_deflater(const ws_deflater&) = delete;
+    ws_deflater& operator=(const ws_deflater&) = delete;
+    
+    // Change the level or window (restarting the context if either differs)
+    
+    void configure(int level, int window_bits)
+    {
+        window_bits = ws_deflate_params::clamp(window_bits);
+        
+        if (m_valid && level == m_level && window_bits == m_window_bits)
+            return;
+        
+        if (m_valid)
+            deflateEnd(&m_stream);
+        
+        m_stream = z_stream();
+        m_level = level;
+        m_window_bits = window_bits;
+        m_valid = deflateInit2(&m_stream, level, Z_DEFLATED, -window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    
+    // Compress a message into out (returns false on failure)
+    
+    bool compress(const ws_buffer *buffers, size_t count, std::vector<unsigned char>& out)
+    {
+        out.clear();
+        
+        if (!m_valid || (!m_context_takeover && deflateReset(&m_stream) != Z_OK))
+            return false;
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!deflate_buffer(buffers[i], i + 1 == count ? Z_SYNC_FLUSH : Z_NO_FLUSH, out))
+                return false;
+        }
+        
+        if (!count && !deflate_buffer(ws_buffer { nullptr, 0 }, Z_SYNC_FLUSH, out))
+            return false;
+        
+        // Remove the empty block ending the flush (RFC 7692 section 7.2.1)
+        
+        if (out.size() >= 4)
+            out.resize(out.size() - 4);
+        
+        return true;
+    }
+    
+private:
+    
+    bool deflate_buffer(const ws_buffer& buffer, int flush, std::vector<unsigned char>& out)
+    {
+        m_stream.next_in = const_cast<Bytef *>(static_cast<const Bytef *>(buffer.m_data));
+        m_stream.avail_in = static_cast<uInt>(buffer.m_size);
+        
+        do
+        {
+            size_t offset = out.size();
+            size_t available = deflateBound(&m_stream, m_stream.avail_in) + 16;
+            
+            out.resize(offset + available);
+            m_stream.next_out = out.data() + offset;
+            m_stream.avail_out = static_cast<uInt>(available);
+            
+            int result = deflate(&m_stream, flush);
+            
+            out.resize(offset + available - m_stream.avail_out);
+            
+            if (result != Z_OK && result != Z_BUF_ERROR)
+                return false;
+        }
+        while (m_stream.avail_in || (flush != Z_NO_FLUSH && !m_stream.avail_out));
+        
+        return true;
+    }
+    
+    z_stream m_stream;
+    int m_level = 0;
+    int m_window_bits = 0;
+    bool m_context_takeover;
+    bool m_valid = false;
+};
+
+// A raw deflate decompressor (keeping the full window is valid whether or not the peer takes over context)
+
+class ws_inflater
+{
+public:
+    
+    ws_inflater()
+    {
+        m_stream = z_stream();
+        m_valid = inflateInit2(&m_stream, -ws_deflate_params::max_window_bits) == Z_OK;
+    }
+    
+    ~ws_inflater()
+    {
+        if (m_valid)
+            inflateEnd(&m_stream);
+    }
+    
+    ws_inflater(const ws_inflater&) = delete;
+    ws_inflater& operator=(const ws_inflater&) = delete;
+    
+    // Decompress a message, or part of one, into out (returns false on failure)
+    
+    bool decompress(const void *data, size_t size, std::vector<unsigned char>& out, bool final = true)
+    {
+        static const unsigned char tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+        
+        out.clear();
+        
+        if (!m_valid || !inflate_buffer(data, size, out))
+            return false;
+        
+        return !final || inflate_buffer(tail, sizeof(tail), out);
+    }
+    
+private:
+    
+    bool inflate_buffer(const void *data, size_t size, std::vector<unsigned char>& out)
+    {
+        m_stream.next_in = const_cast<Bytef *>(static_cast<const Bytef *>(data));
+        m_stream.avail_in = static_cast<uInt>(size);
+        
+        while (true)
+        {
+            size_t offset = out.size();
+            size_t available = std::max(size_t(4096), size * 4);
+            
+            out.resize(offset + available);
+            m_stream.next_out = out.data() + offset;
+            m_stream.avail_out = static_cast<uInt>(available);
+            
+            int result = inflate(&m_stream, Z_SYNC_FLUSH);
+            
+            out.resize(offset + available - m_stream.avail_out);
+            
+            // A peer may end the stream with a final block, after which decompression starts afresh
+            
+            if (result == Z_STREAM_END)
+                result = inflateReset(&m_stream);
+            
+            if (result != Z_OK && result != Z_BUF_ERROR)
+                return false;
+            
+            // A full output buffer may leave output pending even once all the input has been read
+            
+            if (!m_stream.avail_out)
+                continue;
+            
+            if (!m_stream.avail_in)
+                return true;
+            
+            if (result == Z_BUF_ERROR)
+                return false;
+        }
+    }
+    
+    z_stream m_stream;
+    bool m_valid = false;
+};
+
+#else
+
+// Stand-ins when built without zlib (all operations fail)
+
+class ws_deflater
+{
+public:
+    
+    ws_deflater(int, int, bool) {}
+    
+    void configure(int, int) {}
+    bool compress(const ws_buffer *, size_t, std::vector<unsigned char>&) { return false; }
+};
+
+class ws_inflater
+{
+public:
+    
+    bool decompress(const void *, size_t, std::vector<unsigned char>&, bool = true) { return false; }
+};
+
+#endif
+
+// A message framed once for any number of connections, plus a compressed version for those that negotiated it
+
+struct ws_prepared_frame
+{
+    ws_frame m_frame;
+    ws_frame m_compressed;          // Empty if compression is off, or the message is small or did not shrink
+    
+    const ws_frame& get(bool compressed) const
+    {
+        return compressed && !m_compressed.empty() ? m_compressed : m_frame;
+    }
+    
+    size_t size() const { return m_frame.size(); }
+};
+
+// Builds prepared frames, compressing each message independently so the result is valid for every connection
+// (messages with no back references to earlier ones can be decoded whether or not context takeover was negotiated)
+
+class ws_frame_builder
+{
+public:
+    
+    ws_frame_builder(const ws_deflate_options& options) : m_options(options) {}
+    
+    // Build frames for one or more messages (in one buffer)
+    
+    ws_prepared_frame prepare(int opcode, const ws_buffer_list *messages, size_t count) const
+    {
+        ws_prepared_frame frame;
+        
+        frame.m_frame = ws_frame(opcode, messages, count);
+        
+        // Control frames and fragments are never compressed
+        
+        bool fragmented = (opcode & ws_frame_header::fragment) || !(opcode & 0x0F);
+        
+        if (!enabled() || fragmented || ws_is_control(static_cast<ws_opcode>(opcode & 0x0F)))
+            return frame;
+        
+        size_t size = 0;
+        
+        for (size_t i = 0; i < count; i++)
+            size += messages[i].size();
+        
+        if (size < m_options.m_threshold)
+            return frame;
+        
+        static thread_local ws_deflater deflater(m_options.m_level, m_options.m_window_bits, false);
+        
+        deflater.configure(m_options.m_level, m_options.m_window_bits);
+        frame.m_compressed = compress(deflater, opcode, messages, count, size);
+        
+        return frame;
+    }
+    
+    // Compress each message and frame them with RSV1 set into one buffer (returns an empty frame if none is smaller)
+    
+    static ws_frame compress(ws_deflater& deflater,
+                             int opcode,
+                             const ws_buffer_list *messages,
+                             size_t count,
+                             size_t size,
+                             bool masked = false)
+    {
+        std::vector<unsigned char> compressed;
+        std::vector<size_t> sizes(count);
+        std::vector<unsigned char> output;
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!deflater.compress(messages[i].m_buffers, messages[i].m_count, output))
+                return ws_frame();
+            
+            sizes[i] = output.size();
+            compressed.insert(compressed.end(), output.begin(), output.end());
+        }
+        
+        if (compressed.size() >= size)
+            return ws_frame();
+        
+        std::vector<ws_buffer> buffers(count);
+        std::vector<ws_buffer_list> lists(count);
+        
+        for (size_t i = 0, offset = 0; i < count; offset += sizes[i++])
+        {
+            buffers[i] = ws_buffer { compressed.data() + offset, sizes[i] };
+            lists[i] = ws_buffer_list { &buffers[i], 1 };
+        }
+        
+        return ws_frame(opcode | ws_frame_header::compressed, lists.data(), count, masked);
+    }
+    
+    // Whether compressed frames are built (and can be used given the window a connection negotiated)
+    
+    bool enabled() const { return ws_deflate_available && m_options.m_enable; }
+    
+    bool usable(const ws_deflate_params& params) const
+    {
+        int window_bits = ws_deflate_params::clamp(m_options.m_window_bits);
+        
+        return enabled() && params.m_negotiated && params.m_server_window_bits >= window_bits;
+    }
+    
+private:
+    
+    const ws_deflate_options m_options;
+};
+
+#endif /* WS_DEFLATE_HPP */
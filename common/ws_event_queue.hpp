@@ -0,0 +1,377 @@
+
+#ifndef WS_EVENT_QUEUE_HPP
+#define WS_EVENT_QUEUE_HPP
+
+#include "ws_base.hpp"
+#include "ws_allocator.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// The kinds of event delivered through an event queue
+
+enum class ws_event_type
+{
+    connect,
+    ready,
+    receive,
+    backpressure,
+    close,
+    error
+};
+
+// An event (the payload of a received message is held inline if small, else in a buffer from the payload allocator)
+
+class ws_event
+{
+    friend class ws_event_queue;
+    
+public:
+    
+    static constexpr size_t inline_size = 64;
+    
+    ws_event() {}
+    ~ws_event() { clear(); }
+    
+    ws_event(const ws_event&) = delete;
+    ws_event& operator=(const ws_event&) = delete;
+    
+    ws_event_type type() const { return m_type; }
+    ws_connection_id id() const { return m_id; }
+    
+    // Received messages (valid only until the poll callback returns)
+    
+    ws_opcode opcode() const { return m_opcode; }
+    const void *data() const { return m_heap ? m_heap : m_inline; }
+    size_t size() const { return m_size; }
+    
+    // Backpressure and error events
+    
+    bool congested() const { return m_value; }
+    int error() const { return m_value; }
+    
+private:
+    
+    void set(ws_event_type type, ws_connection_id id, int value = 0)
+    {
+        m_type = type;
+        m_id = id;
+        m_value = value;
+        m_size = 0;
+    }
+    
+    void set(ws_connection_id id, ws_opcode opcode, const void *data, size_t size)
+    {
+        set(ws_event_type::receive, id);
+        
+        m_opcode = opcode;
+        m_size = size;
+        
+        if (size > inline_size)
+            m_heap = static_cast<unsigned char *>(ws_payload_allocator().allocate(size));
+        
+        if (size)
+            std::memcpy(m_heap ? m_heap : m_inline, data, size);
+    }
+    
+    void clear()
+    {
+        if (m_heap)
+            ws_payload_allocator().deallocate(m_heap, m_size);
+        
+        m_heap = nullptr;
+    }
+    
+    ws_connection_id m_id = 0;
+    size_t m_size = 0;
+    unsigned char *m_heap = nullptr;
+    ws_event_type m_type = ws_event_type::close;
+    ws_opcode m_opcode = ws_opcode::binary;
+    int m_value = 0;
+    unsigned char m_inline[inline_size];
+};
+
+// A queue through which servers and clients deliver their events to a thread of the application's choosing
+//
+// Pass the queue as the owner when creating a server or client with typed handlers, for instance:
+//
+//     auto server = cw_ws_server::create("8080", "/ws", &queue);
+//
+// Backend threads then copy each event once into a bounded lock-free ring (after Vyukov's MPMC queue), and the
+// application drains it with poll(). The wakeup fd becomes readable when events are waiting, for use with epoll,
+// kqueue and the like, and is signalled once per batch rather than per event. An executor can instead be notified
+// through set_notify(). IDs from different servers and clients may coincide, so use a queue per source where that
+// matters. When the ring is full backend threads wait for space, which throttles receiving, so keep polling until
+// everything delivering to the queue has been destroyed. Connection user data cannot be used with a queue.
+
+class ws_event_queue
+{
+    struct cell
+    {
+        std::atomic<size_t> m_sequence;
+        ws_event m_event;
+    };
+    
+public:
+    
+    using notify_func = void (*)(void *context);
+    
+    // The capacity is rounded up to a power of two
+    
+    ws_event_queue(size_t capacity = 16384)
+    : m_mask(round_up(capacity) - 1)
+    , m_cells(new cell[m_mask + 1])
+    {
+        for (size_t i = 0; i <= m_mask; i++)
+            m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+        
+        open_wakeup();
+    }
+    
+    ~ws_event_queue()
+    {
+        close_wakeup();
+    }
+    
+    ws_event_queue(const ws_event_queue&) = delete;
+    ws_event_queue& operator=(const ws_event_queue&) = delete;
+    
+    // Handle events on the calling thread, up to a maximum (returns the number handled)
+    
+    template <typename F>
+    size_t poll(F func, size_t max_events = ~size_t(0))
+    {
+        size_t count = 0;
+        
+        while (count < max_events && pop(func))
+            count++;
+        
+        // Once empty clear the wakeup before allowing signals again (so none is read away), then recheck for an event
+        // pushed whilst signalling was still suppressed
+        
+        if (count < max_events)
+        {
+            clear_wakeup();
+            m_signalled.store(false);
+            
+            if (!empty() && !m_signalled.exchange(true))
+                signal();
+        }
+        
+        return count;
+    }
+    
+    // Wait for events (a negative time out waits indefinitely and returns false if none arrive in time)
+    
+    bool wait(int time_out_ms = -1)
+    {
+        if (!empty())
+            return true;
+        
+        struct pollfd descriptor { m_read_fd, POLLIN, 0 };
+        
+        return ::poll(&descriptor, 1, time_out_ms) > 0;
+    }
+    
+    // A descriptor that is readable whilst events are waiting
+    
+    int fd() const { return m_read_fd; }
+    
+    // Call a function (on a backend thread) whenever the wakeup is signalled - set this before anything can deliver
+    
+    void set_notify(notify_func func, void *context)
+    {
+        m_notify = func;
+        m_notify_context = context;
+    }
+    
+    bool empty() const
+    {
+        size_t head = m_head.load();
+        return m_cells[head & m_mask].m_sequence.load() != head + 1;
+    }
+    
+    // Typed handlers (called by the backends)
+    
+    void on_connect(ws_connection_id id) { push(ws_event_type::connect, id); }
+    void on_ready(ws_connection_id id) { push(ws_event_type::ready, id); }
+    void on_close(ws_connection_id id) { push(ws_event_type::close, id); }
+    void on_error(ws_connection_id id, int error) { push(ws_event_type::error, id, error); }
+    void on_backpressure(ws_connection_id id, bool congested) { push(ws_event_type::backpressure, id, congested); }
+    
+    void on_receive(ws_connection_id id, ws_opcode opcode, const void *data, size_t size)
+    {
+        push([&](ws_event& event) { event.set(id, opcode, data, size); });
+    }
+    
+private:
+    
+    static size_t round_up(size_t capacity)
+    {
+        size_t size = 2;
+        
+        while (size < capacity)
+            size <<= 1;
+        
+        return size;
+    }
+    
+    void push(ws_event_type type, ws_connection_id id, int value = 0)
+    {
+        push([&](ws_event& event) { event.set(type, id, value); });
+    }
+    
+    // Claim a cell and fill it in place, waiting whilst the ring is full
+    
+    template <typename F>
+    void push(F fill)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        
+        while (true)
+        {
+            cell& c = m_cells[tail & m_mask];
+            size_t sequence = c.m_sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence - tail);
+            
+            if (!difference)
+            {
+                if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                {
+                    fill(c.m_event);
+                    c.m_sequence.store(tail + 1, std::memory_order_release);
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                std::this_thread::yield();
+                tail = m_tail.load(std::memory_order_relaxed);
+            }
+            else
+                tail = m_tail.load(std::memory_order_relaxed);
+        }
+        
+        if (!m_signalled.exchange(true))
+            signal();
+    }
+    
+    // Handle the oldest event in place and free its cell (returns false if the ring is empty)
+    
+    template <typename F>
+    bool pop(F& func)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        
+        while (true)
+        {
+            cell& c = m_cells[head & m_mask];
+            size_t sequence = c.m_sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence - (head + 1));
+            
+            if (!difference)
+            {
+                if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed))
+                {
+                    const ws_event& event = c.m_event;
+                    func(event);
+                    c.m_event.clear();
+                    c.m_sequence.store(head + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+                return false;
+            else
+                head = m_head.load(std::memory_order_relaxed);
+        }
+    }
+    
+    // Wakeup (an eventfd on Linux and a non-blocking pipe elsewhere)
+    
+    void open_wakeup()
+    {
+#ifdef __linux__
+        m_read_fd = m_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        int fds[2] = { -1, -1 };
+        
+        if (!pipe(fds))
+        {
+            for (int fd : fds)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        
+        m_read_fd = fds[0];
+        m_write_fd = fds[1];
+#endif
+    }
+    
+    void close_wakeup()
+    {
+        if (m_read_fd >= 0)
+            ::close(m_read_fd);
+        if (m_write_fd >= 0 && m_write_fd != m_read_fd)
+            ::close(m_write_fd);
+    }
+    
+    void signal()
+    {
+#ifdef __linux__
+        uint64_t value = 1;
+#else
+        unsigned char value = 1;
+#endif
+        ssize_t result;
+        
+        do
+            result = ::write(m_write_fd, &value, sizeof(value));
+        while (result < 0 && errno == EINTR);
+        
+        if (m_notify)
+            m_notify(m_notify_context);
+    }
+    
+    void clear_wakeup()
+    {
+        unsigned char buffer[64];
+        
+        while (true)
+        {
+            ssize_t result = ::read(m_read_fd, buffer, sizeof(buffer));
+            
+            if (result <= 0 && !(result < 0 && errno == EINTR))
+                break;
+        }
+    }
+    
+    const size_t m_mask;
+    std::unique_ptr<cell[]> m_cells;
+    
+    alignas(64) std::atomic<size_t> m_head { 0 };
+    alignas(64) std::atomic<size_t> m_tail { 0 };
+    alignas(64) std::atomic<bool> m_signalled { false };
+    
+    int m_read_fd = -1;
+    int m_write_fd = -1;
+    notify_func m_notify = nullptr;
+    void *m_notify_context = nullptr;
+};
+
+#endif /* WS_EVENT_QUEUE_HPP */
@@ -0,0 +1,295 @@
+
+#ifndef WS_FRAME_HPP
+#define WS_FRAME_HPP
+
+#include "ws_base.hpp"
+#include "ws_allocator.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <random>
+
+// Websocket frame headers (RFC 6455 section 5.2)
+
+struct ws_frame_header
+{
+    static constexpr size_t max_size = 14;
+    
+    // Combine with an opcode to set RSV1 (marking a compressed message) or to clear FIN (for all but a final fragment)
+    
+    static constexpr int compressed = 0x40;
+    static constexpr int fragment = 0x100;
+    
+    // The size of a header for a given payload size
+    
+    static size_t size(size_t payload_size, bool masked = false)
+    {
+        size_t length_size = payload_size < 126 ? 0 : (payload_size <= 0xFFFF ? 2 : 8);
+        return 2 + length_size + (masked ? 4 : 0);
+    }
+    
+    // Write a header (with a masking key if provided) and return the number of bytes written
+    
+    static size_t write(unsigned char *out,
+                        int opcode,
+                        size_t payload_size,
+                        bool fin = true,
+                        const unsigned char *mask = nullptr)
+    {
+        size_t size = 2;
+        
+        fin = fin && !(opcode & fragment);
+        
+        out[0] = static_cast<unsigned char>((fin ? 0x80 : 0x00) | (opcode & (compressed | 0x0F)));
+        
+        if (payload_size < 126)
+        {
+            out[1] = static_cast<unsigned char>(payload_size);
+        }
+        else if (payload_size <= 0xFFFF)
+        {
+            out[1] = 126;
+            out[2] = static_cast<unsigned char>(payload_size >> 8);
+            out[3] = static_cast<unsigned char>(payload_size);
+            size = 4;
+        }
+        else
+        {
+            out[1] = 127;
+            
+            for (int i = 0; i < 8; i++)
+                out[2 + i] = static_cast<unsigned char>(static_cast<uint64_t>(payload_size) >> (56 - 8 * i));
+            
+            size = 10;
+        }
+        
+        if (mask)
+        {
+            out[1] |= 0x80;
+            std::memcpy(out + size, mask, 4);
+            size += 4;
+        }
+        
+        return size;
+    }
+};
+
+// A reference-counted, immutable buffer holding one or more complete frames
+//
+// Frames are built once and the same buffer can then be written to any number of server connections.
+// Masked frames (with a fresh key per frame) are for client connections and should only be written once.
+// Copies share the underlying buffer, which is freed when the last copy is destroyed.
+
+class ws_frame
+{
+    struct block
+    {
+        std::atomic<size_t> m_references;
+        size_t m_size;
+        
+        unsigned char *data() { return reinterpret_cast<unsigned char *>(this + 1); }
+    };
+    
+public:
+    
+    // An empty frame
+    
+    ws_frame() : m_block(nullptr) {}
+    
+    // Build a single frame from a payload
+    
+    ws_frame(int opcode, const void *data, size_t size, bool masked = false)
+    {
+        ws_buffer buffer { data, size };
+        ws_buffer_list message { &buffer, 1 };
+        
+        build(opcode, &message, 1, masked);
+    }
+    
+    // Build a single frame from a gather list
+    
+    ws_frame(int opcode, const ws_buffer *buffers, size_t count, bool masked = false)
+    {
+        ws_buffer_list message { buffers, count };
+        
+        build(opcode, &message, 1, masked);
+    }
+    
+    // Build a batch of frames (one per message) into a single buffer
+    
+    ws_frame(int opcode, const ws_buffer_list *messages, size_t count, bool masked = false)
+    {
+        build(opcode, messages, count, masked);
+    }
+    
+    // Join frames already built into a single buffer (so that they can be written at once)
+    
+    ws_frame(const ws_frame *frames, size_t count)
+    {
+        size_t size = 0;
+        
+        for (size_t i = 0; i < count; i++)
+            size += frames[i].size();
+        
+        m_block = allocate(size);
+        
+        unsigned char *out = m_block->data();
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            std::memcpy(out, frames[i].data(), frames[i].size());
+            out += frames[i].size();
+        }
+    }
+    
+    ws_frame(const ws_frame& other) : m_block(other.m_block)
+    {
+        retain();
+    }
+    
+    ws_frame(ws_frame&& other) : m_block(other.m_block)
+    {
+        other.m_block = nullptr;
+    }
+    
+    ws_frame& operator=(const ws_frame& other)
+    {
+        if (this != &other)
+        {
+            release();
+            m_block = other.m_block;
+            retain();
+        }
+        
+        return *this;
+    }
+    
+    ws_frame& operator=(ws_frame&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            m_block = other.m_block;
+            other.m_block = nullptr;
+        }
+        
+        return *this;
+    }
+    
+    ~ws_frame()
+    {
+        release();
+    }
+    
+    // Access the framed bytes
+    
+    const void *data() const { return m_block->data(); }
+    size_t size() const { return m_block->m_size; }
+    bool empty() const { return !m_block; }
+    
+    // Whether the frame starts with a whole text or binary message (so that the coalesce policy may discard it)
+    
+    bool coalescable() const
+    {
+        if (empty() || !m_block->m_size)
+            return false;
+        
+        unsigned char bits = m_block->data()[0];
+        auto opcode = static_cast<ws_opcode>(bits & 0x0F);
+        
+        return (bits & 0x80) && (opcode == ws_opcode::text || opcode == ws_opcode::binary);
+    }
+    
+private:
+    
+    void build(int opcode, const ws_buffer_list *messages, size_t count, bool masked)
+    {
+        size_t size = 0;
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t payload_size = messages[i].size();
+            size += ws_frame_header::size(payload_size, masked) + payload_size;
+        }
+        
+        m_block = allocate(size);
+        
+        unsigned char *out = m_block->data();
+        
+        for (size_t i = 0; i < count; i++)
+            out += write_message(out, opcode, messages[i], masked);
+    }
+    
+    static size_t write_message(unsigned char *out, int opcode, const ws_buffer_list& message, bool masked)
+    {
+        unsigned char mask[4];
+        
+        if (masked)
+            make_mask(mask);
+        
+        size_t size = ws_frame_header::write(out, opcode, message.size(), true, masked ? mask : nullptr);
+        
+        for (size_t i = 0, offset = 0; i < message.m_count; i++)
+        {
+            const unsigned char *in = static_cast<const unsigned char *>(message.m_buffers[i].m_data);
+            size_t length = message.m_buffers[i].m_size;
+            
+            if (!length)
+                continue;
+            
+            if (masked)
+            {
+                for (size_t j = 0; j < length; j++, offset++)
+                    out[size + j] = in[j] ^ mask[offset & 3];
+            }
+            else
+                std::memcpy(out + size, in, length);
+            
+            size += length;
+        }
+        
+        return size;
+    }
+    
+    static void make_mask(unsigned char *mask)
+    {
+        static thread_local std::mt19937 generator(std::random_device{}());
+        
+        uint32_t key = static_cast<uint32_t>(generator());
+        std::memcpy(mask, &key, 4);
+    }
+    
+    static block *allocate(size_t size)
+    {
+        block *b = static_cast<block *>(ws_payload_allocator().allocate(sizeof(block) + size));
+        
+        new (&b->m_references) std::atomic<size_t>(1);
+        b->m_size = size;
+        
+        return b;
+    }
+    
+    void retain()
+    {
+        if (m_block)
+            m_block->m_references.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void release()
+    {
+        if (m_block && m_block->m_references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            size_t size = sizeof(block) + m_block->m_size;
+            
+            m_block->m_references.~atomic();
+            ws_payload_allocator().deallocate(m_block, size);
+        }
+    }
+    
+    block *m_block;
+};
+
+#endif /* WS_FRAME_HPP */
@@ -0,0 +1,190 @@
+
+#ifndef WS_GROUPS_HPP
+#define WS_GROUPS_HPP
+
+#include "ws_base.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Type for group (topic/room) IDs
+
+using ws_group_id = uint64_t;
+
+// A group ID from a name (a 64-bit FNV-1a hash, so distinct names are vanishingly unlikely to collide)
+
+inline ws_group_id ws_group_name(const char *name)
+{
+    ws_group_id hash = 0xcbf29ce484222325ULL;
+    
+    for ( ; *name; name++)
+        hash = (hash ^ static_cast<unsigned char>(*name)) * 0x100000001b3ULL;
+    
+    return hash;
+}
+
+// Group membership for a server's connections
+//
+// Each group keeps its members in a dense array of connection pointers, so fanning out to a group walks contiguous
+// memory without looking up IDs. Membership changes take the writer lock and sends to a group take the reader lock,
+// so connections must be removed from all groups before they are released (see ws_server_base::remove_connection).
+
+template <class connection_type>
+class ws_groups
+{
+    struct member
+    {
+        connection_type m_connection;
+        ws_connection_id m_id;
+    };
+    
+    struct group
+    {
+        std::vector<member> m_members;
+        std::unordered_map<ws_connection_id, size_t> m_index;
+    };
+    
+public:
+    
+    // Add a connection to a group (the find function is called under the lock and returns nullptr if not connected)
+    // Returns false if not connected or already a member
+    
+    template <typename F>
+    bool add(ws_connection_id id, ws_group_id group_id, F find)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        
+        connection_type connection = find(id);
+        
+        if (!connection)
+            return false;
+        
+        group& g = m_groups[group_id];
+        
+        if (!g.m_index.emplace(id, g.m_members.size()).second)
+            return false;
+        
+        g.m_members.push_back(member { connection, id });
+        m_memberships[id].push_back(group_id);
+        
+        return true;
+    }
+    
+    // Remove a connection from a group (returns false if it was not a member)
+    
+    bool remove(ws_connection_id id, ws_group_id group_id)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        
+        auto it = m_memberships.find(id);
+        
+        if (it == m_memberships.end() || !remove_member(id, group_id))
+            return false;
+        
+        auto& groups = it->second;
+        
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            if (groups[i] == group_id)
+            {
+                groups[i] = groups.back();
+                groups.pop_back();
+                break;
+            }
+        }
+        
+        if (groups.empty())
+            m_memberships.erase(it);
+        
+        return true;
+    }
+    
+    // Remove a connection from all of its groups (on return no send to a group can still be using it)
+    
+    void remove(ws_connection_id id)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        
+        auto it = m_memberships.find(id);
+        
+        if (it == m_memberships.end())
+            return;
+        
+        for (auto group_id : it->second)
+            remove_member(id, group_id);
+        
+        m_memberships.erase(it);
+    }
+    
+    // The number of members in a group
+    
+    size_t size(ws_group_id group_id) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        
+        auto it = m_groups.find(group_id);
+        
+        return it == m_groups.end() ? 0 : it->second.m_members.size();
+    }
+    
+    // Call a function on each member of a group (which must not change membership)
+    
+    template <typename F>
+    void for_each(ws_group_id group_id, F func) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        
+        auto it = m_groups.find(group_id);
+        
+        if (it == m_groups.end())
+            return;
+        
+        for (auto& m : it->second.m_members)
+            func(m.m_connection);
+    }
+    
+private:
+    
+    // Swap the member with the last and shrink (whilst holding the writer lock)
+    
+    bool remove_member(ws_connection_id id, ws_group_id group_id)
+    {
+        auto it = m_groups.find(group_id);
+        
+        if (it == m_groups.end())
+            return false;
+        
+        group& g = it->second;
+        auto index = g.m_index.find(id);
+        
+        if (index == g.m_index.end())
+            return false;
+        
+        size_t position = index->second;
+        
+        g.m_index.erase(index);
+        
+        if (position != g.m_members.size() - 1)
+        {
+            g.m_members[position] = g.m_members.back();
+            g.m_index[g.m_members[position].m_id] = position;
+        }
+        
+        g.m_members.pop_back();
+        
+        if (g.m_members.empty())
+            m_groups.erase(it);
+        
+        return true;
+    }
+    
+    std::unordered_map<ws_group_id, group> m_groups;
+    std::unordered_map<ws_connection_id, std::vector<ws_group_id>> m_memberships;
+    mutable std::shared_mutex m_mutex;
+};
+
+#endif /* WS_GROUPS_HPP */
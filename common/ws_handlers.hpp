@@ -4,13 +4,20 @@
 
 #include "ws_base.hpp"
 
+#include <cstddef>
+
 // Function type definitions
 
 struct ws_handler_funcs
 {
     using ready_handler = void(*)(ws_connection_id, void *);
     using connect_handler = void(*)(ws_connection_id, void *);
-    using receive_handler = void(*)(ws_connection_id, const void *, size_t, void *);
+    using receive_handler = void(*)(ws_connection_id, ws_opcode, const void *, size_t, void *);
+    using receive_regions_handler = void(*)(ws_connection_id, ws_opcode, const ws_buffer *, size_t, void *);
+    using receive_fragment_handler = void(*)(ws_connection_id, ws_opcode, const void *, size_t, bool, void *);
+    using backpressure_handler = void(*)(ws_connection_id, bool, void *);
+    using error_handler = void(*)(ws_connection_id, int, void *);
+    using rtt_handler = void(*)(ws_connection_id, uint64_t, void *);
 };
 
 // Client handlers (and owner type which includes the handlers)
@@ -19,6 +26,22 @@ struct ws_client_handlers
 {
     const ws_handler_funcs::receive_handler m_receive;
     const ws_handler_funcs::connect_handler m_close;
+    
+    // Optional - if set this is called instead of m_receive with the message regions as held by the backend
+    // The regions are borrowed and are only valid for the duration of the call
+    
+    const ws_handler_funcs::receive_regions_handler m_receive_regions = nullptr;
+    
+    // Optional - if set messages are streamed to this instead, in chunks as they arrive with a final flag on the last
+    // Every chunk is passed the opcode of its message (control messages are passed whole)
+    
+    const ws_handler_funcs::receive_fragment_handler m_receive_fragment = nullptr;
+    
+    // Optional - called once the connection is ready to send, or with an errno-style code if it fails to connect
+    // (the code may be zero if the backend cannot tell why)
+    
+    const ws_handler_funcs::ready_handler m_ready = nullptr;
+    const ws_handler_funcs::error_handler m_error = nullptr;
 };
 
 template <const ws_client_handlers& handlers>
@@ -28,6 +51,9 @@ struct ws_client_owner
 };
 
 // Server handlers (and owner type which includes the handlers)
+//
+// Handlers are passed the owner, except that a connection's handlers after m_connect are passed its user data instead
+// if it has been set (see ws_server_base::set_user_data), saving a lookup from the ID to session state per message.
 
 struct ws_server_handlers
 {
@@ -35,8 +61,44 @@ struct ws_server_handlers
     const ws_handler_funcs::ready_handler m_ready;
     const ws_handler_funcs::receive_handler m_receive;
     const ws_handler_funcs::connect_handler m_close;
+    
+    // Optional - called with true when a connection goes over its high watermark and false once it drains
+    
+    const ws_handler_funcs::backpressure_handler m_backpressure = nullptr;
+    
+    // Optional - if set this is called instead of m_receive with the message regions as held by the backend
+    // The regions are borrowed and are only valid for the duration of the call
+    
+    const ws_handler_funcs::receive_regions_handler m_receive_regions = nullptr;
+    
+    // Optional - if set messages are streamed to this instead, in chunks as they arrive with a final flag on the last
+    // Every chunk is passed the opcode of its message (control messages are passed whole)
+    
+    const ws_handler_funcs::receive_fragment_handler m_receive_fragment = nullptr;
+    
+    // Optional - called when a connection is closed for sending nothing within the heartbeat time out (before m_close),
+    // and with the round trip time in microseconds whenever a heartbeat ping is answered
+    
+    const ws_handler_funcs::connect_handler m_idle = nullptr;
+    const ws_handler_funcs::rtt_handler m_rtt = nullptr;
 };
 
+// Deliver a contiguous message to whichever receive handler is set
+
+template <class H>
+void ws_deliver(const H& handlers, ws_connection_id id, ws_opcode opcode, const void *data, size_t size, void *owner)
+{
+    if (handlers.m_receive_fragment)
+        handlers.m_receive_fragment(id, opcode, data, size, true, owner);
+    else if (handlers.m_receive_regions)
+    {
+        ws_buffer region { data, size };
+        handlers.m_receive_regions(id, opcode, &region, 1, owner);
+    }
+    else
+        handlers.m_receive(id, opcode, data, size, owner);
+}
+
 template <const ws_server_handlers& handlers>
 struct ws_server_owner
 {
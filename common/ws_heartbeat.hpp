@@ -0,0 +1,210 @@
+
+#ifndef WS_HEARTBEAT_HPP
+#define WS_HEARTBEAT_HPP
+
+#include "ws_base.hpp"
+#include "ws_options.hpp"
+#include "ws_timer_wheel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Per-connection heartbeat state
+//
+// Receiving a frame costs one relaxed load and store of the server's coarse clock, so no timer is touched per message.
+
+class ws_heartbeat_state
+{
+public:
+    
+    // Attach to a server's clock (before the connection is visible)
+    
+    void attach(const std::atomic<uint64_t> *clock)
+    {
+        m_clock = clock;
+        m_heard.store(clock->load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    
+    // Note that the peer has been heard from
+    
+    void heard()
+    {
+        if (m_clock)
+            m_heard.store(m_clock->load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    
+    uint64_t last_heard() const { return m_heard.load(std::memory_order_relaxed); }
+    
+    // Record a ping being sent and return its stamp (the time in microseconds, carried as the ping's payload)
+    
+    uint64_t ping()
+    {
+        uint64_t stamp = std::max(uint64_t(1), now());
+        m_ping.store(stamp, std::memory_order_relaxed);
+        return stamp;
+    }
+    
+    // Match a pong to the outstanding ping, recording and returning the round trip time in microseconds (or zero)
+    
+    uint64_t answered(uint64_t stamp)
+    {
+        uint64_t expected = stamp;
+        
+        if (!stamp || !m_ping.compare_exchange_strong(expected, 0, std::memory_order_relaxed))
+            return 0;
+        
+        uint64_t rtt = std::max(uint64_t(1), now() - stamp);
+        m_rtt.store(rtt, std::memory_order_relaxed);
+        return rtt;
+    }
+    
+    // The last round trip time in microseconds (zero if no ping has been answered)
+    
+    uint64_t rtt() const { return m_rtt.load(std::memory_order_relaxed); }
+    
+    static uint64_t now()
+    {
+        auto time = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+    }
+    
+private:
+    
+    const std::atomic<uint64_t> *m_clock = nullptr;
+    std::atomic<uint64_t> m_heard { 0 };
+    std::atomic<uint64_t> m_ping { 0 };
+    std::atomic<uint64_t> m_rtt { 0 };
+};
+
+// Heartbeats for all of a server's connections, driven by one timer wheel on one thread
+//
+// Each connection has a single timer. When it falls due the check function decides from the last time the connection
+// was heard from whether to ping it, close it as idle or simply look again later, and returns the tick to look again
+// at (or zero once closing). The thread ticks at the resolution given and advances a coarse clock that connections
+// read when they receive.
+
+class ws_heartbeat
+{
+public:
+    
+    ~ws_heartbeat()
+    {
+        stop();
+    }
+    
+    // Start (once, if enabled)
+    
+    template <typename F>
+    void start(const ws_heartbeat_options& options, F check)
+    {
+        if (!options.m_enable || m_thread.joinable())
+            return;
+        
+        m_resolution_ms = std::max(1, options.m_resolution_ms);
+        m_interval = std::max(uint64_t(1), ticks(options.m_interval_ms));
+        m_timeout = std::max(m_interval + 1, ticks(options.m_timeout_ms));
+        m_enabled.store(true);
+        
+        m_thread = std::thread([this, check]() { run(check); });
+    }
+    
+    // Stop (before the server stops handling pings)
+    
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        
+        m_condition.notify_all();
+        
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+    
+    bool enabled() const { return m_enabled.load(); }
+    
+    // The clock (in ticks since starting)
+    
+    const std::atomic<uint64_t>& clock() const { return m_clock; }
+    
+    uint64_t now() const { return m_clock.load(std::memory_order_relaxed); }
+    
+    // Intervals in ticks
+    
+    uint64_t interval() const { return m_interval; }
+    uint64_t timeout() const { return m_timeout; }
+    
+    // Schedule a check of a connection
+    
+    void schedule(ws_connection_id id, uint64_t tick)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wheel.schedule(id, tick);
+    }
+    
+private:
+    
+    uint64_t ticks(int ms) const
+    {
+        return static_cast<uint64_t>(std::max(0, ms) + m_resolution_ms - 1) / m_resolution_ms;
+    }
+    
+    // Tick, checking connections outside the lock so that they can be rescheduled
+    
+    template <typename F>
+    void run(F check)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto resolution = std::chrono::milliseconds(m_resolution_ms);
+        std::vector<ws_connection_id> due;
+        
+        std::unique_lock<std::mutex> lock(m_mutex);
+        
+        while (true)
+        {
+            auto next = start + resolution * (m_wheel.current() + 1);
+            
+            if (m_condition.wait_until(lock, next, [&]() { return m_stop; }))
+                break;
+            
+            uint64_t tick = (std::chrono::steady_clock::now() - start) / resolution;
+            
+            m_clock.store(tick, std::memory_order_relaxed);
+            m_wheel.advance(tick, [&](ws_connection_id id) { due.push_back(id); });
+            
+            lock.unlock();
+            
+            for (auto id : due)
+            {
+                uint64_t again = check(id, tick);
+                
+                if (again)
+                    schedule(id, again);
+            }
+            
+            due.clear();
+            lock.lock();
+        }
+    }
+    
+    ws_timer_wheel<ws_connection_id> m_wheel;
+    std::atomic<uint64_t> m_clock { 0 };
+    std::atomic<bool> m_enabled { false };
+    int m_resolution_ms = 1;
+    uint64_t m_interval = 1;
+    uint64_t m_timeout = 2;
+    bool m_stop = false;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::thread m_thread;
+};
+
+#endif /* WS_HEARTBEAT_HPP */
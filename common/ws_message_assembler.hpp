@@ -0,0 +1,94 @@
+
+#ifndef WS_MESSAGE_ASSEMBLER_HPP
+#define WS_MESSAGE_ASSEMBLER_HPP
+
+#include "ws_base.hpp"
+#include "ws_handlers.hpp"
+
+#include <cstddef>
+#include <vector>
+
+// Tracks fragmented messages for backends that receive frame by frame
+//
+// Each frame is either streamed to a fragment handler or, for other handlers, appended until the final fragment.
+// Unfragmented messages are passed on without copying and control frames (which may arrive mid-message) pass straight
+// through. One assembler serves one connection and must only be used by one thread at a time.
+
+class ws_message_assembler
+{
+public:
+    
+    static constexpr int fin_bit = 0x80;
+    
+    // Handle a frame given the first byte of its header (returns false if the frame is out of sequence)
+    
+    template <class H>
+    bool receive(const H& handlers, ws_connection_id id, int bits, const void *data, size_t size, void *owner)
+    {
+        ws_opcode opcode = static_cast<ws_opcode>(bits & 0x0F);
+        bool final = bits & fin_bit;
+        
+        if (ws_is_control(opcode))
+        {
+            ws_deliver(handlers, id, opcode, data, size, owner);
+            return true;
+        }
+        
+        // A continuation must follow an unfinished message, and anything else must not
+        
+        if ((opcode == ws_opcode::continuation) != m_in_message)
+            return false;
+        
+        if (!m_in_message)
+            m_opcode = opcode;
+        
+        m_in_message = !final;
+        
+        if (handlers.m_receive_fragment)
+        {
+            handlers.m_receive_fragment(id, m_opcode, data, size, final, owner);
+            return true;
+        }
+        
+        if (final && m_buffer.empty())
+        {
+            ws_deliver(handlers, id, m_opcode, data, size, owner);
+            return true;
+        }
+        
+        auto bytes = static_cast<const unsigned char *>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+        
+        if (final)
+        {
+            ws_deliver(handlers, id, m_opcode, m_buffer.data(), m_buffer.size(), owner);
+            release();
+        }
+        
+        return true;
+    }
+    
+    // Whether a frame (given its header byte) starts a new data message
+    
+    bool starts_message(int bits) const
+    {
+        ws_opcode opcode = static_cast<ws_opcode>(bits & 0x0F);
+        
+        return !m_in_message && opcode != ws_opcode::continuation && !ws_is_control(opcode);
+    }
+    
+private:
+    
+    // Free the reassembly buffer (so that one large message does not pin its memory)
+    
+    void release()
+    {
+        std::vector<unsigned char>().swap(m_buffer);
+    }
+    
+    std::vector<unsigned char> m_buffer;
+    ws_opcode m_opcode = ws_opcode::binary;
+    bool m_in_message = false;
+};
+
+#endif /* WS_MESSAGE_ASSEMBLER_HPP */
@@ -0,0 +1,225 @@
+
+#ifndef WS_OPTIONS_HPP
+#define WS_OPTIONS_HPP
+
+#include "ws_send_queue.hpp"
+
+#include <cstddef>
+#include <string>
+
+class ws_capture_log;
+
+// permessage-deflate settings (CivetWeb only, and only when built with USE_ZLIB)
+
+struct ws_deflate_options
+{
+    bool m_enable = false;
+    
+    // Compression level (0-9) and the window used when compressing (9-15)
+    
+    int m_level = 6;
+    int m_window_bits = 15;
+    
+    // Keep the compression context between messages where possible (clients only, as servers compress once for all)
+    
+    bool m_context_takeover = true;
+    
+    // Messages smaller than this are sent uncompressed
+    
+    size_t m_threshold = 256;
+};
+
+// TCP settings (no delay applies to the Apple backends and the CivetWeb server, the rest to Apple only)
+// Times are in seconds
+
+struct ws_tcp_options
+{
+    bool m_no_delay = true;
+    bool m_keepalive = true;
+    unsigned int m_keepalive_idle_time = 1;
+    unsigned int m_keepalive_count = 1;
+    unsigned int m_keepalive_interval = 2;
+    unsigned int m_connection_timeout = 2;
+    unsigned int m_persist_timeout = 2;
+    unsigned int m_retransmit_connection_drop_time = 2;
+};
+
+// TLS settings (wss://)
+//
+// CivetWeb must be built without NO_SSL and initialised with mg_init_library(MG_FEATURES_SSL). Servers resume
+// sessions from CivetWeb's session cache or with Network.framework's resumption and tickets. CivetWeb's client makes a
+// new TLS context for each connection, so it always performs a full handshake.
+
+struct ws_tls_options
+{
+    bool m_enable = false;
+    
+    // PEM file holding the certificate and its private key (CivetWeb - required for servers, optional for clients)
+    
+    std::string m_certificate;
+    
+    // PKCS #12 file and passphrase holding the identity (Apple - required for servers, optional for clients)
+    
+    std::string m_identity;
+    std::string m_identity_passphrase;
+    
+    // CA certificates for verifying the peer (CivetWeb only - clients then verify the server and servers require
+    // client certificates, neither of which happens without one)
+    
+    std::string m_ca_file;
+    
+    // Name to verify the server's certificate against and send for SNI, if not the host (clients only)
+    
+    std::string m_server_name;
+    
+    // Accept any server certificate (Apple clients only, which otherwise verify against the system trust store)
+    
+    bool m_allow_untrusted = false;
+    
+    // Session resumption (the cache timeout is in seconds and applies to CivetWeb servers only - zero disables)
+    
+    bool m_resumption = true;
+    int m_session_cache_timeout = 300;
+};
+
+// Network service class (Apple only - maps to nw_service_class_t)
+
+enum class ws_service_class
+{
+    best_effort,
+    background,
+    interactive_video,
+    interactive_voice,
+    responsive_data,
+    signaling
+};
+
+// Application-level heartbeats (servers only)
+//
+// Connections that have sent nothing for the interval are pinged (again each interval whilst they stay quiet), and
+// those that have sent nothing at all, pongs included, for the time out are closed as idle. One timer wheel per
+// server covers every connection, ticking at the resolution given. When enabled CivetWeb's websocket time out is
+// capped to the heartbeat time out (so idle connections close promptly) and the Apple backend turns TCP keepalive off.
+
+struct ws_heartbeat_options
+{
+    bool m_enable = false;
+    int m_interval_ms = 15000;
+    int m_timeout_ms = 45000;
+    int m_resolution_ms = 250;
+};
+
+// Batching small messages into single writes (servers only)
+//
+// Messages queued to an idle batching connection are held for up to the delay so that more can join them. CivetWeb
+// and loopback connections then write runs of frames smaller than the batch size as one buffer, so a burst of small
+// updates costs one write rather than one each. The Apple backend cannot join frames, but hands everything held to the
+// framework in one batch. Pings and closes are not held.
+
+struct ws_batching_options
+{
+    bool m_enable = false;                  // The initial mode of each connection (see set_batching())
+    int m_max_delay_us = 200;
+    size_t m_max_batch_size = 16 * 1024;
+};
+
+// Server options (fields that do not apply to a backend are ignored by it)
+
+struct ws_server_options
+{
+    // Outbound queue limits and policy for each connection
+    
+    ws_send_queue_options m_send_queue;
+    
+    // The number of threads draining outbound queues (CivetWeb only - zero uses the hardware concurrency)
+    
+    unsigned int m_send_threads = 0;
+    
+    // The number of serial queues connections are spread across (Apple only - zero uses one per core)
+    
+    unsigned int m_dispatch_queues = 0;
+    
+    // How long to wait for the server to start listening (Apple only - zero waits indefinitely)
+    
+    int m_timeout_ms = 400;
+    
+    // Worker threads (CivetWeb only - each open websocket holds one, so this caps concurrent clients)
+    // Zero sizes the pool from the hardware concurrency
+    
+    unsigned int m_worker_threads = 0;
+    
+    // Listen backlog and accepted connections waiting for a worker (CivetWeb only - zero keeps CivetWeb's defaults)
+    
+    int m_listen_backlog = 0;
+    int m_connection_queue = 0;
+    
+    // Share the port with other servers in the process that also set this, which then take connections in turn
+    // (Apple and loopback only - CivetWeb binds its own listening sockets without SO_REUSEPORT, so spread CivetWeb
+    // instances across separate ports instead)
+    
+    bool m_reuse_port = false;
+    
+    // Close websockets that receive nothing for this long (CivetWeb only - zero keeps CivetWeb's default, and with
+    // heartbeats enabled it is capped to the heartbeat time out)
+    
+    int m_websocket_timeout_ms = 0;
+    
+    // TCP settings and service class
+    
+    ws_tcp_options m_tcp;
+    ws_service_class m_service_class = ws_service_class::signaling;
+    
+    // TLS (when enabled CivetWeb listens with TLS on the port given, with or without its "s" suffix)
+    
+    ws_tls_options m_tls;
+    
+    // Heartbeats (ping/pong) for detecting idle or dead connections
+    
+    ws_heartbeat_options m_heartbeat;
+    
+    // Batching of small outbound messages
+    
+    ws_batching_options m_batching;
+    
+    // A log to capture each connection's frames to (see ws_capture_log - it must be open and outlive the server)
+    
+    ws_capture_log *m_capture = nullptr;
+    
+    // HTTP keep-alive (CivetWeb only)
+    
+    bool m_keep_alive = true;
+    int m_keep_alive_timeout_ms = 500;
+    
+    // Compression for connections that offer permessage-deflate (CivetWeb must also be built with USE_ZLIB and
+    // MG_EXPERIMENTAL_INTERFACES, as it negotiates the extension and decompresses what it receives)
+    
+    ws_deflate_options m_deflate;
+};
+
+// Client options (fields that do not apply to a backend are ignored by it)
+
+struct ws_client_options
+{
+    // How long to wait for the connection to become ready (Apple only - zero waits indefinitely)
+    
+    int m_timeout_ms = 400;
+    
+    // TCP settings and service class (Apple only)
+    
+    ws_tcp_options m_tcp;
+    ws_service_class m_service_class = ws_service_class::signaling;
+    
+    // TLS (connect with wss://)
+    
+    ws_tls_options m_tls;
+    
+    // Offer permessage-deflate to the server (CivetWeb only)
+    
+    ws_deflate_options m_deflate;
+    
+    // Run on a process-wide set of serial queues, one per core, rather than a queue per client (Apple only)
+    
+    bool m_share_queues = false;
+};
+
+#endif /* WS_OPTIONS_HPP */
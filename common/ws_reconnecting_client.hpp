@@ -0,0 +1,497 @@
+
+#ifndef WS_RECONNECTING_CLIENT_HPP
+#define WS_RECONNECTING_CLIENT_HPP
+
+#include "ws_base.hpp"
+#include "ws_handlers.hpp"
+#include "ws_options.hpp"
+#include "ws_send_queue.hpp"
+#include "ws_typed_handlers.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reconnection settings (times are in milliseconds)
+//
+// Each attempt waits a random time of up to the current delay (full jitter), so that clients dropped together spread
+// their reconnects out. The delay starts at the initial delay, grows by the multiplier after each failed attempt up
+// to the maximum and starts again once a connection becomes ready.
+
+struct ws_reconnect_options
+{
+    unsigned int m_initial_delay_ms = 100;
+    unsigned int m_max_delay_ms = 30000;
+    double m_multiplier = 2.0;
+    
+    // The fraction of the delay that is randomised (zero waits the full delay each time)
+    
+    double m_jitter = 1.0;
+    
+    // Consecutive failed attempts before giving up (zero retries indefinitely)
+    
+    unsigned int m_max_attempts = 0;
+    
+    // Messages kept whilst disconnected and sent once reconnected
+    // When full either new messages are dropped or, if set, the oldest are discarded to make room
+    
+    size_t m_buffer_messages = 1024;
+    size_t m_buffer_bytes = 1024 * 1024;
+    bool m_drop_oldest = false;
+};
+
+// Delays between reconnection attempts, as set out by ws_reconnect_options (not thread-safe)
+
+class ws_backoff
+{
+public:
+    
+    ws_backoff(const ws_reconnect_options& options)
+    : m_options(options)
+    , m_random(std::random_device()())
+    {}
+    
+    // The delay before an attempt, given the number of attempts that have failed since the last connection
+    
+    std::chrono::milliseconds delay(unsigned int attempt)
+    {
+        double delay = m_options.m_initial_delay_ms;
+        
+        for (unsigned int i = 0; i < attempt && delay < m_options.m_max_delay_ms; i++)
+            delay *= m_options.m_multiplier;
+        
+        delay = std::min(delay, static_cast<double>(m_options.m_max_delay_ms));
+        
+        std::uniform_real_distribution<double> distribution(0.0, 1.0);
+        double jitter = std::min(std::max(m_options.m_jitter, 0.0), 1.0);
+        
+        delay *= 1.0 - jitter * distribution(m_random);
+        
+        return std::chrono::milliseconds(static_cast<long long>(delay));
+    }
+    
+private:
+    
+    const ws_reconnect_options m_options;
+    std::minstd_rand m_random;
+};
+
+// A client that reconnects when its connection drops, for any backend client type
+//
+// The client and its ws_connection_id stay the same across reconnects. Handlers see:
+//
+// m_ready - after each connection, before buffered messages are sent (the place to resubscribe, as sends from it go
+//           first and sends from other threads wait for it)
+// m_close - each time a ready connection is lost, including when the client is destroyed
+// m_error - each time an attempt to connect fails
+//
+// Connections are made on a thread per client, which sleeps whilst connected. Fragmented sends are not offered, as a
+// message could be split across connections.
+
+template <class C>
+class ws_reconnecting_client
+{
+public:
+    
+    // Create (never returns nullptr, and connects in the background)
+    
+    template <const ws_client_handlers& handlers>
+    static ws_reconnecting_client *create(const char *host,
+                                          uint16_t port,
+                                          const char *path,
+                                          ws_client_owner<handlers> owner,
+                                          const ws_reconnect_options& reconnect = ws_reconnect_options(),
+                                          const ws_client_options& options = ws_client_options())
+    {
+        return new ws_reconnecting_client(host, port, path, owner, reconnect, options);
+    }
+    
+    // Create with handlers that are members of the owner's type (see ws_typed_handlers)
+    
+    template <class O>
+    static ws_reconnecting_client *create(const char *host,
+                                          uint16_t port,
+                                          const char *path,
+                                          O *owner,
+                                          const ws_reconnect_options& reconnect = ws_reconnect_options(),
+                                          const ws_client_options& options = ws_client_options())
+    {
+        constexpr auto& handlers = ws_typed_handlers<O>::client;
+        
+        return create<handlers>(host, port, path, ws_client_owner<handlers> { owner }, reconnect, options);
+    }
+    
+    // Destructor (closes the connection and stops reconnecting)
+    
+    ~ws_reconnecting_client()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            m_stop = true;
+        }
+        
+        m_condition.notify_all();
+        m_thread.join();
+    }
+    
+    // The ID passed to handlers (stable across reconnects)
+    
+    ws_connection_id id() const { return as_ws_connection_id(this); }
+    
+    // Connection state
+    
+    bool ready()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        return m_client && m_connected;
+    }
+    
+    // False once the maximum number of attempts has failed
+    
+    bool reconnecting()
+    {
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        
+        return !m_given_up;
+    }
+    
+    // Send (buffered whilst disconnected)
+    
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        ws_buffer buffer { data, size };
+        
+        send(&buffer, 1, opcode);
+    }
+    
+    // Send (gathered into one message)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        if (m_client && m_connected)
+            m_client->send(buffers, count, opcode);
+        else
+            buffer(buffers, count, opcode);
+    }
+    
+    // Send a batch of binary messages
+    
+    void send_batch(const ws_buffer_list *messages, size_t count)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        if (m_client && m_connected)
+            m_client->send_batch(messages, count);
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+                buffer(messages[i].m_buffers, messages[i].m_count, ws_opcode::binary);
+        }
+    }
+    
+    // Buffered messages and the number dropped because the buffer was full
+    
+    ws_queue_depth buffered()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        return ws_queue_depth { m_buffer.size(), m_buffered_bytes };
+    }
+    
+    uint64_t dropped()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        return m_dropped;
+    }
+    
+    // The number of connections made (the first included)
+    
+    uint64_t connections()
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        return m_connections;
+    }
+    
+private:
+    
+    struct buffered_message
+    {
+        std::vector<unsigned char> m_data;
+        ws_opcode m_opcode;
+    };
+    
+    // Handlers for the backend client (passing on the stable ID and the owner)
+    
+    template <const ws_client_handlers& handlers>
+    struct relay
+    {
+        static ws_reconnecting_client& get(void *x) { return *static_cast<ws_reconnecting_client *>(x); }
+        
+        static void receive(ws_connection_id, ws_opcode opcode, const void *data, size_t size, void *x)
+        {
+            handlers.m_receive(get(x).id(), opcode, data, size, get(x).m_owner);
+        }
+        
+        static void receive_regions(ws_connection_id, ws_opcode opcode, const ws_buffer *regions, size_t count, void *x)
+        {
+            handlers.m_receive_regions(get(x).id(), opcode, regions, count, get(x).m_owner);
+        }
+        
+        static void receive_fragment(ws_connection_id,
+                                     ws_opcode opcode,
+                                     const void *data,
+                                     size_t size,
+                                     bool final,
+                                     void *x)
+        {
+            handlers.m_receive_fragment(get(x).id(), opcode, data, size, final, get(x).m_owner);
+        }
+        
+        static void ready(ws_connection_id, void *x)
+        {
+            get(x).connected(handlers.m_ready);
+        }
+        
+        static void close(ws_connection_id, void *x)
+        {
+            if (get(x).lost(0))
+                handlers.m_close(get(x).id(), get(x).m_owner);
+        }
+        
+        static void error(ws_connection_id, int error, void *x)
+        {
+            get(x).lost(error);
+            
+            if constexpr (handlers.m_error != nullptr)
+                handlers.m_error(get(x).id(), error, get(x).m_owner);
+        }
+        
+        static constexpr ws_client_handlers relayed
+        {
+            receive,
+            close,
+            handlers.m_receive_regions ? &receive_regions : nullptr,
+            handlers.m_receive_fragment ? &receive_fragment : nullptr,
+            ready,
+            error
+        };
+    };
+    
+    // Keep a copy of a message (whilst holding m_mutex)
+    
+    void buffer(const ws_buffer *buffers, size_t count, ws_opcode opcode)
+    {
+        ws_buffer_list list { buffers, count };
+        size_t size = list.size();
+        
+        auto full = [&]()
+        {
+            return m_buffer.size() >= m_options.m_buffer_messages
+                || m_buffered_bytes + size > m_options.m_buffer_bytes;
+        };
+        
+        while (m_options.m_drop_oldest && !m_buffer.empty() && full())
+        {
+            m_buffered_bytes -= m_buffer.front().m_data.size();
+            m_buffer.pop_front();
+            m_dropped++;
+        }
+        
+        if (full())
+        {
+            m_dropped++;
+            return;
+        }
+        
+        buffered_message message { std::vector<unsigned char>(size), opcode };
+        unsigned char *ptr = message.m_data.data();
+        
+        for (size_t i = 0; i < count; i++)
+        {
+            if (buffers[i].m_size)
+                std::memcpy(ptr, buffers[i].m_data, buffers[i].m_size);
+            ptr += buffers[i].m_size;
+        }
+        
+        m_buffer.push_back(std::move(message));
+        m_buffered_bytes += size;
+    }
+    
+    // Called when the backend connection becomes ready
+    
+    void connected(ws_handler_funcs::ready_handler ready_handler)
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        
+        if (!m_client)
+            return;
+        
+        m_connected = true;
+        m_connections++;
+        
+        {
+            std::lock_guard<std::mutex> state_lock(m_state_mutex);
+            m_attempts = 0;
+        }
+        
+        if (ready_handler)
+            ready_handler(id(), m_owner);
+        
+        for (auto it = m_buffer.begin(); it != m_buffer.end(); ++it)
+            m_client->send(it->m_data.data(), it->m_data.size(), it->m_opcode);
+        
+        m_buffer.clear();
+        m_buffered_bytes = 0;
+    }
+    
+    // Called when the backend connection closes or fails (returns true if it was ready)
+    
+    bool lost(int)
+    {
+        bool was_connected;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            was_connected = m_connected;
+            m_connected = false;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(m_state_mutex);
+            m_lost = true;
+        }
+        
+        m_condition.notify_all();
+        
+        return was_connected;
+    }
+    
+    // Connection thread
+    
+    template <const ws_client_handlers& handlers>
+    void run()
+    {
+        std::unique_lock<std::mutex> state_lock(m_state_mutex);
+        
+        while (!m_stop)
+        {
+            // Connect (holding m_mutex so that the new client's handlers wait until it is stored)
+            
+            m_attempts++;
+            state_lock.unlock();
+            
+            {
+                ws_client_owner<relay<handlers>::relayed> owner { this };
+                
+                std::lock_guard<std::recursive_mutex> lock(m_mutex);
+                m_client = C::template create_async<relay<handlers>::relayed>(m_host.c_str(),
+                                                                             m_port,
+                                                                             m_path.c_str(),
+                                                                             owner,
+                                                                             m_client_options);
+            }
+            
+            // Wait for the connection to be lost and then destroy it (after which none of its handlers can run)
+            
+            state_lock.lock();
+            m_condition.wait(state_lock, [&]() { return m_lost || m_stop; });
+            state_lock.unlock();
+            
+            C *client;
+            
+            {
+                std::lock_guard<std::recursive_mutex> lock(m_mutex);
+                client = m_client;
+                m_client = nullptr;
+            }
+            
+            // Destroying the client reports the close of a connection that is still ready
+            
+            delete client;
+            
+            if (lost(0))
+                handlers.m_close(id(), m_owner);
+            
+            // Wait before trying again (the attempt count is reset once a connection becomes ready)
+            
+            state_lock.lock();
+            m_lost = false;
+            
+            if (m_stop)
+                break;
+            
+            if (m_options.m_max_attempts && m_attempts >= m_options.m_max_attempts)
+            {
+                m_given_up = true;
+                break;
+            }
+            
+            m_condition.wait_for(state_lock, m_backoff.delay(m_attempts), [&]() { return m_stop; });
+        }
+    }
+    
+    // Constructor
+    
+    template <const ws_client_handlers& handlers>
+    ws_reconnecting_client(const char *host,
+                           uint16_t port,
+                           const char *path,
+                           ws_client_owner<handlers> owner,
+                           const ws_reconnect_options& reconnect,
+                           const ws_client_options& options)
+    : m_owner(owner.m_owner)
+    , m_host(host)
+    , m_port(port)
+    , m_path(path)
+    , m_options(reconnect)
+    , m_client_options(options)
+    , m_backoff(reconnect)
+    {
+        m_thread = std::thread(&ws_reconnecting_client::run<handlers>, this);
+    }
+    
+    void *m_owner;
+    
+    const std::string m_host;
+    const uint16_t m_port;
+    const std::string m_path;
+    const ws_reconnect_options m_options;
+    const ws_client_options m_client_options;
+    
+    // Sending state (recursive so that the ready handler can send)
+    
+    std::recursive_mutex m_mutex;
+    C *m_client = nullptr;
+    bool m_connected = false;
+    std::deque<buffered_message> m_buffer;
+    size_t m_buffered_bytes = 0;
+    uint64_t m_dropped = 0;
+    uint64_t m_connections = 0;
+    
+    // Connection thread state
+    
+    std::mutex m_state_mutex;
+    std::condition_variable m_condition;
+    bool m_lost = false;
+    bool m_stop = false;
+    bool m_given_up = false;
+    unsigned int m_attempts = 0;                        // Attempts since a connection was last ready
+    ws_backoff m_backoff;
+    
+    std::thread m_thread;
+};
+
+#endif /* WS_RECONNECTING_CLIENT_HPP */
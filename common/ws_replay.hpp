@@ -0,0 +1,193 @@
+
+#ifndef WS_REPLAY_HPP
+#define WS_REPLAY_HPP
+
+#include "ws_base.hpp"
+#include "ws_capture.hpp"
+#include "ws_handlers.hpp"
+#include "ws_options.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <thread>
+
+// Replay settings
+
+struct ws_replay_options
+{
+    // The pace relative to the capture (1 keeps the original timing, 2 is twice as fast - zero is as fast as possible)
+    
+    double m_speed = 1.0;
+    
+    ws_client_options m_client;
+};
+
+// The outcome of a replay
+
+struct ws_replay_result
+{
+    size_t m_connections = 0;                       // Clients that connected
+    size_t m_failed = 0;                            // Clients that could not connect (their frames are skipped)
+    size_t m_frames = 0;                            // Frames sent
+    size_t m_bytes = 0;
+    std::chrono::microseconds m_elapsed { 0 };
+    std::chrono::microseconds m_max_lag { 0 };      // The furthest sends fell behind the captured timing
+};
+
+// Replays the frames a server received, from a capture log, to a server through any backend client type
+//
+// Each captured connection is replayed by a client of its own, which connects when the connection opened and is
+// destroyed when it closed or sent a close frame. Data frames are sent in the order captured, as whole messages or as
+// fragments just as they arrived. Pings and pongs are left to the clients and the server, and replies are discarded.
+// Replaying runs on the calling thread, which sleeps until each frame falls due, so time spent connecting or sending
+// shows up as lag rather than compressing the schedule.
+
+template <class C>
+class ws_replay
+{
+    // Replayed connections (one per captured connection ID)
+    
+    struct session
+    {
+        C *m_client = nullptr;
+        bool m_fragmenting = false;
+    };
+    
+    using clock = std::chrono::steady_clock;
+    
+public:
+    
+    static ws_replay_result run(const ws_capture_reader& log,
+                                const char *host,
+                                uint16_t port,
+                                const char *path,
+                                const ws_replay_options& options = ws_replay_options())
+    {
+        std::map<ws_connection_id, session> sessions;
+        ws_replay_result result;
+        auto start = clock::now();
+        uint64_t first = 0;
+        bool started = false;
+        
+        log.for_each([&](const ws_capture_record& record)
+        {
+            if (record.m_event == ws_capture_event::sent)
+                return;
+            
+            // Wait until the record falls due (measured from the first one replayed)
+            
+            if (!started)
+            {
+                first = record.m_time_ns;
+                started = true;
+            }
+            
+            if (options.m_speed > 0.0)
+            {
+                double offset = static_cast<double>(record.m_time_ns - std::min(first, record.m_time_ns));
+                auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(offset / options.m_speed));
+                auto now = clock::now();
+                
+                if (now < due)
+                    std::this_thread::sleep_until(due);
+                else
+                    result.m_max_lag = std::max(result.m_max_lag, elapsed(due, now));
+            }
+            
+            auto it = sessions.find(record.m_id);
+            
+            if (record.m_event == ws_capture_event::closed)
+            {
+                if (it != sessions.end())
+                {
+                    delete it->second.m_client;
+                    sessions.erase(it);
+                }
+                
+                return;
+            }
+            
+            // Connect for a new connection (or one whose opening was not captured)
+            
+            if (it == sessions.end())
+            {
+                session& s = sessions[record.m_id];
+                ws_client_owner<handlers> owner { nullptr };
+                
+                s.m_client = C::template create<handlers>(host, port, path, owner, options.m_client);
+                
+                if (s.m_client)
+                    result.m_connections++;
+                else
+                    result.m_failed++;
+                
+                it = sessions.find(record.m_id);
+            }
+            
+            if (record.m_event == ws_capture_event::received && it->second.m_client)
+                send(it->second, record, result);
+        });
+        
+        for (auto& s : sessions)
+            delete s.second.m_client;
+        
+        result.m_elapsed = elapsed(start, clock::now());
+        
+        return result;
+    }
+    
+private:
+    
+    static std::chrono::microseconds elapsed(clock::time_point from, clock::time_point to)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(to - from);
+    }
+    
+    // Send a received frame as it arrived
+    
+    static void send(session& s, const ws_capture_record& record, ws_replay_result& result)
+    {
+        ws_opcode opcode = record.opcode();
+        
+        if (opcode == ws_opcode::ping || opcode == ws_opcode::pong)
+            return;
+        
+        // A close frame ends the session (destroying the client sends its own)
+        
+        if (opcode == ws_opcode::close)
+        {
+            delete s.m_client;
+            s.m_client = nullptr;
+            return;
+        }
+        
+        // Skip continuations of a message whose start was not captured
+        
+        if (!s.m_fragmenting && opcode == ws_opcode::continuation)
+            return;
+        
+        if (!s.m_fragmenting && record.final())
+            s.m_client->send(record.m_data, record.m_size, opcode);
+        else
+        {
+            opcode = s.m_fragmenting ? ws_opcode::continuation : opcode;
+            s.m_client->send_fragment(record.m_data, record.m_size, opcode, record.final());
+            s.m_fragmenting = !record.final();
+        }
+        
+        result.m_frames++;
+        result.m_bytes += record.m_size;
+    }
+    
+    // Handlers (replies are discarded)
+    
+    static void receive(ws_connection_id, ws_opcode, const void *, size_t, void *) {}
+    static void close(ws_connection_id, void *) {}
+    
+    static constexpr ws_client_handlers handlers { receive, close };
+};
+
+#endif /* WS_REPLAY_HPP */
@@ -0,0 +1,302 @@
+
+#ifndef WS_SEND_QUEUE_HPP
+#define WS_SEND_QUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// What to do with new messages when a connection goes over its high watermark
+
+enum class ws_backpressure_policy
+{
+    drop,           // Discard the new message
+    coalesce,       // Discard whole data messages not yet being written and queue the new message
+    disconnect      // Discard the queue and close the connection
+};
+
+// Queue configuration (sizes in bytes, counting both queued messages and those being written)
+
+struct ws_send_queue_options
+{
+    size_t m_high_watermark = 1024 * 1024;
+    size_t m_low_watermark = 256 * 1024;
+    ws_backpressure_policy m_policy = ws_backpressure_policy::drop;
+};
+
+// The outcome of a send
+
+enum class ws_send_result
+{
+    queued,
+    dropped,
+    coalesced,
+    disconnecting,
+    not_connected
+};
+
+// Queue depth numbers
+
+struct ws_queue_depth
+{
+    size_t m_messages = 0;
+    size_t m_bytes = 0;
+};
+
+// A bounded per-connection outbound queue with high/low watermark hysteresis
+//
+// A connection becomes congested when its depth would exceed the high watermark and stays so until it drains to the low
+// watermark. A message larger than the high watermark is still queued when nothing else is queued or being written,
+// as nothing would complete to clear the congestion. Only one drainer runs at a time: push() reports when a drainer
+// should be scheduled and pop() reports when it should stop. All methods are thread-safe.
+
+template <class T>
+class ws_send_queue
+{
+public:
+    
+    struct push_result
+    {
+        ws_send_result m_result;
+        bool m_schedule;            // The caller should schedule a drainer
+        bool m_congested;           // The connection has just become congested
+    };
+    
+    ws_send_queue(const ws_send_queue_options& options) : m_options(options) {}
+    
+    // Push a message
+    
+    push_result push(T item, size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        push_result result { ws_send_result::queued, false, false };
+        
+        if (m_closed)
+        {
+            result.m_result = ws_send_result::not_connected;
+            return result;
+        }
+        
+        // An empty queue takes any message (congestion is only cleared as queued messages complete)
+        
+        size_t depth = m_queued_bytes + m_in_flight_bytes;
+        
+        if (!m_congested && depth && depth + bytes > m_options.m_high_watermark)
+        {
+            m_congested = true;
+            result.m_congested = true;
+        }
+        
+        if (m_congested)
+        {
+            switch (m_options.m_policy)
+            {
+                case ws_backpressure_policy::drop:
+                    result.m_result = ws_send_result::dropped;
+                    return result;
+                
+                case ws_backpressure_policy::coalesce:
+                    coalesce();
+                    result.m_result = ws_send_result::coalesced;
+                    break;
+                
+                case ws_backpressure_policy::disconnect:
+                    result.m_result = ws_send_result::disconnecting;
+                    return result;
+            }
+        }
+        
+        m_items.emplace_back(std::move(item), bytes);
+        m_queued_bytes += bytes;
+        
+        if (!m_scheduled)
+        {
+            m_scheduled = true;
+            result.m_schedule = true;
+        }
+        
+        return result;
+    }
+    
+    // Replace anything queued with a final message and refuse further pushes (returns true to schedule a drainer)
+    
+    bool close(T item, size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (m_closed)
+            return false;
+        
+        m_closed = true;
+        m_items.clear();
+        m_items.emplace_back(std::move(item), bytes);
+        m_queued_bytes = bytes;
+        
+        bool schedule = !m_scheduled;
+        m_scheduled = true;
+        
+        return schedule;
+    }
+    
+    // Discard everything and refuse further pushes
+    
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        m_closed = true;
+        m_items.clear();
+        m_queued_bytes = 0;
+    }
+    
+    // Pop the next message to write (returns false and unschedules the drainer when empty)
+    
+    bool pop(T& item, size_t& bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (m_items.empty())
+        {
+            m_scheduled = false;
+            return false;
+        }
+        
+        pop_front(item, bytes);
+        
+        return true;
+    }
+    
+    // Pop a run of messages whose sizes total no more than a limit (or one larger message), passing each to a
+    // non-blocking function under the lock, and return the number popped (unscheduling the drainer if none)
+    
+    template <typename F>
+    size_t pop_batch(F&& func, size_t max_bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        T item;
+        size_t bytes;
+        size_t count = 0;
+        size_t total = 0;
+        
+        while (!m_items.empty() && (!count || total + m_items.front().second <= max_bytes))
+        {
+            pop_front(item, bytes);
+            func(item, bytes);
+            total += bytes;
+            count++;
+        }
+        
+        if (!count)
+            m_scheduled = false;
+        
+        return count;
+    }
+    
+    // Pop and pass messages to a non-blocking function under the lock (preserving order) until the window is full
+    
+    template <typename F>
+    void drain(F func, size_t window)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        T item;
+        size_t bytes;
+        
+        while (!m_items.empty() && m_in_flight_bytes < window)
+        {
+            pop_front(item, bytes);
+            func(item, bytes);
+        }
+        
+        m_scheduled = false;
+    }
+    
+    // Mark popped messages as written (returns true if the connection is no longer congested)
+    
+    bool complete(size_t bytes, size_t messages = 1)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        m_in_flight_bytes -= bytes;
+        m_in_flight_messages -= messages;
+        
+        if (m_congested && m_queued_bytes + m_in_flight_bytes <= m_options.m_low_watermark)
+        {
+            m_congested = false;
+            return true;
+        }
+        
+        return false;
+    }
+    
+    // Depth
+    
+    ws_queue_depth depth() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        ws_queue_depth depth;
+        
+        depth.m_messages = m_items.size() + m_in_flight_messages;
+        depth.m_bytes = m_queued_bytes + m_in_flight_bytes;
+        
+        return depth;
+    }
+    
+    const ws_send_queue_options& options() const { return m_options; }
+    
+private:
+    
+    // Discard queued messages that the item type reports as coalescable (whole data messages), keeping control frames
+    // and fragments, so that a fragmented message already started is never broken up
+    
+    void coalesce()
+    {
+        size_t kept = 0;
+        
+        m_queued_bytes = 0;
+        
+        for (size_t i = 0; i < m_items.size(); i++)
+        {
+            if (m_items[i].first.coalescable())
+                continue;
+            
+            m_queued_bytes += m_items[i].second;
+            
+            if (kept != i)
+                m_items[kept] = std::move(m_items[i]);
+            
+            kept++;
+        }
+        
+        m_items.erase(m_items.begin() + kept, m_items.end());
+    }
+    
+    void pop_front(T& item, size_t& bytes)
+    {
+        item = std::move(m_items.front().first);
+        bytes = m_items.front().second;
+        m_items.pop_front();
+        
+        m_queued_bytes -= bytes;
+        m_in_flight_bytes += bytes;
+        m_in_flight_messages++;
+    }
+    
+    const ws_send_queue_options m_options;
+    
+    std::deque<std::pair<T, size_t>> m_items;
+    size_t m_queued_bytes = 0;
+    size_t m_in_flight_bytes = 0;
+    size_t m_in_flight_messages = 0;
+    bool m_congested = false;
+    bool m_scheduled = false;
+    bool m_closed = false;
+    
+    mutable std::mutex m_mutex;
+};
+
+#endif /* WS_SEND_QUEUE_HPP */
@@ -3,86 +3,231 @@
 #define WS_SERVER_BASE_HPP
 
 #include "ws_base.hpp"
+#include "ws_capture.hpp"
+#include "ws_handlers.hpp"
+#include "ws_connection_registry.hpp"
+#include "ws_groups.hpp"
+#include "ws_heartbeat.hpp"
+#include "ws_options.hpp"
+#include "ws_send_queue.hpp"
+#include "ws_stats.hpp"
+#include "ws_typed_handlers.hpp"
 
 #include <algorithm>
-#include <map>
-#include <type_traits>
+#include <cstring>
+#include <vector>
 
 // A base class for all websocket servers
 
 template <class T, class server_type, class connection_type>
 class ws_server_base : public ws_base<T, server_type>
 {
-    using const_connection_type = const typename std::remove_pointer<connection_type>::type *const;
-    
 public:
     
     // Create
     
     template <const ws_server_handlers& handlers>
-    static T *create(const char *port, const char *path, ws_server_owner<handlers> owner)
+    static T *create(const char *port,
+                     const char *path,
+                     ws_server_owner<handlers> owner,
+                     const ws_server_options& options = ws_server_options())
     {
-        return ws_base<T, server_type>::create(port, path, owner);
+        return ws_base<T, server_type>::create(port, path, owner, options);
+    }
+    
+    // Create with handlers that are members of the owner's type (see ws_typed_handlers)
+    
+    template <class O>
+    static T *create(const char *port,
+                     const char *path,
+                     O *owner,
+                     const ws_server_options& options = ws_server_options())
+    {
+        constexpr auto& handlers = ws_typed_handlers<O>::server;
+        
+        return create<handlers>(port, path, ws_server_owner<handlers> { owner }, options);
     }
     
     // The number of connected clients
     
     size_t size() const
     {
-        return m_map_from_connection.size();
+        return m_connections.size();
+    }
+    
+    // The outbound queue depth for a connection
+    
+    ws_queue_depth queue_depth(ws_connection_id id) const
+    {
+        ws_queue_depth depth;
+        
+        m_connections.visit(id, [&](connection_type connection)
+        {
+            depth = connection->m_queue.depth();
+        });
+        
+        return depth;
+    }
+    
+    // Statistics (all zero unless built with WS_STATS)
+    
+    ws_stats_snapshot stats() const
+    {
+        return m_stats.snapshot();
+    }
+    
+    ws_counter_snapshot connection_stats(ws_connection_id id) const
+    {
+        ws_counter_snapshot counters;
+        
+        m_connections.visit(id, [&](connection_type connection)
+        {
+            counters = connection->m_stats.snapshot();
+        });
+        
+        return counters;
+    }
+    
+    // The last heartbeat round trip time for a connection in microseconds (zero if none has been measured)
+    
+    uint64_t rtt(ws_connection_id id) const
+    {
+        uint64_t rtt = 0;
+        
+        m_connections.visit(id, [&](connection_type connection)
+        {
+            rtt = connection->m_heartbeat.rtt();
+        });
+        
+        return rtt;
+    }
+    
+    // Per-connection user data (passed to the connection's handlers in place of the owner, except for m_connect)
+    // Set it from m_connect so that every later handler is passed it (returns false if the ID is not current)
+    
+    bool set_user_data(ws_connection_id id, void *data)
+    {
+        return m_connections.visit(id, [&](connection_type connection)
+        {
+            connection->set_user_data(data);
+        });
+    }
+    
+    template <class U = void>
+    U *user_data(ws_connection_id id) const
+    {
+        void *data = nullptr;
+        
+        m_connections.visit(id, [&](connection_type connection)
+        {
+            data = connection->user_data();
+        });
+        
+        return static_cast<U *>(data);
     }
     
-    // The current port
+    // Batching mode for a connection (see ws_batching_options - returns false if the ID is not current)
+    
+    bool set_batching(ws_connection_id id, bool enable)
+    {
+        return m_connections.visit(id, [&](connection_type connection)
+        {
+            connection->m_batching.store(enable, std::memory_order_relaxed);
+        });
+    }
+    
+    // Group membership (a connection leaves all its groups when it closes)
+    // Subscribing returns false if the connection is not connected or is already a member
+    // Backpressure handlers run during sends to groups and so must not change membership
+    
+    bool subscribe(ws_connection_id id, ws_group_id group)
+    {
+        return m_groups.add(id, group, [&](ws_connection_id member) { return m_connections.find(member); });
+    }
+    
+    bool unsubscribe(ws_connection_id id, ws_group_id group)
+    {
+        return m_groups.remove(id, group);
+    }
+    
+    void unsubscribe(ws_connection_id id)
+    {
+        m_groups.remove(id);
+    }
+    
+    size_t group_size(ws_group_id group) const
+    {
+        return m_groups.size(group);
+    }
+    
+    // The current port (the first if there are several)
     
     uint16_t port() const
     {
         return m_port;
     }
     
+    // All bound ports
+    
+    const std::vector<uint16_t>& ports() const
+    {
+        return m_ports;
+    }
+    
 protected:
     
-    // Find connection pointers from ids
+    // Find connection pointers from ids (only safe from within the connection's own callbacks)
     
     connection_type find(ws_connection_id id)
     {
-        auto it = m_map_from_id.find(id);
-        return (it == m_map_from_id.end()) ? nullptr : it->second;
+        return m_connections.find(id);
     }
     
-    // Find ids from connection pointers
+    // Call a function on a connection by id whilst it is guaranteed to remain valid
     
-    ws_connection_id find(const_connection_type connection)
+    template <typename F>
+    bool visit_connection(ws_connection_id id, F func)
     {
-        auto it = m_map_from_connection.find(connection);
-        return (it == m_map_from_connection.end()) ? -1 : it->second;
+        return m_connections.visit(id, func);
     }
     
-    // Add a new connection to the maps
+    // Add a new connection to the registry (storing its ID and attaching its stats before it is visible)
     
     ws_connection_id add_connection(connection_type connection)
     {
-        ws_connection_id id = new_id();
+        connection->m_stats.attach(&m_stats);
+        connection->m_capture = m_capture;
         
-        m_map_from_connection[connection] = id;
-        m_map_from_id[id] = connection;
+        if (m_heartbeat.enabled())
+            connection->m_heartbeat.attach(&m_heartbeat.clock());
         
-        assert(m_map_from_connection.size() == m_map_from_id.size());
+        auto id = m_connections.add(connection, [&](ws_connection_id id) { connection->m_id = id; });
+        
+        if (id && m_capture)
+            m_capture->append(ws_capture_event::opened, id);
+        
+        if (id && m_heartbeat.enabled())
+            m_heartbeat.schedule(id, m_heartbeat.now() + m_heartbeat.interval());
         
         return id;
     }
     
-    // Remove an expired connection from the maps
+    // Remove an expired connection from the registry and its groups (waits for any concurrent sends to the connection)
+    //
+    // Removal from the registry comes first, so that subscribing can no longer find the connection once it has left
+    // its groups.
     
-    ws_connection_id remove_connection(const_connection_type connection)
+    connection_type remove_connection(ws_connection_id id)
     {
-        ws_connection_id id = m_map_from_connection[connection];
+        connection_type connection = m_connections.remove(id);
         
-        m_map_from_connection.erase(connection);
-        m_map_from_id.erase(id);
+        if (connection)
+            m_groups.remove(id);
         
-        assert(m_map_from_connection.size() == m_map_from_id.size());
+        if (connection && m_capture)
+            m_capture->append(ws_capture_event::closed, id);
         
-        return id;
+        return connection;
     }
     
     // Call a function on each connection
@@ -90,24 +235,150 @@ protected:
     template <typename F>
     void for_each_connection(F func)
     {
-        for (auto it = m_map_from_id.begin(); it != m_map_from_id.end(); it++)
-            func(it->second);
+        m_connections.for_each(func);
     }
     
-    // Generate a new ID
+    // Call a function on each member of a group
     
-    ws_connection_id new_id()
+    template <typename F>
+    void for_each_in_group(ws_group_id group, F func)
     {
-        ws_connection_id id = 0;
+        m_groups.for_each(group, func);
+    }
+    
+    // Group a batch by connection (preserving order within each connection) and call a function for each group
+    
+    template <typename F>
+    static void group_batch(const ws_batch_message *messages, size_t count, F func)
+    {
+        std::vector<size_t> order(count);
+        std::vector<ws_buffer_list> group;
         
-        while (find(++id)) {}
+        for (size_t i = 0; i < count; i++)
+            order[i] = i;
         
-        return id;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+        {
+            return messages[a].m_id < messages[b].m_id;
+        });
+        
+        for (size_t i = 0; i < count; )
+        {
+            ws_connection_id id = messages[order[i]].m_id;
+            
+            group.clear();
+            
+            for ( ; i < count && messages[order[i]].m_id == id; i++)
+                group.push_back(messages[order[i]].m_message);
+            
+            func(id, group.data(), group.size());
+        }
+    }
+    
+    // Heartbeats
+    //
+    // Backends start them before accepting connections and stop them before anything else when shutting down. They
+    // provide ping<handlers>(connection, stamp), which sends a ping that carries or is matched to the stamp, and
+    // close_idle(connection), which starts closing the connection.
+    
+    template <const ws_server_handlers& handlers>
+    void start_heartbeat(const ws_heartbeat_options& options)
+    {
+        m_heartbeat.start(options, [this](ws_connection_id id, uint64_t tick)
+        {
+            return check_heartbeat<handlers>(id, tick);
+        });
+    }
+    
+    void stop_heartbeat()
+    {
+        m_heartbeat.stop();
+    }
+    
+    // Capture (backends set the log from their options before accepting connections and capture what they send)
+    
+    void start_capture(ws_capture_log *log)
+    {
+        m_capture = log && log->is_open() ? log : nullptr;
+    }
+    
+    // Note a received frame given its FIN bit and opcode (returns true if it was a pong answering a heartbeat ping,
+    // which is then consumed)
+    
+    template <const ws_server_handlers& handlers>
+    static bool received(connection_type connection, int bits, const void *data, size_t size)
+    {
+        uint64_t stamp;
+        
+        connection->m_heartbeat.heard();
+        connection->capture(ws_capture_event::received, bits, data, size);
+        
+        if (static_cast<ws_opcode>(bits & 0x0F) != ws_opcode::pong || size != sizeof(stamp))
+            return false;
+        
+        std::memcpy(&stamp, data, sizeof(stamp));
+        
+        return answered<handlers>(connection, stamp);
+    }
+    
+    // Match a pong to a heartbeat ping by its stamp and report the round trip time (returns false if it does not match)
+    
+    template <const ws_server_handlers& handlers>
+    static bool answered(connection_type connection, uint64_t stamp)
+    {
+        uint64_t rtt = connection->m_heartbeat.answered(stamp);
+        
+        if (rtt && handlers.m_rtt)
+            handlers.m_rtt(connection->m_id, rtt, connection->user_data());
+        
+        return rtt;
+    }
+    
+    // Check a connection whose heartbeat timer has fallen due (returns the tick to check again at, or zero)
+    
+    template <const ws_server_handlers& handlers>
+    uint64_t check_heartbeat(ws_connection_id id, uint64_t tick)
+    {
+        uint64_t again = 0;
+        
+        m_connections.visit(id, [&](connection_type connection)
+        {
+            uint64_t heard = connection->m_heartbeat.last_heard();
+            uint64_t quiet = tick > heard ? tick - heard : 0;
+            
+            if (quiet >= m_heartbeat.timeout())
+            {
+                if (handlers.m_idle)
+                    handlers.m_idle(id, connection->user_data());
+                
+                static_cast<T *>(this)->close_idle(connection);
+            }
+            else if (quiet >= m_heartbeat.interval())
+            {
+                static_cast<T *>(this)->template ping<handlers>(connection, connection->m_heartbeat.ping());
+                again = std::min(tick + m_heartbeat.interval(), heard + m_heartbeat.timeout());
+            }
+            else
+                again = heard + m_heartbeat.interval();
+        });
+        
+        return again;
+    }
+    
+    // Whether a send result means the message will be sent
+    
+    static bool accepted(ws_send_result result)
+    {
+        return result == ws_send_result::queued || result == ws_send_result::coalesced;
     }
     
-    std::map<const_connection_type, ws_connection_id> m_map_from_connection;
-    std::map<ws_connection_id, connection_type> m_map_from_id;
+    ws_connection_registry<connection_type> m_connections;
+    ws_groups<connection_type> m_groups;
+    ws_heartbeat m_heartbeat;
+    ws_capture_log *m_capture = nullptr;
+    ws_stats m_stats;
     uint16_t m_port = 0;
+    std::vector<uint16_t> m_ports;
 };
 
 #endif /* WS_SERVER_BASE_HPP */
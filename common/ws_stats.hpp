@@ -0,0 +1,287 @@
+
+#ifndef WS_STATS_HPP
+#define WS_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Message, byte and latency statistics for servers, connections and clients
+//
+// Statistics are only collected when building with WS_STATS defined. Otherwise every type here is empty, recording
+// compiles to nothing and snapshots read as zero. Counters use relaxed atomics, so a snapshot is not an exact point in
+// time but each counter is individually correct.
+
+// A latency histogram snapshot (bucket i counts latencies below 2^i microseconds, the last bucket everything else)
+
+struct ws_histogram_snapshot
+{
+    static constexpr size_t buckets = 32;
+    
+    uint64_t m_counts[buckets] = {};
+    
+    uint64_t count() const
+    {
+        uint64_t count = 0;
+        
+        for (size_t i = 0; i < buckets; i++)
+            count += m_counts[i];
+        
+        return count;
+    }
+    
+    // An upper bound in microseconds on the given percentile (0-100)
+    
+    uint64_t percentile(double p) const
+    {
+        uint64_t total = count();
+        uint64_t sum = 0;
+        
+        if (!total)
+            return 0;
+        
+        for (size_t i = 0; i < buckets; i++)
+        {
+            sum += m_counts[i];
+            
+            if (sum * 100.0 >= p * total)
+                return uint64_t(1) << i;
+        }
+        
+        return uint64_t(1) << (buckets - 1);
+    }
+};
+
+// Counter snapshots (per connection, or aggregated with connection events)
+
+struct ws_counter_snapshot
+{
+    uint64_t m_messages_in = 0;
+    uint64_t m_bytes_in = 0;
+    uint64_t m_messages_out = 0;
+    uint64_t m_bytes_out = 0;
+    uint64_t m_send_failures = 0;
+};
+
+struct ws_stats_snapshot : ws_counter_snapshot
+{
+    uint64_t m_connects = 0;
+    uint64_t m_closes = 0;
+    
+    ws_histogram_snapshot m_handshake;          // From accepting (or starting) a connection to it being ready
+    ws_histogram_snapshot m_receive;            // From the backend passing on data to the receive handler returning
+};
+
+#ifdef WS_STATS
+
+// Latency histogram
+
+class ws_histogram
+{
+public:
+    
+    void record(std::chrono::steady_clock::duration duration)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        size_t bucket = 0;
+        
+        while (bucket + 1 < ws_histogram_snapshot::buckets && (uint64_t(1) << bucket) <= uint64_t(us))
+            bucket++;
+        
+        m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void snapshot(ws_histogram_snapshot& snapshot) const
+    {
+        for (size_t i = 0; i < ws_histogram_snapshot::buckets; i++)
+            snapshot.m_counts[i] = m_counts[i].load(std::memory_order_relaxed);
+    }
+    
+private:
+    
+    std::atomic<uint64_t> m_counts[ws_histogram_snapshot::buckets] = {};
+};
+
+// Message counters
+
+class ws_counters
+{
+public:
+    
+    void received(size_t bytes, size_t messages = 1)
+    {
+        add(m_messages_in, messages);
+        add(m_bytes_in, bytes);
+    }
+    
+    void sent(size_t bytes, size_t messages = 1)
+    {
+        add(m_messages_out, messages);
+        add(m_bytes_out, bytes);
+    }
+    
+    void failed()
+    {
+        add(m_send_failures, 1);
+    }
+    
+    void snapshot(ws_counter_snapshot& snapshot) const
+    {
+        snapshot.m_messages_in = m_messages_in.load(std::memory_order_relaxed);
+        snapshot.m_bytes_in = m_bytes_in.load(std::memory_order_relaxed);
+        snapshot.m_messages_out = m_messages_out.load(std::memory_order_relaxed);
+        snapshot.m_bytes_out = m_bytes_out.load(std::memory_order_relaxed);
+        snapshot.m_send_failures = m_send_failures.load(std::memory_order_relaxed);
+    }
+    
+    ws_counter_snapshot snapshot() const
+    {
+        ws_counter_snapshot counters;
+        snapshot(counters);
+        return counters;
+    }
+    
+private:
+    
+    static void add(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+    
+    std::atomic<uint64_t> m_messages_in { 0 };
+    std::atomic<uint64_t> m_bytes_in { 0 };
+    std::atomic<uint64_t> m_messages_out { 0 };
+    std::atomic<uint64_t> m_bytes_out { 0 };
+    std::atomic<uint64_t> m_send_failures { 0 };
+};
+
+// Aggregate statistics
+
+class ws_stats : public ws_counters
+{
+public:
+    
+    using timestamp = std::chrono::steady_clock::time_point;
+    
+    static timestamp now() { return std::chrono::steady_clock::now(); }
+    
+    void connected(timestamp start)
+    {
+        m_connects.fetch_add(1, std::memory_order_relaxed);
+        m_handshake.record(now() - start);
+    }
+    
+    void closed()
+    {
+        m_closes.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void handled(timestamp start)
+    {
+        m_receive.record(now() - start);
+    }
+    
+    ws_stats_snapshot snapshot() const
+    {
+        ws_stats_snapshot stats;
+        
+        ws_counters::snapshot(stats);
+        stats.m_connects = m_connects.load(std::memory_order_relaxed);
+        stats.m_closes = m_closes.load(std::memory_order_relaxed);
+        m_handshake.snapshot(stats.m_handshake);
+        m_receive.snapshot(stats.m_receive);
+        
+        return stats;
+    }
+    
+private:
+    
+    std::atomic<uint64_t> m_connects { 0 };
+    std::atomic<uint64_t> m_closes { 0 };
+    ws_histogram m_handshake;
+    ws_histogram m_receive;
+};
+
+// Per-connection counters that also update the server's aggregate (attached before the connection is visible)
+
+class ws_connection_stats : public ws_counters
+{
+public:
+    
+    void attach(ws_stats *aggregate) { m_aggregate = aggregate; }
+    
+    void received(size_t bytes, size_t messages = 1)
+    {
+        ws_counters::received(bytes, messages);
+        m_aggregate->received(bytes, messages);
+    }
+    
+    void sent(size_t bytes, size_t messages = 1)
+    {
+        ws_counters::sent(bytes, messages);
+        m_aggregate->sent(bytes, messages);
+    }
+    
+    void failed()
+    {
+        ws_counters::failed();
+        m_aggregate->failed();
+    }
+    
+    // Connection events (handshake latency is measured from when the connection's state was created)
+    
+    void connected() { m_aggregate->connected(m_accepted); }
+    void closed() { m_aggregate->closed(); }
+    void handled(ws_stats::timestamp start) { m_aggregate->handled(start); }
+    
+private:
+    
+    ws_stats *m_aggregate = nullptr;
+    ws_stats::timestamp m_accepted = ws_stats::now();
+};
+
+#else
+
+// Stand-ins when statistics are off
+
+class ws_counters
+{
+public:
+    
+    void received(size_t, size_t = 1) {}
+    void sent(size_t, size_t = 1) {}
+    void failed() {}
+    
+    ws_counter_snapshot snapshot() const { return ws_counter_snapshot(); }
+};
+
+class ws_stats : public ws_counters
+{
+public:
+    
+    struct timestamp {};
+    
+    static timestamp now() { return timestamp(); }
+    
+    void connected(timestamp) {}
+    void closed() {}
+    void handled(timestamp) {}
+    
+    ws_stats_snapshot snapshot() const { return ws_stats_snapshot(); }
+};
+
+class ws_connection_stats : public ws_counters
+{
+public:
+    
+    void attach(ws_stats *) {}
+    
+    void connected() {}
+    void closed() {}
+    void handled(ws_stats::timestamp) {}
+};
+
+#endif
+
+#endif /* WS_STATS_HPP */
@@ -0,0 +1,118 @@
+
+#ifndef WS_TIMER_WHEEL_HPP
+#define WS_TIMER_WHEEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A hierarchical timer wheel (after Varghese and Lauck) holding values that fall due at a tick
+//
+// Each level has 64 slots, each covering 64 times as many ticks as a slot in the level below, so scheduling takes
+// constant time and each tick touches one slot plus, every 64 ticks, a slot cascaded down from a higher level.
+// Values due further ahead than the wheel spans (2^24 ticks) fall due at its end instead. Not thread-safe.
+
+template <class T>
+class ws_timer_wheel
+{
+    static constexpr int level_bits = 6;
+    static constexpr int levels = 4;
+    static constexpr size_t slots = size_t(1) << level_bits;
+    static constexpr uint64_t span = uint64_t(1) << (level_bits * levels);
+    
+    struct entry
+    {
+        T m_value;
+        uint64_t m_due;
+    };
+    
+public:
+    
+    // Schedule a value for a tick (ticks already reached fall due on the next)
+    
+    void schedule(T value, uint64_t tick)
+    {
+        if (tick <= m_current)
+            tick = m_current + 1;
+        
+        if (tick - m_current >= span)
+            tick = m_current + span - 1;
+        
+        insert(entry { std::move(value), tick });
+        m_size++;
+    }
+    
+    // Advance to a tick, passing each value that falls due to a function (which may schedule more)
+    
+    template <typename F>
+    void advance(uint64_t tick, F func)
+    {
+        if (!m_size)
+            m_current = std::max(m_current, tick);
+        
+        while (m_current < tick)
+        {
+            m_current++;
+            
+            // Cascade slots from the higher levels whose boundaries have been reached (highest first)
+            
+            for (int level = levels - 1; level > 0; level--)
+            {
+                if (m_current & ((uint64_t(1) << (level_bits * level)) - 1))
+                    continue;
+                
+                auto& slot = m_wheels[level][(m_current >> (level_bits * level)) & (slots - 1)];
+                
+                m_cascading.swap(slot);
+                
+                for (auto& e : m_cascading)
+                    insert(std::move(e));
+                
+                m_cascading.clear();
+            }
+            
+            // Fire the values due now
+            
+            auto& slot = m_wheels[0][m_current & (slots - 1)];
+            
+            if (slot.empty())
+                continue;
+            
+            m_firing.swap(slot);
+            m_size -= m_firing.size();
+            
+            for (auto& e : m_firing)
+                func(e.m_value);
+            
+            m_firing.clear();
+        }
+    }
+    
+    uint64_t current() const { return m_current; }
+    size_t size() const { return m_size; }
+    
+private:
+    
+    // Place an entry in the lowest level whose range covers it
+    
+    void insert(entry e)
+    {
+        uint64_t delta = e.m_due - m_current;
+        int level = 0;
+        
+        while (level < levels - 1 && delta >= (uint64_t(1) << (level_bits * (level + 1))))
+            level++;
+        
+        m_wheels[level][(e.m_due >> (level_bits * level)) & (slots - 1)].push_back(std::move(e));
+    }
+    
+    std::vector<entry> m_wheels[levels][slots];
+    std::vector<entry> m_cascading;
+    std::vector<entry> m_firing;
+    uint64_t m_current = 0;
+    size_t m_size = 0;
+};
+
+#endif /* WS_TIMER_WHEEL_HPP */
@@ -0,0 +1,205 @@
+
+#ifndef WS_TYPED_HANDLERS_HPP
+#define WS_TYPED_HANDLERS_HPP
+
+#include "ws_base.hpp"
+#include "ws_handlers.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// Handler tables built at compile time from the members of an owner type
+//
+// The owner type provides any of the following (static or non-static) member functions. Optional handlers it lacks are
+// left out of the tables and required ones do nothing, so unused callbacks cost nothing:
+//
+// on_connect(id)                                       servers
+// on_ready(id)                                         servers and clients
+// on_receive(id, opcode, data, size)                   servers and clients
+// on_receive_regions(id, opcode, buffers, count)       servers and clients
+// on_receive_fragment(id, opcode, data, size, final)   servers and clients
+// on_backpressure(id, congested)                       servers
+// on_close(id)                                         servers and clients
+// on_error(id, error)                                  clients
+// on_idle(id)                                          servers
+// on_rtt(id, microseconds)                             servers
+//
+// The trampolines call the members directly and the tables are constant expressions, so the backends' calls through
+// them can be inlined. The pointer passed to handlers is treated as an O *, so any user data set on a server
+// connection must also point to an O.
+
+template <class O>
+class ws_typed_handlers
+{
+    // Detect the members present
+    
+    template <class U>
+    static auto test_connect(int) -> decltype(std::declval<U&>().on_connect(ws_connection_id()), std::true_type());
+    
+    template <class U>
+    static auto test_ready(int) -> decltype(std::declval<U&>().on_ready(ws_connection_id()), std::true_type());
+    
+    template <class U>
+    static auto test_receive(int) -> decltype(std::declval<U&>().on_receive(ws_connection_id(),
+                                                                            ws_opcode(),
+                                                                            std::declval<const void *>(),
+                                                                            size_t()), std::true_type());
+    
+    template <class U>
+    static auto test_regions(int) -> decltype(std::declval<U&>().on_receive_regions(ws_connection_id(),
+                                                                                    ws_opcode(),
+                                                                                    std::declval<const ws_buffer *>(),
+                                                                                    size_t()), std::true_type());
+    
+    template <class U>
+    static auto test_fragment(int) -> decltype(std::declval<U&>().on_receive_fragment(ws_connection_id(),
+                                                                                      ws_opcode(),
+                                                                                      std::declval<const void *>(),
+                                                                                      size_t(),
+                                                                                      bool()), std::true_type());
+    
+    template <class U>
+    static auto test_backpressure(int) -> decltype(std::declval<U&>().on_backpressure(ws_connection_id(), bool()),
+                                                   std::true_type());
+    
+    template <class U>
+    static auto test_close(int) -> decltype(std::declval<U&>().on_close(ws_connection_id()), std::true_type());
+    
+    template <class U>
+    static auto test_error(int) -> decltype(std::declval<U&>().on_error(ws_connection_id(), int()), std::true_type());
+    
+    template <class U>
+    static auto test_idle(int) -> decltype(std::declval<U&>().on_idle(ws_connection_id()), std::true_type());
+    
+    template <class U>
+    static auto test_rtt(int) -> decltype(std::declval<U&>().on_rtt(ws_connection_id(), uint64_t()), std::true_type());
+    
+    template <class U> static std::false_type test_connect(...);
+    template <class U> static std::false_type test_ready(...);
+    template <class U> static std::false_type test_receive(...);
+    template <class U> static std::false_type test_regions(...);
+    template <class U> static std::false_type test_fragment(...);
+    template <class U> static std::false_type test_backpressure(...);
+    template <class U> static std::false_type test_close(...);
+    template <class U> static std::false_type test_error(...);
+    template <class U> static std::false_type test_idle(...);
+    template <class U> static std::false_type test_rtt(...);
+    
+public:
+    
+    static constexpr bool has_connect = decltype(test_connect<O>(0))::value;
+    static constexpr bool has_ready = decltype(test_ready<O>(0))::value;
+    static constexpr bool has_receive = decltype(test_receive<O>(0))::value;
+    static constexpr bool has_receive_regions = decltype(test_regions<O>(0))::value;
+    static constexpr bool has_receive_fragment = decltype(test_fragment<O>(0))::value;
+    static constexpr bool has_backpressure = decltype(test_backpressure<O>(0))::value;
+    static constexpr bool has_close = decltype(test_close<O>(0))::value;
+    static constexpr bool has_error = decltype(test_error<O>(0))::value;
+    static constexpr bool has_idle = decltype(test_idle<O>(0))::value;
+    static constexpr bool has_rtt = decltype(test_rtt<O>(0))::value;
+    
+    static_assert(has_receive || has_receive_regions || has_receive_fragment,
+                  "an owner type needs on_receive, on_receive_regions or on_receive_fragment");
+    
+private:
+    
+    // Trampolines
+    
+    static O& get(void *x) { return *static_cast<O *>(x); }
+    
+    static void connect(ws_connection_id id, void *x)
+    {
+        if constexpr (has_connect)
+            get(x).on_connect(id);
+    }
+    
+    static void ready(ws_connection_id id, void *x)
+    {
+        if constexpr (has_ready)
+            get(x).on_ready(id);
+    }
+    
+    static void receive(ws_connection_id id, ws_opcode opcode, const void *data, size_t size, void *x)
+    {
+        if constexpr (has_receive)
+            get(x).on_receive(id, opcode, data, size);
+    }
+    
+    static void receive_regions(ws_connection_id id, ws_opcode opcode, const ws_buffer *buffers, size_t count, void *x)
+    {
+        if constexpr (has_receive_regions)
+            get(x).on_receive_regions(id, opcode, buffers, count);
+    }
+    
+    static void receive_fragment(ws_connection_id id,
+                                 ws_opcode opcode,
+                                 const void *data,
+                                 size_t size,
+                                 bool final,
+                                 void *x)
+    {
+        if constexpr (has_receive_fragment)
+            get(x).on_receive_fragment(id, opcode, data, size, final);
+    }
+    
+    static void backpressure(ws_connection_id id, bool congested, void *x)
+    {
+        if constexpr (has_backpressure)
+            get(x).on_backpressure(id, congested);
+    }
+    
+    static void close(ws_connection_id id, void *x)
+    {
+        if constexpr (has_close)
+            get(x).on_close(id);
+    }
+    
+    static void error(ws_connection_id id, int error, void *x)
+    {
+        if constexpr (has_error)
+            get(x).on_error(id, error);
+    }
+    
+    static void idle(ws_connection_id id, void *x)
+    {
+        if constexpr (has_idle)
+            get(x).on_idle(id);
+    }
+    
+    static void rtt(ws_connection_id id, uint64_t microseconds, void *x)
+    {
+        if constexpr (has_rtt)
+            get(x).on_rtt(id, microseconds);
+    }
+    
+public:
+    
+    // The tables
+    
+    static constexpr ws_server_handlers server
+    {
+        connect,
+        ready,
+        receive,
+        close,
+        has_backpressure ? &backpressure : nullptr,
+        has_receive_regions ? &receive_regions : nullptr,
+        has_receive_fragment ? &receive_fragment : nullptr,
+        has_idle ? &idle : nullptr,
+        has_rtt ? &rtt : nullptr
+    };
+    
+    static constexpr ws_client_handlers client
+    {
+        receive,
+        close,
+        has_receive_regions ? &receive_regions : nullptr,
+        has_receive_fragment ? &receive_fragment : nullptr,
+        has_ready ? &ready : nullptr,
+        has_error ? &error : nullptr
+    };
+};
+
+#endif /* WS_TYPED_HANDLERS_HPP */
@@ -0,0 +1,247 @@
+
+#ifndef LB_WS_CLIENT_HPP
+#define LB_WS_CLIENT_HPP
+
+#include "lb_ws_common.hpp"
+#include "../common/ws_handlers.hpp"
+#include "../common/ws_client_base.hpp"
+#include "../common/ws_frame.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+
+// In-process websocket client (connects to an lb_ws_server in the same process, ignoring the host)
+//
+// Messages are received on a thread per client, as with the CivetWeb client. Sends do not take a lock, so each
+// client must only be sent to from one thread at a time, and wait whilst the ring to the server is full.
+
+class lb_ws_client : public lb_ws_common, public ws_client_base<lb_ws_client, lb_ws_pipe *>
+{
+    friend ws_base<lb_ws_client, lb_ws_pipe *>;
+    
+public:
+    
+    // Destructor
+    
+    ~lb_ws_client()
+    {
+        m_pipe->close();
+        
+        if (m_thread.joinable())
+            m_thread.join();
+        
+        m_pipe->release();
+    }
+    
+    // Connection state
+    
+    bool ready() const { return m_pipe->accepted() && !m_pipe->closed(); }
+    
+    // Send (dropped unless ready, and counted as a send failure if dropped)
+    
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        write(ws_frame(static_cast<int>(opcode), data, size), 1);
+    }
+    
+    // Send (gathered into one frame)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        write(ws_frame(static_cast<int>(opcode), buffers, count), 1);
+    }
+    
+    // Send one fragment of a message (the first with the message's opcode and the rest as continuations)
+    // No other data messages may be sent until the final fragment
+    
+    void send_fragment(const void *data, size_t size, ws_opcode opcode, bool final)
+    {
+        int flags = final ? 0 : ws_frame_header::fragment;
+        
+        write(ws_frame(static_cast<int>(opcode) | flags, data, size), final ? 1 : 0);
+    }
+    
+    // Send a batch of binary messages (framed into a single buffer)
+    
+    void send_batch(const ws_buffer_list *messages, size_t count)
+    {
+        write(ws_frame(static_cast<int>(ws_opcode::binary), messages, count), count);
+    }
+    
+private:
+    
+    // Pass a frame to the server
+    
+    void write(ws_frame frame, size_t messages)
+    {
+        size_t size = frame.size();
+        
+        if (ready() && push(m_pipe, m_pipe->m_to_server, frame))
+        {
+            m_stats.sent(size, messages);
+            m_pipe->m_server_signal->notify();
+        }
+        else
+            m_stats.failed();
+    }
+    
+    // Wait for the server to accept or refuse the connection (a zero time out waits indefinitely)
+    
+    bool wait_for_accept(int time_out)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(time_out);
+        
+        while (!m_pipe->accepted() && !m_pipe->closed())
+        {
+            if (time_out && std::chrono::steady_clock::now() >= deadline)
+                return false;
+            
+            auto epoch = m_pipe->m_client_signal.prepare_wait();
+            
+            if (m_pipe->accepted() || m_pipe->closed())
+                m_pipe->m_client_signal.cancel_wait();
+            else
+                m_pipe->m_client_signal.wait(epoch, std::chrono::milliseconds(1));
+        }
+        
+        return m_pipe->accepted();
+    }
+    
+    // Client thread
+    
+    template <const ws_client_handlers& handlers>
+    void run(bool connected, ws_stats::timestamp start)
+    {
+        auto id = as_ws_connection_id(this);
+        
+        if (!connected || !wait_for_accept(0) || m_pipe->closed())
+        {
+            if constexpr (handlers.m_error != nullptr)
+                handlers.m_error(id, ECONNREFUSED, m_owner);
+            
+            return;
+        }
+        
+        m_stats.connected(start);
+        
+        if constexpr (handlers.m_ready != nullptr)
+            handlers.m_ready(id, m_owner);
+        
+        for (int idle = 0; ; )
+        {
+            if (receive<handlers>(id))
+            {
+                idle = 0;
+                continue;
+            }
+            
+            // Finish once closed by either end and everything sent by the server has been handled
+            
+            if (m_pipe->closed())
+            {
+                if (m_pipe->m_to_client.empty())
+                    break;
+                
+                continue;
+            }
+            
+            if (++idle < spin_count)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            
+            auto epoch = m_pipe->m_client_signal.prepare_wait();
+            
+            if (!m_pipe->m_to_client.empty() || m_pipe->closed())
+                m_pipe->m_client_signal.cancel_wait();
+            else
+                m_pipe->m_client_signal.wait(epoch);
+            
+            idle = 0;
+        }
+        
+        m_stats.closed();
+        handlers.m_close(id, m_owner);
+    }
+    
+    // Handle a batch of received frames (returns true if there were any)
+    
+    template <const ws_client_handlers& handlers>
+    bool receive(ws_connection_id id)
+    {
+        ws_frame frame;
+        int count = 0;
+        
+        // Answer pings (passing them on as well)
+        
+        auto pong = [&](int bits, const void *data, size_t size)
+        {
+            if (static_cast<ws_opcode>(bits & 0x0F) == ws_opcode::ping)
+            {
+                ws_frame reply(static_cast<int>(ws_opcode::pong), data, size);
+                m_pipe->m_control_to_server.push(reply);
+            }
+            
+            return false;
+        };
+        
+        while (count < receive_batch && m_pipe->m_to_client.pop(frame))
+        {
+            if (!deliver(frame, handlers, id, m_assembler, m_owner, m_stats, pong))
+                m_pipe->close();
+            
+            count++;
+        }
+        
+        // Wake the server if it is waiting for space or has pongs to read
+        
+        if (count)
+            m_pipe->m_server_signal->notify();
+        
+        return count;
+    }
+    
+    // Constructor
+    
+    template <const ws_client_handlers& handlers>
+    lb_ws_client(const char *,
+                 uint16_t port,
+                 const char *path,
+                 ws_client_owner<handlers> owner,
+                 const ws_client_options& options,
+                 bool async)
+    : m_owner(owner.m_owner)
+    , m_pipe(new lb_ws_pipe())
+    {
+        auto start = ws_stats::now();
+        bool connected = lb_ws_directory::connect(port, path, m_pipe);
+        
+        // The server holds the other reference once connected
+        
+        if (!connected)
+            m_pipe->release();
+        
+        m_thread = std::thread(&lb_ws_client::run<handlers>, this, connected, start);
+        
+        if (async)
+        {
+            m_handle = m_pipe;
+            return;
+        }
+        
+        if (connected && wait_for_accept(options.m_timeout_ms))
+            m_handle = m_pipe;
+        else
+            m_pipe->close();
+    }
+    
+    void *m_owner;
+    lb_ws_pipe *m_pipe;
+    ws_message_assembler m_assembler;
+    std::thread m_thread;
+};
+
+#endif /* LB_WS_CLIENT_HPP */
@@ -0,0 +1,439 @@
+
+#ifndef LB_WS_COMMON_HPP
+#define LB_WS_COMMON_HPP
+
+#include "../common/ws_base.hpp"
+#include "../common/ws_frame.hpp"
+#include "../common/ws_message_assembler.hpp"
+#include "../common/ws_stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A bounded lock-free single-producer single-consumer ring
+//
+// Each side caches the other's index so that it only touches the shared cache line when the ring looks full or empty.
+
+template <class T>
+class lb_ring
+{
+public:
+    
+    lb_ring(size_t capacity) : m_items(round_up(capacity)), m_mask(m_items.size() - 1) {}
+    
+    lb_ring(const lb_ring&) = delete;
+    lb_ring& operator=(const lb_ring&) = delete;
+    
+    // Producer only (returns false and leaves the item alone if the ring is full)
+    
+    bool push(T& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        
+        if (tail - m_head_cache == m_items.size())
+        {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            
+            if (tail - m_head_cache == m_items.size())
+                return false;
+        }
+        
+        m_items[tail & m_mask] = std::move(item);
+        m_tail.store(tail + 1, std::memory_order_release);
+        
+        return true;
+    }
+    
+    // Consumer only (returns false if the ring is empty)
+    
+    bool pop(T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        
+        if (head == m_tail_cache)
+        {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            
+            if (head == m_tail_cache)
+                return false;
+        }
+        
+        item = std::move(m_items[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_release);
+        
+        return true;
+    }
+    
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+    
+private:
+    
+    static size_t round_up(size_t capacity)
+    {
+        size_t size = 1;
+        
+        while (size < capacity)
+            size <<= 1;
+        
+        return size;
+    }
+    
+    std::vector<T> m_items;
+    const size_t m_mask;
+    
+    // Consumer state
+    
+    alignas(64) std::atomic<size_t> m_head { 0 };
+    size_t m_tail_cache = 0;
+    
+    // Producer state
+    
+    alignas(64) std::atomic<size_t> m_tail { 0 };
+    size_t m_head_cache = 0;
+};
+
+// A wakeup for a thread that consumes from one or more rings
+//
+// Producers pay one atomic increment and load per notify unless the consumer is asleep. The consumer calls
+// prepare_wait(), checks for work once more and then either cancel_wait() or wait() with the value returned.
+
+class lb_signal
+{
+public:
+    
+    void notify()
+    {
+        m_epoch.fetch_add(1);
+        
+        if (m_waiters.load())
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_condition.notify_all();
+        }
+    }
+    
+    uint64_t prepare_wait()
+    {
+        m_waiters.fetch_add(1);
+        return m_epoch.load();
+    }
+    
+    void cancel_wait()
+    {
+        m_waiters.fetch_sub(1);
+    }
+    
+    // Wait for a notify (the time out only guards against a consumer polling something that does not notify)
+    
+    void wait(uint64_t epoch, std::chrono::milliseconds time_out = std::chrono::milliseconds(100))
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait_for(lock, time_out, [&]() { return m_epoch.load() != epoch; });
+        }
+        
+        m_waiters.fetch_sub(1);
+    }
+    
+private:
+    
+    std::atomic<uint64_t> m_epoch { 0 };
+    std::atomic<int> m_waiters { 0 };
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+};
+
+// An in-process connection (a ring in each direction, shared by the client and the server's connection state)
+
+class lb_ws_pipe
+{
+public:
+    
+    // Messages in flight in each direction before senders wait (or the server keeps them queued), and control frames
+    // sent by the client's thread in reply (dropped if that ring is full)
+    
+    static constexpr size_t ring_size = 4096;
+    static constexpr size_t control_ring_size = 64;
+    
+    lb_ws_pipe() : m_to_server(ring_size), m_to_client(ring_size), m_control_to_server(control_ring_size) {}
+    
+    // Reference counting (one reference for each end)
+    
+    void retain()
+    {
+        m_references.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void release()
+    {
+        if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+    
+    // Close from either end (waking both)
+    
+    void close()
+    {
+        m_closed.store(true);
+        m_client_signal.notify();
+        
+        if (m_server_signal)
+            m_server_signal->notify();
+    }
+    
+    bool closed() const { return m_closed.load(); }
+    
+    // Called by the server once it has accepted or refused the connection
+    
+    void accept(bool accepted)
+    {
+        if (accepted)
+            m_accepted.store(true);
+        else
+            m_closed.store(true);
+        
+        m_client_signal.notify();
+    }
+    
+    bool accepted() const { return m_accepted.load(); }
+    
+    lb_ring<ws_frame> m_to_server;
+    lb_ring<ws_frame> m_to_client;
+    lb_ring<ws_frame> m_control_to_server;
+    lb_signal m_client_signal;
+    std::shared_ptr<lb_signal> m_server_signal;         // Set before the pipe is passed to the server
+    
+private:
+    
+    ~lb_ws_pipe() {}
+    
+    std::atomic<int> m_references { 2 };
+    std::atomic<bool> m_accepted { false };
+    std::atomic<bool> m_closed { false };
+};
+
+// A server listening for in-process connections
+
+struct lb_ws_listener
+{
+    using accept_func = void(*)(void *, lb_ws_pipe *);
+    
+    accept_func m_accept;
+    void *m_server;
+    std::shared_ptr<lb_signal> m_signal;
+    uint16_t m_port;
+    std::string m_path;
+    bool m_reuse_port = false;
+};
+
+// The process-wide table of listeners (ports are only meaningful within the process)
+
+class lb_ws_directory
+{
+    static constexpr uint16_t first_ephemeral_port = 49152;
+    
+public:
+    
+    // Register a listener (a zero port picks a free one) and return false if the port and path are taken
+    // Listeners that all reuse the port share it, taking connections in turn
+    
+    static bool add(lb_ws_listener& listener)
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        
+        auto& entries = listeners();
+        
+        if (!listener.m_port)
+        {
+            for (uint16_t port = first_ephemeral_port; port && !listener.m_port; port++)
+            {
+                if (entries.find({ port, listener.m_path }) == entries.end())
+                    listener.m_port = port;
+            }
+        }
+        
+        if (!listener.m_port)
+            return false;
+        
+        auto& shared = entries[key(listener.m_port, listener.m_path)];
+        
+        for (auto it = shared.m_listeners.begin(); it != shared.m_listeners.end(); it++)
+        {
+            if (!listener.m_reuse_port || !(*it)->m_reuse_port)
+                return false;
+        }
+        
+        shared.m_listeners.push_back(&listener);
+        
+        return true;
+    }
+    
+    static void remove(lb_ws_listener& listener)
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        
+        auto it = listeners().find(key(listener.m_port, listener.m_path));
+        
+        if (it == listeners().end())
+            return;
+        
+        auto& shared = it->second.m_listeners;
+        
+        shared.erase(std::remove(shared.begin(), shared.end(), &listener), shared.end());
+        
+        if (shared.empty())
+            listeners().erase(it);
+    }
+    
+    // Pass a pipe to the listener (or next of those sharing) for a port and path (returns false if there is none)
+    
+    static bool connect(uint16_t port, const char *path, lb_ws_pipe *pipe)
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        
+        auto it = listeners().find(key(port, path));
+        
+        if (it == listeners().end())
+            return false;
+        
+        auto& shared = it->second;
+        lb_ws_listener *listener = shared.m_listeners[shared.m_next++ % shared.m_listeners.size()];
+        
+        pipe->m_server_signal = listener->m_signal;
+        listener->m_accept(listener->m_server, pipe);
+        
+        return true;
+    }
+    
+private:
+    
+    using key = std::pair<uint16_t, std::string>;
+    
+    struct entry
+    {
+        std::vector<lb_ws_listener *> m_listeners;
+        size_t m_next = 0;
+    };
+    
+    static std::mutex& mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+    
+    static std::map<key, entry>& listeners()
+    {
+        static std::map<key, entry> listeners;
+        return listeners;
+    }
+};
+
+// Common functionality for loopback clients and servers
+
+class lb_ws_common
+{
+protected:
+    
+    // Messages handled at once per connection before moving on, and polls before a consumer sleeps
+    
+    static constexpr int receive_batch = 64;
+    static constexpr int spin_count = 256;
+    
+    // Pass each frame in a buffer to a function as (header byte, payload, size) and return false if it does
+    
+    template <typename F>
+    static bool for_each_frame(const ws_frame& frame, F func)
+    {
+        auto bytes = static_cast<const unsigned char *>(frame.data());
+        size_t remaining = frame.size();
+        
+        while (remaining >= 2)
+        {
+            size_t length = bytes[1] & 0x7F;
+            size_t header_size = 2;
+            
+            if (length == 126)
+            {
+                length = (size_t(bytes[2]) << 8) | bytes[3];
+                header_size = 4;
+            }
+            else if (length == 127)
+            {
+                length = 0;
+                
+                for (int i = 0; i < 8; i++)
+                    length = (length << 8) | bytes[2 + i];
+                
+                header_size = 10;
+            }
+            
+            if (!func(bytes[0], bytes + header_size, length))
+                return false;
+            
+            bytes += header_size + length;
+            remaining -= header_size + length;
+        }
+        
+        return true;
+    }
+    
+    // Deliver the frames in a buffer (counting them in stats) and return false if they are out of sequence
+    // Each frame is first passed to a filter as (bits, payload, size), which returns true if it has consumed it
+    
+    template <class H, class S, typename F>
+    static bool deliver(const ws_frame& frame,
+                        const H& handlers,
+                        ws_connection_id id,
+                        ws_message_assembler& assembler,
+                        void *owner,
+                        S& stats,
+                        F filter)
+    {
+        auto start = ws_stats::now();
+        
+        bool result = for_each_frame(frame, [&](int bits, const void *data, size_t size)
+        {
+            stats.received(size, (bits & ws_message_assembler::fin_bit) ? 1 : 0);
+            
+            if (filter(bits, data, size))
+                return true;
+            
+            return assembler.receive(handlers, id, bits, data, size, owner);
+        });
+        
+        stats.handled(start);
+        
+        return result;
+    }
+    
+    // Push into a ring, waiting for space unless the pipe closes (returns false if it did)
+    
+    static bool push(lb_ws_pipe *pipe, lb_ring<ws_frame>& ring, ws_frame& frame)
+    {
+        while (!ring.push(frame))
+        {
+            if (pipe->closed())
+                return false;
+            
+            std::this_thread::yield();
+        }
+        
+        return true;
+    }
+};
+
+#endif /* LB_WS_COMMON_HPP */
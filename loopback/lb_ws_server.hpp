@@ -0,0 +1,631 @@
+
+#ifndef LB_WS_SERVER_HPP
+#define LB_WS_SERVER_HPP
+
+#include "lb_ws_common.hpp"
+#include "../common/ws_handlers.hpp"
+#include "../common/ws_server_base.hpp"
+#include "../common/ws_connection.hpp"
+#include "../common/ws_frame.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Loopback per-connection state
+
+class lb_ws_connection : public ws_connection<lb_ws_connection, ws_frame>
+{
+public:
+    
+    lb_ws_connection(lb_ws_pipe *pipe,
+                     const ws_send_queue_options& options,
+                     ws_handler_funcs::backpressure_handler backpressure,
+                     void *owner)
+    : ws_connection(options, backpressure, owner)
+    , m_pipe(pipe)
+    {}
+    
+    ~lb_ws_connection()
+    {
+        m_pipe->release();
+    }
+    
+    lb_ws_pipe *const m_pipe;
+    ws_message_assembler m_assembler;
+    
+    // A frame popped from the queue that did not fit in the ring (only used by the server thread)
+    
+    ws_frame m_pending;
+    size_t m_pending_bytes = 0;
+    size_t m_pending_messages = 0;
+};
+
+// In-process websocket server (connections are made by lb_ws_client in the same process, without sockets)
+//
+// One server thread accepts connections, moves queued messages into each connection's ring and calls the handlers for
+// received messages. Ports are only meaningful within the process and a zero port picks a free one.
+
+class lb_ws_server : public lb_ws_common, public ws_server_base<lb_ws_server, lb_ws_listener *, lb_ws_connection *>
+{
+    friend ws_base<lb_ws_server, lb_ws_listener *>;
+    friend ws_server_base<lb_ws_server, lb_ws_listener *, lb_ws_connection *>;
+    
+    using clock = std::chrono::steady_clock;
+    
+public:
+    
+    // Destructor (closes all connections)
+    
+    ~lb_ws_server()
+    {
+        stop_heartbeat();
+        
+        if (m_handle)
+            lb_ws_directory::remove(m_listener);
+        
+        m_stop.store(true);
+        m_listener.m_signal->notify();
+        
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+    
+    // A message framed once for sending to any number of connections
+    
+    using message = ws_frame;
+    
+    static message prepare(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return ws_frame(static_cast<int>(opcode), data, size);
+    }
+    
+    static message prepare(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return ws_frame(static_cast<int>(opcode), buffers, count);
+    }
+    
+    // Send (queued and moved to the connection by the server thread)
+    
+    ws_send_result send(ws_connection_id id, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send(id, prepare(data, size, opcode));
+    }
+    
+    // Send (gathered)
+    
+    ws_send_result send(ws_connection_id id, const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send(id, prepare(buffers, count, opcode));
+    }
+    
+    // Send (prepared)
+    
+    ws_send_result send(ws_connection_id id, const message& frame)
+    {
+        ws_send_result result = ws_send_result::not_connected;
+        
+        visit_connection(id, [&](lb_ws_connection *connection)
+        {
+            result = enqueue(connection, frame);
+        });
+        
+        if (result == ws_send_result::not_connected)
+            m_stats.failed();
+        
+        return result;
+    }
+    
+    // Send (prepared to all)
+    
+    void send(const message& frame)
+    {
+        for_each_connection([&](lb_ws_connection *connection)
+        {
+            enqueue(connection, frame);
+        });
+    }
+    
+    // Send (prepared to the members of a group) and return the number queued
+    
+    size_t send_to_group(ws_group_id group, const message& frame)
+    {
+        size_t queued = 0;
+        
+        for_each_in_group(group, [&](lb_ws_connection *connection)
+        {
+            if (accepted(enqueue(connection, frame)))
+                queued++;
+        });
+        
+        return queued;
+    }
+    
+    // Send (to the members of a group)
+    
+    size_t send_to_group(ws_group_id group, const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_to_group(group, prepare(data, size, opcode));
+    }
+    
+    // Send (gathered to the members of a group)
+    
+    size_t send_to_group(ws_group_id group,
+                         const ws_buffer *buffers,
+                         size_t count,
+                         ws_opcode opcode = ws_opcode::binary)
+    {
+        return send_to_group(group, prepare(buffers, count, opcode));
+    }
+    
+    // Send (to all)
+    
+    void send(const void *data, size_t size, ws_opcode opcode = ws_opcode::binary)
+    {
+        send(prepare(data, size, opcode));
+    }
+    
+    // Send (gathered to all)
+    
+    void send(const ws_buffer *buffers, size_t count, ws_opcode opcode = ws_opcode::binary)
+    {
+        send(prepare(buffers, count, opcode));
+    }
+    
+    // Send one fragment of a message (the first with the message's opcode and the rest as continuations)
+    // No other data messages may be sent to the connection until the final fragment (the coalesce policy never
+    // discards queued fragments, so a message is not broken up)
+    
+    ws_send_result send_fragment(ws_connection_id id, const void *data, size_t size, ws_opcode opcode, bool final)
+    {
+        int flags = final ? 0 : ws_frame_header::fragment;
+        
+        return send(id, ws_frame(static_cast<int>(opcode) | flags, data, size));
+    }
+    
+    // Send a batch of binary messages (those for each connection are framed into a single buffer)
+    // Returns the number queued
+    
+    size_t send_batch(const ws_batch_message *messages, size_t count)
+    {
+        size_t queued = 0;
+        
+        group_batch(messages, count, [&](ws_connection_id id, const ws_buffer_list *group, size_t size)
+        {
+            ws_frame frame(static_cast<int>(ws_opcode::binary), group, size);
+            
+            bool found = visit_connection(id, [&](lb_ws_connection *connection)
+            {
+                if (accepted(enqueue(connection, frame, size)))
+                    queued += size;
+            });
+            
+            if (!found)
+                m_stats.failed();
+        });
+        
+        return queued;
+    }
+    
+private:
+    
+    // Pass a new pipe to the server thread (called by lb_ws_directory with its lock held)
+    
+    static void accept(void *server, lb_ws_pipe *pipe)
+    {
+        auto self = static_cast<lb_ws_server *>(server);
+        
+        {
+            std::lock_guard<std::mutex> lock(self->m_mutex);
+            self->m_accepting.push_back(pipe);
+        }
+        
+        self->m_listener.m_signal->notify();
+    }
+    
+    // Queue a frame (holding one or more messages) and schedule the connection if needed
+    
+    ws_send_result enqueue(lb_ws_connection *connection, const message& frame, size_t messages = 1)
+    {
+        auto result = connection->push(frame, frame.size());
+        
+        if (accepted(result.m_result))
+        {
+            connection->m_stats.sent(frame.size(), messages);
+            connection->capture(ws_capture_event::sent, 0, frame.data(), frame.size(), true);
+        }
+        else
+            connection->m_stats.failed();
+        
+        if (result.m_result == ws_send_result::disconnecting)
+            close_idle(connection);
+        else if (result.m_schedule)
+            schedule(connection, connection->m_batching.load(std::memory_order_relaxed));
+        
+        return result.m_result;
+    }
+    
+    // Pass a connection with queued messages to the server thread (after the batching delay if asked)
+    
+    void schedule(lb_ws_connection *connection, bool delay = false)
+    {
+        connection->retain();
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            
+            if (delay)
+                m_delayed.emplace_back(clock::now() + batch_delay(), connection);
+            else
+                m_ready.push_back(connection);
+        }
+        
+        m_listener.m_signal->notify();
+    }
+    
+    std::chrono::microseconds batch_delay() const
+    {
+        return std::chrono::microseconds(std::max(0, m_options.m_batching.m_max_delay_us));
+    }
+    
+    // Heartbeats
+    
+    template <const ws_server_handlers&>
+    void ping(lb_ws_connection *connection, uint64_t stamp)
+    {
+        ws_frame frame(static_cast<int>(ws_opcode::ping), &stamp, sizeof(stamp));
+        
+        if (connection->push(frame, frame.size()).m_schedule)
+            schedule(connection);
+    }
+    
+    // Close (the server thread closes the connection once its pipe is drained)
+    
+    void close_idle(lb_ws_connection *connection)
+    {
+        connection->m_queue.close();
+        connection->m_pipe->close();
+    }
+    
+    // Server thread
+    
+    template <const ws_server_handlers& handlers>
+    void run()
+    {
+        for (int idle = 0; !m_stop.load(); )
+        {
+            if (poll<handlers>())
+            {
+                idle = 0;
+                continue;
+            }
+            
+            if (++idle < spin_count)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            
+            // Sleep unless there is work after all (a full ring is rechecked when its client pops), waking for any
+            // connection whose batching delay ends first
+            
+            auto epoch = m_listener.m_signal->prepare_wait();
+            
+            if (poll<handlers>())
+                m_listener.m_signal->cancel_wait();
+            else
+                m_listener.m_signal->wait(epoch, wait_time());
+            
+            idle = 0;
+        }
+        
+        shutdown<handlers>();
+    }
+    
+    // Do any outstanding work (returns true if there was some)
+    
+    template <const ws_server_handlers& handlers>
+    bool poll()
+    {
+        bool busy = accept_connections<handlers>();
+        
+        busy = write_connections() || busy;
+        busy = read_connections<handlers>() || busy;
+        
+        return busy;
+    }
+    
+    template <const ws_server_handlers& handlers>
+    bool accept_connections()
+    {
+        std::vector<lb_ws_pipe *> pipes;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            pipes.assign(m_accepting.begin(), m_accepting.end());
+            m_accepting.clear();
+        }
+        
+        for (auto it = pipes.begin(); it != pipes.end(); it++)
+        {
+            auto connection = new lb_ws_connection(*it, m_options.m_send_queue, handlers.m_backpressure, m_owner);
+            
+            connection->m_batching.store(m_options.m_batching.m_enable);
+            
+            auto id = add_connection(connection);
+            
+            // Refuse the connection if the registry is full
+            
+            if (!id)
+            {
+                (*it)->accept(false);
+                connection->release();
+                continue;
+            }
+            
+            m_active.push_back(connection);
+            handlers.m_connect(id, m_owner);
+            (*it)->accept(true);
+            connection->m_stats.connected();
+            handlers.m_ready(id, connection->user_data());
+        }
+        
+        return !pipes.empty();
+    }
+    
+    // How long the server thread may sleep for
+    
+    std::chrono::milliseconds wait_time()
+    {
+        auto time_out = std::chrono::milliseconds(100);
+        
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        if (m_delayed.empty())
+            return time_out;
+        
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(m_delayed.front().first - clock::now());
+        
+        return std::max(std::chrono::milliseconds(0), std::min(time_out, remaining));
+    }
+    
+    // Move queued messages into rings (connections whose rings are full are kept until there is space)
+    
+    bool write_connections()
+    {
+        std::vector<lb_ws_connection *> ready;
+        bool busy = false;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ready.assign(m_ready.begin(), m_ready.end());
+            m_ready.clear();
+            
+            // Connections are delayed for the same time, so those due are at the front
+            
+            for (auto now = clock::now(); !m_delayed.empty() && m_delayed.front().first <= now; m_delayed.pop_front())
+                ready.push_back(m_delayed.front().second);
+        }
+        
+        ready.insert(ready.end(), m_blocked.begin(), m_blocked.end());
+        m_blocked.clear();
+        
+        for (auto it = ready.begin(); it != ready.end(); it++)
+        {
+            lb_ws_connection *connection = *it;
+            lb_ws_pipe *pipe = connection->m_pipe;
+            int written = 0;
+            
+            while (!pipe->closed())
+            {
+                if (connection->m_pending.empty() && !pop(connection))
+                    break;
+                
+                if (!pipe->m_to_client.push(connection->m_pending))
+                    break;
+                
+                connection->complete(connection->m_pending_bytes, connection->m_pending_messages);
+                written++;
+            }
+            
+            if (written)
+                pipe->m_client_signal.notify();
+            
+            busy = busy || written;
+            
+            if (!connection->m_pending.empty() && !pipe->closed())
+                m_blocked.push_back(connection);
+            else
+                connection->release();
+        }
+        
+        return busy;
+    }
+    
+    // Pop the next frame to write into the pending slot (joining a run of frames for a batching connection)
+    
+    bool pop(lb_ws_connection *connection)
+    {
+        connection->m_pending_messages = 1;
+        
+        if (!connection->m_batching.load(std::memory_order_relaxed))
+            return connection->m_queue.pop(connection->m_pending, connection->m_pending_bytes);
+        
+        connection->m_pending_bytes = 0;
+        
+        auto add = [&](ws_frame& frame, size_t size)
+        {
+            m_batch.push_back(std::move(frame));
+            connection->m_pending_bytes += size;
+        };
+        
+        size_t count = connection->m_queue.pop_batch(add, m_options.m_batching.m_max_batch_size);
+        
+        if (count)
+            connection->m_pending = count == 1 ? std::move(m_batch[0]) : ws_frame(m_batch.data(), count);
+        
+        connection->m_pending_messages = count;
+        m_batch.clear();
+        
+        return count;
+    }
+    
+    // Deliver received messages and close connections whose pipes have closed
+    
+    template <const ws_server_handlers& handlers>
+    bool read_connections()
+    {
+        bool busy = false;
+        
+        for (size_t i = 0; i < m_active.size(); )
+        {
+            lb_ws_connection *connection = m_active[i];
+            lb_ws_pipe *pipe = connection->m_pipe;
+            bool valid = true;
+            ws_frame frame;
+            int count = 0;
+            
+            auto pong = [&](int bits, const void *data, size_t size)
+            {
+                return received<handlers>(connection, bits, data, size);
+            };
+            
+            auto read = [&](lb_ring<ws_frame>& ring)
+            {
+                while (valid && count < receive_batch && ring.pop(frame))
+                {
+                    auto& stats = connection->m_stats;
+                    auto& assembler = connection->m_assembler;
+                    
+                    valid = deliver(frame, handlers, connection->m_id, assembler, connection->user_data(), stats, pong);
+                    count++;
+                }
+            };
+            
+            // Read replies to pings first so that their round trip times do not include waiting behind messages
+            
+            read(pipe->m_control_to_server);
+            read(pipe->m_to_server);
+            
+            busy = busy || count;
+            
+            // Wake a client waiting for space, and close on a protocol error or once a closed pipe is drained
+            
+            if (count)
+                pipe->m_client_signal.notify();
+            
+            if (!valid || (pipe->closed() && pipe->m_to_server.empty()))
+            {
+                close_connection<handlers>(connection);
+                m_active[i] = m_active.back();
+                m_active.pop_back();
+                busy = true;
+            }
+            else
+                i++;
+        }
+        
+        return busy;
+    }
+    
+    template <const ws_server_handlers& handlers>
+    void close_connection(lb_ws_connection *connection)
+    {
+        auto id = connection->m_id;
+        
+        remove_connection(id);
+        connection->m_queue.close();
+        connection->m_pipe->close();
+        connection->m_stats.closed();
+        handlers.m_close(id, connection->user_data());
+        connection->release();
+    }
+    
+    // Close everything when the server stops
+    
+    template <const ws_server_handlers& handlers>
+    void shutdown()
+    {
+        while (m_active.size())
+        {
+            close_connection<handlers>(m_active.back());
+            m_active.pop_back();
+        }
+        
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        for (auto it = m_accepting.begin(); it != m_accepting.end(); it++)
+        {
+            (*it)->accept(false);
+            (*it)->release();
+        }
+        
+        for (auto it = m_ready.begin(); it != m_ready.end(); it++)
+            (*it)->release();
+        
+        for (auto it = m_blocked.begin(); it != m_blocked.end(); it++)
+            (*it)->release();
+        
+        for (auto it = m_delayed.begin(); it != m_delayed.end(); it++)
+            it->second->release();
+        
+        m_accepting.clear();
+        m_ready.clear();
+        m_blocked.clear();
+        m_delayed.clear();
+    }
+    
+    // Constructor
+    
+    template <const ws_server_handlers& handlers>
+    lb_ws_server(const char *port, const char *path, ws_server_owner<handlers> owner, const ws_server_options& options)
+    : m_owner(owner.m_owner)
+    , m_options(options)
+    {
+        m_listener.m_accept = accept;
+        m_listener.m_server = this;
+        m_listener.m_signal = std::make_shared<lb_signal>();
+        m_listener.m_port = static_cast<uint16_t>(std::atoi(port));
+        m_listener.m_path = path;
+        m_listener.m_reuse_port = options.m_reuse_port;
+        
+        // Start capturing, heartbeats and the server thread before connections can arrive
+        
+        start_capture(m_options.m_capture);
+        start_heartbeat<handlers>(m_options.m_heartbeat);
+        
+        m_thread = std::thread(&lb_ws_server::run<handlers>, this);
+        
+        if (lb_ws_directory::add(m_listener))
+        {
+            m_handle = &m_listener;
+            m_port = m_listener.m_port;
+            m_ports.push_back(m_port);
+        }
+    }
+    
+    void *m_owner;
+    const ws_server_options m_options;
+    lb_ws_listener m_listener;
+    
+    // Server thread state (m_active, m_blocked and m_batch are only used by the server thread)
+    
+    std::mutex m_mutex;
+    std::deque<lb_ws_pipe *> m_accepting;
+    std::deque<lb_ws_connection *> m_ready;
+    std::deque<std::pair<clock::time_point, lb_ws_connection *>> m_delayed;
+    std::vector<lb_ws_connection *> m_active;
+    std::vector<lb_ws_connection *> m_blocked;
+    std::vector<ws_frame> m_batch;
+    std::atomic<bool> m_stop { false };
+    std::thread m_thread;
+};
+
+#endif /* LB_WS_SERVER_HPP */
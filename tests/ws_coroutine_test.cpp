@@ -0,0 +1,176 @@
+
+// Coroutine wrappers over the loopback backend
+//
+// An echo round trip through ws_co_server and ws_co_client, with every coroutine resumed on the test's own loop. This
+// also instantiates the wrappers' relayed handlers, which the build checks with warnings enabled.
+
+#include "common/ws_coroutine.hpp"
+#include "loopback/lb_ws_client.hpp"
+#include "loopback/lb_ws_server.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// An executor that queues coroutines for the main thread
+
+class loop
+{
+public:
+    
+    ws_co_executor executor() { return ws_co_executor { post, this }; }
+    
+    // Resume one coroutine (returns false if none was posted in time)
+    
+    bool run_one(int time_out_ms)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        
+        if (!m_condition.wait_for(lock, std::chrono::milliseconds(time_out_ms), [&]() { return !m_queue.empty(); }))
+            return false;
+        
+        auto handle = m_queue.front();
+        m_queue.pop_front();
+        lock.unlock();
+        
+        handle.resume();
+        
+        return true;
+    }
+    
+private:
+    
+    static void post(std::coroutine_handle<> handle, void *context)
+    {
+        loop *l = static_cast<loop *>(context);
+        
+        {
+            std::lock_guard<std::mutex> lock(l->m_mutex);
+            l->m_queue.push_back(handle);
+        }
+        
+        l->m_condition.notify_one();
+    }
+    
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::coroutine_handle<>> m_queue;
+};
+
+// A coroutine that starts at once and is not awaited
+
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+using co_server = ws_co_server<lb_ws_server>;
+using co_client = ws_co_client<lb_ws_client>;
+
+static const int messages = 100;
+
+static int echoed = 0;
+static int replies = 0;
+static bool finished = false;
+static bool refused = false;
+
+// Echo messages until the connection closes
+
+static task serve(co_server::connection_ptr connection)
+{
+    while (auto message = co_await connection->receive())
+    {
+        co_await connection->send(message.m_data, message.m_size, message.m_opcode);
+        echoed++;
+    }
+}
+
+static task accept_all(co_server *server)
+{
+    while (auto connection = co_await server->accept())
+        serve(std::move(connection));
+}
+
+// Send messages one at a time, checking each reply, then try a port with no server
+
+static task run_client(loop *l, uint16_t port)
+{
+    auto client = co_await co_client::connect("localhost", port, "/ws", l->executor());
+    
+    check(client != nullptr, "the client connects");
+    
+    for (int i = 0; client && i < messages; i++)
+    {
+        std::string text = "message " + std::to_string(i);
+        
+        co_await client->send(text.data(), text.size(), ws_opcode::text);
+        
+        auto reply = co_await client->receive();
+        
+        if (reply && reply.m_size == text.size() && !std::memcmp(reply.m_data, text.data(), text.size()))
+            replies++;
+    }
+    
+    client.reset();
+    
+    auto unreachable = co_await co_client::connect("localhost", port + 1, "/nowhere", l->executor());
+    
+    refused = !unreachable;
+    finished = true;
+}
+
+int main()
+{
+    loop l;
+    auto server = co_server::create("0", "/ws", l.executor());
+    
+    check(server != nullptr, "the server starts");
+    
+    if (!server)
+        return EXIT_FAILURE;
+    
+    accept_all(server.get());
+    run_client(&l, server->server().port());
+    
+    for (int idle = 0; !finished && idle < 500; )
+        idle = l.run_one(10) ? 0 : idle + 1;
+    
+    server.reset();
+    
+    while (l.run_one(50));
+    
+    check(finished, "the client finishes");
+    check(replies == messages, "every message is echoed back");
+    check(echoed == messages, "the server echoes every message");
+    check(refused, "connecting to a port with no server gives no client");
+    
+    if (failures)
+        return EXIT_FAILURE;
+    
+    std::printf("ws_coroutine_test passed\n");
+    return EXIT_SUCCESS;
+}
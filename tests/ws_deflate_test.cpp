@@ -0,0 +1,103 @@
+
+// permessage-deflate round trips
+//
+// Highly compressible messages inflate to far more than the output reserved per pass, so these check that nothing
+// zlib still holds once the input runs out is lost or carried into the next message.
+
+#include "common/ws_deflate.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// A message of the given size that compresses very well (long runs of one byte)
+
+static std::vector<unsigned char> payload(size_t size, unsigned char seed)
+{
+    std::vector<unsigned char> data(size);
+    
+    for (size_t i = 0; i < size; i++)
+        data[i] = static_cast<unsigned char>('a' + (seed + i / 65536) % 26);
+    
+    return data;
+}
+
+// Compress and decompress messages in sequence with the given context takeover
+
+static void round_trips(bool context_takeover)
+{
+    ws_deflater deflater(6, 15, context_takeover);
+    ws_inflater inflater;
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> inflated;
+    const size_t sizes[] = { 0, 1, 100, 64 * 1024, 1024 * 1024, 8 * 1024 * 1024, 17 };
+    
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        auto message = payload(sizes[i], static_cast<unsigned char>(i));
+        ws_buffer buffer { message.data(), message.size() };
+        
+        check(deflater.compress(&buffer, 1, compressed), "compress");
+        
+        if (sizes[i] >= 64 * 1024)
+            check(compressed.size() * 100 < message.size(), "the message compresses more than 100 times");
+        
+        check(inflater.decompress(compressed.data(), compressed.size(), inflated), "decompress");
+        check(inflated == message, "the message inflates to the original");
+    }
+}
+
+// Decompress a message given in pieces of each size up to a maximum, as fragments arrive
+// (so that the output buffer fills just as a piece runs out at some point)
+
+static void fragments(size_t max_piece)
+{
+    ws_deflater deflater(9, 15, true);
+    ws_inflater inflater;
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> part;
+    std::vector<unsigned char> inflated;
+    
+    auto message = payload(4 * 1024 * 1024, 3);
+    ws_buffer buffer { message.data(), message.size() };
+    
+    check(deflater.compress(&buffer, 1, compressed), "compress");
+    
+    for (size_t offset = 0, piece = 1; offset < compressed.size(); piece = piece % max_piece + 1)
+    {
+        size_t size = std::min(piece, compressed.size() - offset);
+        bool final = offset + size == compressed.size();
+        
+        check(inflater.decompress(compressed.data() + offset, size, part, final), "decompress a fragment");
+        inflated.insert(inflated.end(), part.begin(), part.end());
+        offset += size;
+    }
+    
+    check(inflated == message, "the fragments inflate to the original");
+}
+
+int main()
+{
+    round_trips(true);
+    round_trips(false);
+    fragments(1);
+    fragments(64);
+    
+    if (failures)
+        return EXIT_FAILURE;
+    
+    std::printf("ws_deflate_test passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+
+// Event queue wakeups under contention
+//
+// Producers push into a small ring whilst the consumer sleeps on the wakeup fd between polls, so the ring keeps
+// emptying and refilling. A wakeup lost whilst clearing the fd would leave events waiting with the fd unreadable.
+
+#include "common/ws_event_queue.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// Deliver events from several threads and check each is handled with the fd readable whenever any are waiting
+
+static void stress(size_t capacity, size_t producers, size_t events, size_t max_events)
+{
+    ws_event_queue queue(capacity);
+    std::vector<std::thread> threads;
+    std::vector<size_t> last(producers, 0);
+    size_t total = producers * events;
+    size_t handled = 0;
+    bool ordered = true;
+    bool lost = false;
+    
+    for (size_t i = 0; i < producers; i++)
+    {
+        threads.emplace_back([&queue, i, events]()
+        {
+            for (size_t j = 1; j <= events; j++)
+            {
+                queue.on_error(static_cast<ws_connection_id>(i), static_cast<int>(j));
+                
+                if (!(j % 64))
+                    std::this_thread::yield();
+            }
+        });
+    }
+    
+    while (handled < total && !lost)
+    {
+        struct pollfd descriptor { queue.fd(), POLLIN, 0 };
+        
+        if (::poll(&descriptor, 1, 2000) <= 0)
+        {
+            lost = !queue.empty();
+            
+            if (!lost)
+                break;
+        }
+        
+        handled += queue.poll([&](const ws_event& event)
+        {
+            size_t& previous = last[event.id()];
+            
+            ordered = ordered && static_cast<size_t>(event.error()) == previous + 1;
+            previous = event.error();
+        }, max_events);
+    }
+    
+    // Drain whatever is left (producers wait for space until it is handled)
+    
+    while (handled < total)
+        handled += queue.poll([](const ws_event&) {});
+    
+    for (auto& thread : threads)
+        thread.join();
+    
+    check(!lost, "the fd is readable whilst events are waiting");
+    check(ordered, "each producer's events are handled in order");
+    check(handled == total, "every event is handled");
+    check(queue.empty(), "the queue is empty");
+}
+
+int main()
+{
+    stress(64, 4, 200000, ~size_t(0));
+    stress(64, 4, 200000, 16);
+    stress(2, 8, 50000, ~size_t(0));
+    
+    if (failures)
+        return EXIT_FAILURE;
+    
+    std::printf("ws_event_queue_test passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+
+// Send queue watermarks
+//
+// Congestion is only cleared as messages complete, so these check that a message larger than the high watermark on an
+// idle connection cannot leave it congested with nothing to complete.
+
+#include "common/ws_send_queue.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// A queued message (all of them whole data messages)
+
+struct message
+{
+    size_t m_size = 0;
+    
+    bool coalescable() const { return true; }
+};
+
+static ws_send_queue_options queue_options(ws_backpressure_policy policy)
+{
+    ws_send_queue_options options;
+    
+    options.m_high_watermark = 1024;
+    options.m_low_watermark = 256;
+    options.m_policy = policy;
+    
+    return options;
+}
+
+// Write everything queued, completing each message (returns true if congestion cleared)
+
+static bool write_all(ws_send_queue<message>& queue)
+{
+    message item;
+    size_t bytes;
+    bool cleared = false;
+    
+    while (queue.pop(item, bytes))
+        cleared = queue.complete(bytes) || cleared;
+    
+    return cleared;
+}
+
+// An oversized message on an idle connection is queued, and later sends still go through
+
+static void oversized_when_idle(ws_backpressure_policy policy)
+{
+    ws_send_queue<message> queue(queue_options(policy));
+    
+    auto result = queue.push(message { 2048 }, 2048);
+    
+    check(result.m_result == ws_send_result::queued, "an oversized message on an idle connection is queued");
+    check(result.m_schedule, "an oversized message schedules a drainer");
+    check(!result.m_congested, "an oversized message on an idle connection does not congest it");
+    
+    write_all(queue);
+    
+    for (int i = 0; i < 10; i++)
+    {
+        result = queue.push(message { 10 }, 10);
+        check(result.m_result == ws_send_result::queued, "later small messages are queued");
+    }
+    
+    write_all(queue);
+    
+    check(queue.depth().m_bytes == 0, "the queue drains");
+}
+
+// An oversized message behind others congests the connection until they complete
+
+static void oversized_when_busy()
+{
+    ws_send_queue<message> queue(queue_options(ws_backpressure_policy::drop));
+    
+    queue.push(message { 100 }, 100);
+    
+    auto result = queue.push(message { 2048 }, 2048);
+    
+    check(result.m_result == ws_send_result::dropped, "an oversized message behind another is dropped");
+    check(result.m_congested, "an oversized message behind another congests the connection");
+    check(queue.push(message { 10 }, 10).m_result == ws_send_result::dropped, "sends are dropped whilst congested");
+    check(write_all(queue), "congestion clears once the queue drains");
+    check(queue.push(message { 10 }, 10).m_result == ws_send_result::queued, "sends are queued again");
+}
+
+int main()
+{
+    oversized_when_idle(ws_backpressure_policy::drop);
+    oversized_when_idle(ws_backpressure_policy::coalesce);
+    oversized_when_idle(ws_backpressure_policy::disconnect);
+    oversized_when_busy();
+    
+    if (failures)
+        return EXIT_FAILURE;
+    
+    std::printf("ws_send_queue_test passed\n");
+    return EXIT_SUCCESS;
+}
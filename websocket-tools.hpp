@@ -10,4 +10,13 @@
 #include "civetweb/cw_ws_server.hpp"
 #include "civetweb/cw_ws_client.hpp"
 
+#include "loopback/lb_ws_server.hpp"
+#include "loopback/lb_ws_client.hpp"
+
+#include "common/ws_reconnecting_client.hpp"
+#include "common/ws_client_pool.hpp"
+#include "common/ws_replay.hpp"
+#include "common/ws_event_queue.hpp"
+#include "common/ws_coroutine.hpp"
+
 #endif /* WEBSOCKET_TOOLS_HPP */